@@ -0,0 +1,253 @@
+/*
+   budget.h
+
+   How much memory and time one statement may take, shared by count, count2
+   and qc.  A typo like 1000000000! or 9^9^9^9 used to allocate until the
+   machine ran out; now it is an error like any other:
+
+       1000000000!  ->  factorial: the result would need about 3393 MB, over
+                        the 1024 MB a statement may use (CALC_MAX_MEMORY)
+
+   Two lines of defence:
+     - before factorial, nCr, nPr or a power is built, check_result_bits()
+       compares an estimate of its size with the budget.  The estimates are
+       upper bounds from logarithms: log2 n! = lgamma(n+1)/ln 2 (Stirling),
+       C(n,k) <= (e n/k)^k, P(n,k) <= n^k, b^e has at most e * bits(b) bits.
+     - GMP's allocation functions are replaced (mp_set_memory_functions) and
+       count the bytes a statement holds; check_budget(), called in the loops
+       of the kernels and the parsers, fails once that is over the budget or
+       the deadline has passed.  This catches what has no estimate (a long
+       product, a huge sum of terms).  The allocation functions themselves
+       never throw: GMP does not promise anything when they do.  If malloc
+       fails they end the program with a message, as GMP would.
+
+   Every block GMP gets carries the number of the statement that allocated
+   it, and only that statement's frees and reallocations count: a value made
+   before the statement (x = ...) can be freed without giving it more room,
+   and a result a helper thread made can be freed on the statement's thread.
+
+   The budget comes from the environment:
+       CALC_MAX_MEMORY   megabytes per statement (1024 if not set, 0: no limit)
+       CALC_MAX_TIME     seconds per statement (no limit if not set)
+
+   A Statement_budget marks a statement: the outermost one in a thread starts
+   the count and the clock, nested ones (a function call, a formula) share
+   them.  Each statement has a count of its own, so a parallel batch or a
+   server keeps its statements apart.
+
+   The same checks stop a statement early on request: a thread may point
+   budget_state().stop at a flag, and once that is set the statement fails
+   with "interrupted" at its next check.  That is how ^C and the background
+   jobs of the REPLs work (see jobs.h).
+
+   The kernels of combinatorics.h put a statement's work on helper threads.
+   share_budget() gives a helper the statement's count, deadline and stop
+   flag, so all of them together get one budget, and cancel is a flag of the
+   kernel's: it is set when any of its threads fails, so the others give up
+   too instead of working on for nothing.
+*/
+
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include "std_lib_facilities.h"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <gmpxx.h>
+
+struct Budget {
+    size_t bytes;           // 0: no limit
+    double seconds;         // 0: no limit
+};
+
+inline Budget budget_from_environment()
+{
+    Budget b{size_t(1) << 30, 0};
+    if (const char* m = getenv("CALC_MAX_MEMORY")) b.bytes = size_t(atof(m) * (1 << 20));
+    if (const char* t = getenv("CALC_MAX_TIME")) b.seconds = atof(t);
+    return b;
+}
+
+inline const Budget& budget()
+{
+    static const Budget b = budget_from_environment();
+    return b;
+}
+
+struct Budget_state {       // of the statement running in this thread
+    int depth = 0;          // Statement_budgets alive
+    unsigned long long id = 0;          // of the statement, 0: none
+    atomic<long long>* used = nullptr;  // bytes it holds, shared with its helpers
+    chrono::steady_clock::time_point deadline;
+    const atomic<bool>* stop = nullptr;     // set: give up (^C, see jobs.h)
+    const atomic<bool>* cancel = nullptr;   // set: the kernel this helps failed
+};
+
+inline Budget_state& budget_state()
+{
+    thread_local Budget_state s;
+    return s;
+}
+
+inline string megabytes(double bytes)
+{
+    return to_string((long long)ceil(bytes / (1 << 20))) + " MB";
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+
+inline void check_budget()
+    // for loops that may run long: is the statement over its memory, past its
+    // deadline, or stopped?
+{
+    const Budget_state& s = budget_state();
+    if (s.depth == 0) return;
+    if ((s.stop && *s.stop) || (s.cancel && *s.cancel)) error("interrupted");
+    if (budget().bytes > 0 && *s.used > (long long)budget().bytes)
+        error("out of memory: a statement may use ",
+              megabytes(budget().bytes) + " (CALC_MAX_MEMORY)");
+    if (budget().seconds > 0 && chrono::steady_clock::now() > s.deadline) {
+        ostringstream os;
+        os << budget().seconds << " s (CALC_MAX_TIME)";
+        error("out of time: a statement may take ", os.str());
+    }
+}
+
+inline void check_result_bits(double bits, const string& what)
+    // about to build a number of (at most) that many bits
+{
+    size_t limit = budget().bytes;
+    if (limit == 0) return;
+    const Budget_state& s = budget_state();
+    double left = double(limit) - (s.depth > 0 ? max(s.used->load(), 0LL) : 0);
+    if (bits / 8 > left)
+        error(what, ": the result would need about " + megabytes(bits / 8) + ", over the "
+              + megabytes(limit) + " a statement may use (CALC_MAX_MEMORY)");
+}
+
+inline double factorial_bits(const mpz_class& n)
+{
+    double x = n.get_d();
+    return x < 2 ? 0 : lgamma(x + 1) / log(2.0);
+}
+
+inline double binomial_bits(const mpz_class& n, const mpz_class& k)
+    // C(n,k) <= (e n/m)^m, m = min(k, n-k)
+{
+    mpz_class j = n - k;
+    double m = min(k, j).get_d();
+    return m < 1 ? 0 : m * log2(M_E * n.get_d() / m);
+}
+
+inline double falling_bits(const mpz_class& n, const mpz_class& k)
+    // P(n,k) = n!/(n-k)! <= n^k
+{
+    if (2*k > n) return factorial_bits(n) - factorial_bits(n - k) + 64;
+    return k.get_d() * log2(max(n.get_d(), 1.0));
+}
+
+inline double power_bits(const mpz_class& b, const mpz_class& e)
+{
+    return e.get_d() * mpz_sizeinbase(b.get_mpz_t(), 2);
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+// GMP's memory: each block starts with the id of the statement that holds it
+
+const size_t budget_header = 16;    // keeps malloc's alignment
+
+inline unsigned long long& block_owner(void* block)
+{
+    return *static_cast<unsigned long long*>(block);
+}
+
+inline void* budget_out_of_memory(size_t n)
+{
+    fprintf(stderr, "out of memory: could not allocate %zu bytes\n", n);
+    abort();
+}
+
+inline void* budget_alloc(size_t n)
+{
+    void* b = malloc(n + budget_header);
+    if (!b) return budget_out_of_memory(n);
+    const Budget_state& s = budget_state();
+    block_owner(b) = s.depth > 0 ? s.id : 0;
+    if (block_owner(b)) *s.used += n;
+    return static_cast<char*>(b) + budget_header;
+}
+
+inline void* budget_realloc(void* p, size_t old, size_t n)
+{
+    void* b = realloc(static_cast<char*>(p) - budget_header, n + budget_header);
+    if (!b) return budget_out_of_memory(n);
+    const Budget_state& s = budget_state();
+    if (s.depth > 0 && block_owner(b) == s.id) *s.used += (long long)n - (long long)old;
+    else if (s.depth > 0) {             // from before: it is ours from now on
+        block_owner(b) = s.id;
+        *s.used += n;
+    }
+    return static_cast<char*>(b) + budget_header;
+}
+
+inline void budget_free(void* p, size_t n)
+{
+    void* b = static_cast<char*>(p) - budget_header;
+    const Budget_state& s = budget_state();
+    if (s.depth > 0 && block_owner(b) == s.id) *s.used -= n;
+    free(b);
+}
+
+inline bool install_budget()
+{
+    mp_set_memory_functions(budget_alloc, budget_realloc, budget_free);
+    return true;
+}
+
+inline const bool budget_installed = install_budget();     // before main()
+
+inline atomic<unsigned long long> statement_count { 0 };     // for the ids
+
+class Statement_budget {
+public:
+    Statement_budget()
+    {
+        Budget_state& s = budget_state();
+        if (s.depth++ > 0) return;
+        s.id = ++statement_count;
+        s.used = &used;
+        if (budget().seconds > 0)
+            s.deadline = chrono::steady_clock::now()
+                       + chrono::duration_cast<chrono::steady_clock::duration>(
+                             chrono::duration<double>(budget().seconds));
+    }
+    ~Statement_budget()
+    {
+        Budget_state& s = budget_state();
+        if (--s.depth > 0) return;
+        s.id = 0;
+        s.used = nullptr;
+    }
+    Statement_budget(const Statement_budget&) = delete;
+    Statement_budget& operator=(const Statement_budget&) = delete;
+
+private:
+    atomic<long long> used { 0 };   // of the outermost one
+};
+
+inline void share_budget(const Budget_state& from, const atomic<bool>* cancel)
+    // on a helper thread: count and fail like the statement whose state was from
+{
+    Budget_state& s = budget_state();
+    s.depth = from.depth > 0 ? 1 : 0;
+    s.id = from.id;
+    s.used = from.used;
+    s.deadline = from.deadline;
+    s.stop = from.stop;
+    s.cancel = cancel;
+}
+
+#endif // BUDGET_H
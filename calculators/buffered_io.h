@@ -0,0 +1,328 @@
+/*
+   buffered_io.h
+
+   Where count and qc read their statements from, and how their results
+   are written.
+
+   Input_buffer is the character half of their Token_streams: the Token
+   half (the Tokens put back, count's replayed function bodies, and get()
+   itself, which knows the Tokens of its calculator) derives from it.
+   Characters are scanned with a pointer from [p, end).  For a string or a
+   mapped file that is all the input there is; an istream or a file
+   descriptor is read a block at a time into block by refill(), so a batch
+   file of a million statements is neither read whole nor a character at a
+   time.  A statement ends at ';' or at a newline.
+
+   Output_buffer collects results in a large buffer that goes out with
+   write(), instead of through cout; put_result() writes one.  batch_files()
+   and batch_statements() are the loop of --batch, less what a statement
+   is, which each calculator passes in.
+*/
+
+#ifndef BUFFERED_IO_H
+#define BUFFERED_IO_H
+
+#include "std_lib_facilities.h"
+#include <cerrno>
+#include <cstring>
+#include <string_view>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "digits.h"      // put_integer(), scientific()
+
+class Input_buffer {
+public:
+    Input_buffer() : block(block_size) { close_source(); }   // no input until told
+    virtual ~Input_buffer() { close_source(); }
+    Input_buffer(const Input_buffer&) = delete;
+    Input_buffer& operator=(const Input_buffer&) = delete;
+
+    // where the characters come from (each one replaces the previous source)
+    void from_stream(istream& is);         // e.g. an ifstream or istringstream
+    void from_fd(int fd);                  // e.g. 0 for a pipe into standard input
+    void from_file(const string& path);    // memory-mapped, scanned in place
+    void from_string(string_view s);       // scanned in place, s must outlive us
+
+    string rest_of_line();      // the raw text up to the next ';' or newline
+    int line() const { return lines; }   // input line we are on (from 1)
+
+protected:
+    const char* p { nullptr };
+    const char* end { nullptr };
+    int lines { 1 };
+
+    bool refill(const char*& keep);
+    bool available(const char*& keep, size_t n);
+    void skip_past(char c);             // up to and including a c
+    bool take_background(string& s);    // the next statement, if it ends with '&'
+    virtual void new_source() { }       // the Tokens read ahead are stale
+
+private:
+    static const size_t block_size = 1 << 16;
+    vector<char> block;
+    istream* is { nullptr };
+    int fd { -1 };
+    void* map { nullptr };
+    size_t map_size { 0 };
+
+    void close_source();
+};
+
+inline void Input_buffer::close_source()
+{
+    if (map) munmap(map, map_size);
+    map = nullptr;
+    is = nullptr;
+    fd = -1;
+    p = end = block.data();
+    lines = 1;
+    new_source();
+}
+
+inline void Input_buffer::from_stream(istream& s)
+{
+    close_source();
+    is = &s;
+}
+
+inline void Input_buffer::from_fd(int f)
+{
+    close_source();
+    fd = f;
+}
+
+inline void Input_buffer::from_file(const string& path)
+{
+    close_source();
+    int f = open(path.c_str(), O_RDONLY);
+    if (f < 0) error("can't open input file ", path);
+    struct stat sb;
+    if (fstat(f, &sb) < 0) {
+        ::close(f);
+        error("can't stat input file ", path);
+    }
+    if (sb.st_size > 0) {
+        map = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, f, 0);
+        if (map == MAP_FAILED) {
+            map = nullptr;
+            ::close(f);
+            error("can't map input file ", path);
+        }
+        map_size = sb.st_size;
+        madvise(map, map_size, MADV_SEQUENTIAL);
+        p = static_cast<const char*>(map);
+        end = p + map_size;
+    }
+    ::close(f);         // the mapping stays valid without the descriptor
+}
+
+inline void Input_buffer::from_string(string_view s)
+{
+    close_source();
+    p = s.data();
+    end = p + s.size();
+}
+
+inline bool Input_buffer::refill(const char*& keep)
+    // move the unscanned [keep, end) to the front of block and read more after
+    // it; keep and p are moved along.  false if there is no more input
+{
+    if (!is && fd < 0) return false;            // strings and maps are complete
+
+    size_t kept = end - keep;
+    size_t scanned = p - keep;
+    memmove(block.data(), keep, kept);
+    // a huge token: grow the block only now, keep and p point into the old one
+    if (kept == block.size()) block.resize(2*block.size());
+    char* buf = block.data();
+    keep = buf;
+    p = buf + scanned;
+    end = buf + kept;
+
+    char* room = buf + kept;
+    size_t n = block.size() - kept;
+    ssize_t got = 0;
+    if (is) {
+        // readsome() only takes what is already there; block for one
+        // character only when it has nothing, so a terminal still works
+        got = is->readsome(room, n);
+        if (got == 0 && is->read(room, 1))
+            got = 1 + is->readsome(room+1, n-1);
+    }
+    else {
+        do got = read(fd, room, n); while (got < 0 && errno == EINTR);
+    }
+    if (got <= 0) return false;
+    end += got;
+    return true;
+}
+
+inline bool Input_buffer::available(const char*& keep, size_t n)
+    // are there at least n characters from p on?
+{
+    while (size_t(end - p) < n)
+        if (!refill(keep)) return false;
+    return true;
+}
+
+inline void Input_buffer::skip_past(char c)
+    // a newline ends a statement too
+{
+    while (p < end || refill(p)) {
+        char ch = *p++;
+        if (ch == '\n') ++lines;
+        if (ch == c || (c == ';' && ch == '\n')) return;
+    }
+}
+
+inline string Input_buffer::rest_of_line()
+    // for a file name, which is no Token; the ';' or newline stays put
+{
+    string s;
+    while ((p < end || refill(p)) && *p != ';' && *p != '\n') s += *p++;
+    size_t b = s.find_first_not_of(" \t\r");
+    if (b == string::npos) return "";
+    return s.substr(b, s.find_last_not_of(" \t\r") + 1 - b);
+}
+
+inline bool Input_buffer::take_background(string& s)
+    // is the next statement one to run as a job, "1000000! &"?  If so, take
+    // its text, without the '&', into s; if not, leave it to be scanned
+{
+    while ((p < end || refill(p)) && (isspace(*p) || *p == ';')) {
+        if (*p == '\n') ++lines;
+        ++p;
+    }
+    size_t n = 0;
+    while (available(p, n+1) && p[n] != ';' && p[n] != '\n') ++n;
+    size_t e = n;
+    while (e > 0 && isspace(p[e-1])) --e;
+    if (e == 0 || p[e-1] != '&') return false;
+    s.assign(p, e-1);
+    s.erase(s.find_last_not_of(" \t\r") + 1);
+    p += n;
+    return true;
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+
+enum class Format { both, exact, decimal };
+
+class Output_buffer {
+public:
+    explicit Output_buffer(int f) : fd{f} { buf.reserve(limit + 4096); }
+    Output_buffer() : fd{-1} { }    // kept in memory, see take()
+    ~Output_buffer() { try { flush(); } catch(...) { } }
+
+    void put(const char* s, size_t n) { buf.append(s, n); check(); }
+    void put(const string& s) { put(s.data(), s.size()); }
+    void put(char c) { buf += c; check(); }
+    char* room(size_t n);       // n chars at the end, shrink with used()
+    void used(char* s, size_t n) { buf.resize(s - &buf[0] + n); check(); }
+    void flush();
+    string take() { string s; s.swap(buf); return s; }    // what an in-memory buffer has
+
+private:
+    static const size_t limit = 1 << 20;
+    int fd;
+    string buf;
+    void check() { if (fd >= 0 && buf.size() >= limit) flush(); }
+};
+
+inline char* Output_buffer::room(size_t n)
+{
+    size_t old = buf.size();
+    buf.resize(old + n);
+    return &buf[old];
+}
+
+inline void Output_buffer::flush()
+{
+    if (fd < 0) return;
+    const char* s = buf.data();
+    size_t n = buf.size();
+    while (n > 0) {
+        ssize_t w = write(fd, s, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) error("can't write results");
+        s += w;
+        n -= w;
+    }
+    buf.clear();
+}
+
+inline void put_decimal(Output_buffer& out, double d)
+    // the way cout << d prints it
+{
+    char* s = out.room(32);
+    out.used(s, snprintf(s, 32, "%g", d));
+}
+
+template<class Number>
+void put_result(Output_buffer& out, const Number& x, Format f, const Digits_format& d)
+    // the calculator has put_exact(out, x, d), and integer_part(x) for
+    // a value too large for a double
+{
+    if (f != Format::decimal) put_exact(out, x, d);
+    if (f == Format::both) out.put(" = ", 3);
+    if (f != Format::exact) {
+        double v = x.get_d();
+        if (isinf(v)) out.put(scientific(integer_part(x)));
+        else put_decimal(out, v);
+    }
+    out.put('\n');
+}
+
+inline string error_line(int line, const exception& e)
+{
+    return "error: line " + to_string(line) + ": " + e.what() + '\n';
+}
+
+template<class Run>
+int batch_files(Input_buffer& in, const string& in_name, const string& out_name, Run run)
+    // read in_name and write out_name ("-" is standard input/output);
+    // run(out) does the statements and returns how many failed
+{
+    if (in_name != "-") in.from_file(in_name);
+    else in.from_fd(0);
+    int fd = 1;
+    if (out_name != "-") {
+        fd = open(out_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) error("can't open output file ", out_name);
+    }
+
+    int errors = 0;
+    {
+        Output_buffer out(fd);
+        errors = run(out);
+        out.flush();
+    }
+    if (fd != 1) ::close(fd);
+    return errors;
+}
+
+template<class Step, class Recover>
+int batch_statements(Input_buffer& in, Output_buffer& out, Step step, Recover recover)
+    // step(line) does the next statement, setting line to where it starts,
+    // and is false at the end of the input.  One that fails is answered
+    // with an error line, recover() skips the rest of it, and we go on.
+    // Returns how many failed
+{
+    int errors = 0;
+    while (true) {
+        int line = in.line();
+        try {
+            if (!step(line)) break;
+        }
+        catch(exception& e) {
+            ++errors;
+            out.put(error_line(line, e));
+            recover();
+        }
+    }
+    return errors;
+}
+
+#endif // BUFFERED_IO_H
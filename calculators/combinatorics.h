@@ -0,0 +1,507 @@
+/*
+   combinatorics.h
+
+   Big integer kernels for counting, shared by integer_calculator.cpp (count)
+   and rational_calculator.cpp (qc):
+
+       factorial(n)       n!  using GMP's mpz_fac_ui, with a cache of big results
+                          (split across threads for n in the millions)
+       product(a, b)      (a+1)*(a+2)*...*b  by binary splitting
+       binomial(n, k)     C(n,k) = n!/((n-k)! k!)  without computing any factorial
+       falling(n, k)      P(n,k) = n!/(n-k)! = n*(n-1)*...*(n-k+1)
+       prime_binomial(n, k)   C(n,k) for huge n from its prime factorization
+       small_factorial(n, r), small_binomial(n, k, r), small_falling(n, k, r)
+                          the same in a long, for results that fit in one
+
+   The first version of factorial() multiplied result *= n one step at a time:
+   n multiplications with an ever growing left operand, so 100000! took
+   minutes.  mpz_fac_ui() uses a prime-swing algorithm and balanced products,
+   which brings that down to milliseconds.
+
+   The kernels for huge arguments run on several threads, so build with
+   g++ -pthread -lgmpxx -lgmp
+*/
+
+#ifndef COMBINATORICS_H
+#define COMBINATORICS_H
+
+#include "std_lib_facilities.h"
+#include <map>
+#include <climits>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include <gmpxx.h>
+#include "budget.h"      // how big a result may get
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+
+inline mpz_class product(unsigned long a, unsigned long b)
+    // (a+1)*(a+2)*...*b, 1 for an empty range
+    // multiply the two halves so that the operands stay about the same size
+{
+    if (b <= a) return 1;
+    if (b - a <= 16) {
+        check_budget();
+        mpz_class r = a + 1;
+        for (unsigned long i = a + 2; i <= b; ++i) r *= i;
+        return r;
+    }
+    unsigned long m = a + (b - a)/2;
+    return product(a, m) * product(m, b);
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  Big products on several threads: split the range between the workers,
+    let each one build its part as a balanced tree, and then multiply the
+    parts pairwise.  Every round of that merge is done in parallel too, so the
+    huge multiplications at the top are not left to a single core.
+*/
+
+inline int worker_count()
+{
+    unsigned n = thread::hardware_concurrency();
+    return n == 0 ? 1 : n > 16 ? 16 : n;
+}
+
+/*  The threads of one kernel.  They work under the budget of the statement
+    that started them (see share_budget() in budget.h), and they are always
+    joined: a thread still joinable when its vector goes would end the whole
+    program through std::terminate, and check_budget() throws when the
+    budget runs out or ^C is pressed, on the caller's thread as on a worker.
+    The first failure is kept and thrown again by join(), the other threads
+    are cancelled.
+*/
+
+class Workers {
+public:
+    Workers() : from(budget_state()) { }
+    ~Workers();                         // cancels and joins what still runs
+    Workers(const Workers&) = delete;
+    Workers& operator=(const Workers&) = delete;
+
+    template<class F>
+    void start(F f);                    // f() on a new thread
+    void join();                        // wait for them all; throws the first failure
+
+private:
+    Budget_state from;                  // of the statement we work for
+    vector<thread> threads;
+    atomic<bool> cancel { false };
+    mutex guard;                        // for failure
+    exception_ptr failure;
+
+    void wait();
+};
+
+template<class F>
+void Workers::start(F f)
+{
+    threads.emplace_back([this, f] {
+        share_budget(from, &cancel);
+        try {
+            f();
+        }
+        catch (...) {
+            lock_guard<mutex> held(guard);
+            if (!failure) failure = current_exception();
+            cancel = true;
+        }
+    });
+}
+
+inline void Workers::wait()
+{
+    for (thread& t : threads)
+        if (t.joinable()) t.join();
+}
+
+inline void Workers::join()
+{
+    wait();
+    if (failure) rethrow_exception(failure);
+}
+
+inline Workers::~Workers()
+{
+    cancel = true;
+    wait();
+}
+
+inline mpz_class parallel_product(vector<mpz_class> parts)
+    // multiply the parts pairwise, each round's multiplications in parallel
+{
+    if (parts.empty()) return 1;
+    while (parts.size() > 1) {
+        check_budget();
+        size_t half = parts.size()/2;
+        Workers workers;
+        for (size_t i = 1; i < half; ++i)
+            workers.start([&parts, i, half] { parts[i] *= parts[i+half]; });
+        parts[0] *= parts[half];
+        workers.join();
+        if (parts.size() % 2) parts[half] = parts.back();   // odd one out
+        parts.resize(parts.size() - half);
+    }
+    return parts[0];
+}
+
+// ranges shorter than this are not worth the threads
+const unsigned long parallel_min_range = 1ul << 20;
+
+inline mpz_class parallel_range_product(unsigned long a, unsigned long b)
+    // product(a, b) split over worker_count() threads
+{
+    int threads = worker_count();
+    if (threads == 1 || b - a < parallel_min_range) return product(a, b);
+
+    unsigned long chunk = (b - a)/threads + 1;
+    vector<mpz_class> parts(threads);
+    Workers workers;
+    for (int i = 0; i < threads; ++i) {
+        unsigned long lo = a + i*chunk;
+        unsigned long hi = min(b, lo + chunk);
+        workers.start([&parts, i, lo, hi] { parts[i] = product(lo, hi); });
+    }
+    workers.join();
+    return parallel_product(parts);
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  Factorials that are expensive to compute are remembered, so that a script
+    using 5000! on every line pays for it once.  A new n! is built from the
+    nearest cached m! below it when n is close enough (m! * product(m, n)),
+    otherwise it is computed from scratch.  Small factorials are cheaper
+    to recompute than to look up and are never cached.  When the cache grows
+    past its budget the least recently used entries are dropped.
+    There is one cache for all the Calculators of a process, so it is
+    locked, but never while a factorial is being multiplied out.
+*/
+
+inline mpz_class compute_factorial(unsigned long n)
+    // mpz_fac_ui is the fastest on one core; with several cores and a big
+    // n the plain product 1*2*...*n split across threads beats it
+{
+    mpz_class r;
+    if (n >= parallel_min_range && worker_count() > 1)
+        r = parallel_range_product(0, n);
+    else
+        mpz_fac_ui(r.get_mpz_t(), n);
+    return r;
+}
+
+class Factorial_cache {
+public:
+    mpz_class get(unsigned long n);
+    void clear() { lock_guard<mutex> held(guard); table.clear(); recent.clear(); bytes = 0; }
+
+    static const unsigned long min_cached = 1000;    // cheaper to recompute below this
+    static const size_t max_bytes = size_t(64) << 20;
+
+private:
+    struct Entry {
+        mpz_class value;
+        list<unsigned long>::iterator place;    // in recent
+    };
+    map<unsigned long, Entry> table;
+    list<unsigned long> recent;     // the keys of table, most recently used first
+    size_t bytes { 0 };
+    mutex guard;                // for all of the above
+
+    void use(Entry& e) { recent.splice(recent.begin(), recent, e.place); }
+    void insert(unsigned long n, const mpz_class& v);
+};
+
+inline mpz_class Factorial_cache::get(unsigned long n)
+{
+    mpz_class r;
+    if (n < min_cached) {
+        mpz_fac_ui(r.get_mpz_t(), n);
+        return r;
+    }
+
+    unique_lock<mutex> held(guard);
+    auto p = table.upper_bound(n);      // first m > n
+    if (p != table.begin()) {
+        --p;                            // largest m <= n
+        unsigned long m = p->first;
+        if (m == n) {
+            use(p->second);
+            return p->second.value;
+        }
+        if (n - m <= n/8) {             // a short product finishes the job
+            use(p->second);
+            mpz_class start = p->second.value;
+            held.unlock();
+            r = start * parallel_range_product(m, n);
+            held.lock();
+            insert(n, r);
+            return r;
+        }
+    }
+    held.unlock();
+    r = compute_factorial(n);
+    held.lock();
+    insert(n, r);
+    return r;
+}
+
+inline void Factorial_cache::insert(unsigned long n, const mpz_class& v)
+    // with guard held; another thread may have put n in while we worked
+{
+    size_t size = mpz_size(v.get_mpz_t()) * sizeof(mp_limb_t);
+    if (size > max_bytes || table.count(n)) return;
+    while (bytes + size > max_bytes && !recent.empty()) {
+        auto lru = table.find(recent.back());
+        bytes -= mpz_size(lru->second.value.get_mpz_t()) * sizeof(mp_limb_t);
+        recent.pop_back();
+        table.erase(lru);
+    }
+    recent.push_front(n);
+    table[n] = Entry{v, recent.begin()};
+    bytes += size;
+}
+
+inline Factorial_cache& factorial_cache()
+{
+    static Factorial_cache cache;
+    return cache;
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+
+inline mpz_class factorial(const mpz_class& n)
+{
+    if (n < 0) error("factorial: negative value");
+    if (!n.fits_ulong_p()) error("factorial: value too large");
+    check_result_bits(factorial_bits(n), "factorial");
+    return factorial_cache().get(n.get_ui());
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  nCr and nPr used to be n!/((n-k)! k!) and n!/(n-k)!: three (or two) huge
+    factorials, most of which was divided away again.  Now:
+        C(n,k)  comes from mpz_bin_ui on the smaller of k and n-k
+                (or from prime_binomial() below when n and k are huge)
+        P(n,k)  is the falling product n*(n-1)*...*(n-k+1), multiplied as a
+                balanced tree, so the work is in numbers the size of the result
+    Both are 0 when k < 0 or k > n.
+*/
+
+inline mpz_class falling_product(const mpz_class& n, unsigned long a, unsigned long b)
+    // (n-a)*(n-a-1)*...*(n-b+1), for an n too big for an unsigned long
+{
+    if (b <= a) return 1;
+    if (b - a <= 16) {
+        check_budget();
+        mpz_class r = n - a;
+        for (unsigned long i = a + 1; i < b; ++i) r *= n - i;
+        return r;
+    }
+    unsigned long m = a + (b - a)/2;
+    return falling_product(n, a, m) * falling_product(n, m, b);
+}
+
+inline mpz_class falling(const mpz_class& n, const mpz_class& k)
+{
+    if (n < 0) error("nPr: negative n");
+    if (k < 0 || k > n) return 0;
+    if (!k.fits_ulong_p()) error("nPr: value too large");
+    check_result_bits(falling_bits(n, k), "nPr");
+    unsigned long kk = k.get_ui();
+    if (n.fits_ulong_p()) {
+        unsigned long nn = n.get_ui();
+        return parallel_range_product(nn - kk, nn);
+    }
+    return falling_product(n, 0, kk);
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  For C(n,k) with n in the millions or billions even a falling product is
+    slow.  Instead we find the prime factorization of C(n,k) directly:
+    a prime p divides C(n,k) exactly e times, where e is the number of borrows
+    when k is subtracted from n in base p (Kummer; Legendre's formula counted
+    another way), and no prime above n divides it at all.  So we sieve the
+    primes up to n a segment at a time, pack the prime powers into machine
+    words and multiply the words together as a balanced tree.  The range of
+    primes is split between threads and their partial products are then
+    multiplied pairwise, also in parallel.
+*/
+
+inline mpz_class word_product(const vector<unsigned long>& w, size_t a, size_t b)
+    // w[a]*w[a+1]*...*w[b-1] as a balanced tree
+{
+    if (b <= a) return 1;
+    if (b - a <= 8) {
+        check_budget();
+        mpz_class r = w[a];
+        for (size_t i = a + 1; i < b; ++i) r *= w[i];
+        return r;
+    }
+    size_t m = a + (b - a)/2;
+    return word_product(w, a, m) * word_product(w, m, b);
+}
+
+inline vector<unsigned long> primes_upto(unsigned long limit)
+    // plain sieve of Eratosthenes, for the sieving primes (up to sqrt(n))
+{
+    vector<char> composite(limit + 1, 0);
+    vector<unsigned long> primes;
+    for (unsigned long i = 2; i <= limit; ++i) {
+        if (composite[i]) continue;
+        primes.push_back(i);
+        for (unsigned long j = i*i; j <= limit; j += i) composite[j] = 1;
+    }
+    return primes;
+}
+
+inline unsigned kummer(unsigned long n, unsigned long k, unsigned long p)
+    // exponent of p in C(n,k): the number of borrows in n - k in base p
+{
+    unsigned e = 0;
+    unsigned long borrow = 0;
+    while (n > 0) {
+        unsigned long b = k % p + borrow;
+        borrow = (n % p < b);
+        e += borrow;
+        n /= p;
+        k /= p;
+    }
+    return e;
+}
+
+inline mpz_class prime_power_product(unsigned long n, unsigned long k,
+                                     unsigned long lo, unsigned long hi,
+                                     const vector<unsigned long>& base)
+    // product of p^e for the primes p in [lo, hi), e = kummer(n, k, p);
+    // base holds the primes up to sqrt(hi) for the segmented sieve
+{
+    const unsigned long segment = 1 << 18;
+    vector<char> composite(segment);
+    vector<unsigned long> words;
+    unsigned long w = 1;
+    for (unsigned long s = lo; s < hi; s += segment) {
+        unsigned long t = min(hi, s + segment);
+        check_budget();
+        fill(composite.begin(), composite.end(), 0);
+        for (unsigned long p : base) {
+            if (p*p >= t) break;
+            unsigned long j = max(p*p, (s + p - 1)/p*p);
+            for (; j < t; j += p) composite[j - s] = 1;
+        }
+        for (unsigned long p = max(s, 2ul); p < t; ++p) {
+            if (composite[p - s]) continue;
+            for (unsigned e = kummer(n, k, p); e > 0; --e) {
+                if (w > ULONG_MAX / p) {
+                    words.push_back(w);
+                    w = 1;
+                }
+                w *= p;
+            }
+        }
+    }
+    words.push_back(w);
+    return word_product(words, 0, words.size());
+}
+
+inline mpz_class prime_binomial(unsigned long n, unsigned long k)
+{
+    if (k > n) return 0;
+    vector<unsigned long> base = primes_upto(sqrt(double(n)) + 1);
+
+    // equal ranges of n have about the same number of primes
+    int threads = n < (1ul << 20) ? 1 : worker_count();
+    unsigned long chunk = n/threads + 1;
+    vector<mpz_class> parts(threads);
+    Workers workers;
+    for (int i = 0; i < threads; ++i) {
+        unsigned long lo = i*chunk;
+        unsigned long hi = min(n + 1, lo + chunk);
+        workers.start([&parts, &base, i, n, k, lo, hi] {
+            parts[i] = prime_power_product(n, k, lo, hi, base);
+        });
+    }
+    workers.join();
+    return parallel_product(parts);
+}
+
+// prime_binomial() sieves all of [2, n], so it only pays off when k is a fair
+// share of n: mpz_bin_uiui is as fast below these (GMP factors big binomials
+// too, on one thread), and much faster for a small k and a huge n, like
+// nCr(1000000000000, 20000) in 0.1 s, where the sieve would not finish
+const unsigned long prime_binomial_min_n = 1ul << 20;
+const unsigned long prime_binomial_max_n = 1ul << 30;
+const unsigned long prime_binomial_min_k = 1ul << 14;
+const unsigned long prime_binomial_share = 512;     // k >= n/512
+
+inline mpz_class binomial(const mpz_class& n, const mpz_class& k)
+{
+    if (n < 0) error("nCr: negative n");
+    if (k < 0 || k > n) return 0;
+    mpz_class j = n - k;
+    const mpz_class& m = j < k ? j : k;     // C(n,k) == C(n,n-k)
+    if (!m.fits_ulong_p()) error("nCr: value too large");
+    check_result_bits(binomial_bits(n, k), "nCr");
+    mpz_class r;
+    if (n.fits_ulong_p()) {
+        unsigned long nn = n.get_ui();
+        unsigned long mm = m.get_ui();
+        if (nn >= prime_binomial_min_n && nn <= prime_binomial_max_n
+            && mm >= prime_binomial_min_k && mm >= nn / prime_binomial_share)
+            return prime_binomial(nn, mm);
+        mpz_bin_uiui(r.get_mpz_t(), n.get_ui(), m.get_ui());
+    }
+    else
+        mpz_bin_ui(r.get_mpz_t(), n.get_mpz_t(), m.get_ui());
+    return r;
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  Most of what we are asked fits in a long: 5!, nCr(52,5), nPr(10,3).
+    These set r and return true when the result fits, and return false
+    (leaving the work, and the error messages, to the mpz versions above)
+    when it does not.
+*/
+
+inline bool small_factorial(long n, long& r)
+{
+    if (n < 0 || n > 20) return false;      // 21! > LONG_MAX
+    r = 1;
+    for (long i = 2; i <= n; ++i) r *= i;
+    return true;
+}
+
+inline bool small_binomial(long n, long k, long& r)
+    // C(n,i+1) = C(n,i)*(n-i)/(i+1), every partial result is a binomial,
+    // so the division is exact; it overflows after a few dozen steps at most
+{
+    if (n < 0) return false;
+    if (k < 0 || k > n) {
+        r = 0;
+        return true;
+    }
+    if (k > n - k) k = n - k;
+    unsigned __int128 c = 1;
+    for (long i = 0; i < k; ++i) {
+        c = c * (n - i) / (i + 1);
+        if (c > LONG_MAX) return false;
+    }
+    r = c;
+    return true;
+}
+
+inline bool small_falling(long n, long k, long& r)
+{
+    if (n < 0) return false;
+    if (k < 0 || k > n) {
+        r = 0;
+        return true;
+    }
+    r = 1;
+    for (long i = 0; i < k; ++i)
+        if (__builtin_mul_overflow(r, n - i, &r)) return false;
+    return true;
+}
+
+#endif // COMBINATORICS_H
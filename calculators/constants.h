@@ -0,0 +1,295 @@
+/*
+   constants.h
+
+   pi, e, ln 2 and ln 10 to as many digits as you like, shared by
+   integer_calculator.cpp (count) and rational_calculator.cpp (qc):
+
+       constant_digits(c, n)   floor(c * 10^n), so for pi and n = 5: 314159
+       constant_named(s, c)    is s "pi", "e", "ln2" or "ln10"?
+
+   Each constant is a series summed by binary splitting: the terms are
+   combined as a balanced tree of big integer products, never one at a time.
+       pi     Chudnovsky, about 14 digits a term
+       e      1/0! + 1/1! + 1/2! + ...
+       ln 2   2 atanh(1/3)
+       ln 10  3 ln 2 + 2 atanh(1/9)
+   We work with guard_digits more than asked for and cut them off at the end.
+
+   Results are kept in memory: asking for fewer digits than we already have
+   only truncates.  If the environment variable CALC_CACHE names a directory,
+   they are also kept there (one file per constant: a line "pi 1000", then the
+   value written with mpz_out_raw) so that the next run does not compute them
+   again.  A file is written under a name of its own (mkstemp) and renamed
+   into place, so two calculators saving at once don't mix their bytes, and
+   one is only believed if it holds the right constant to the digits it
+   claims: a wrong value would be a wrong answer, with no error to warn us.
+   The cache is shared by every Calculator in the process and locked while a
+   constant is computed.
+
+   The names don't take a variable's name away: "let e = 2" is fine, and
+   then e is the variable and e(5) the constant (see primary()).
+*/
+
+#ifndef CONSTANTS_H
+#define CONSTANTS_H
+
+#include "std_lib_facilities.h"
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <gmpxx.h>
+
+enum class Constant { pi, e, ln2, ln10 };
+
+inline string constant_name(Constant c)
+{
+    switch (c) {
+        case Constant::pi:   return "pi";
+        case Constant::e:    return "e";
+        case Constant::ln2:  return "ln2";
+        case Constant::ln10: return "ln10";
+    }
+    return "?";
+}
+
+inline bool constant_named(const string& s, Constant& c)
+{
+    for (Constant k : { Constant::pi, Constant::e, Constant::ln2, Constant::ln10 })
+        if (s == constant_name(k)) {
+            c = k;
+            return true;
+        }
+    return false;
+}
+
+const unsigned long guard_digits = 16;
+const unsigned long max_constant_digits = 100000000;
+
+inline mpz_class power_of_10(unsigned long n)
+{
+    mpz_class r;
+    mpz_ui_pow_ui(r.get_mpz_t(), 10, n);
+    return r;
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  Chudnovsky:
+        1/pi = 12 sum (-1)^k (6k)! (13591409 + 545140134 k) / ((3k)! (k!)^3 640320^(3k+3/2))
+    For the terms [a, b), with the ratio of term k to term k-1 = p(k)/q(k):
+        P = p(a)...p(b-1),  Q = q(a)...q(b-1),
+        T = the sum of the terms times Q (see series() in rational_calculator.cpp)
+    and then pi = 426880 sqrt(10005) Q / (13591409 Q + T) over [1, n).
+*/
+
+struct Split {
+    mpz_class p;
+    mpz_class q;
+    mpz_class t;
+};
+
+inline Split chudnovsky(unsigned long a, unsigned long b)
+{
+    if (b - a == 1) {
+        Split s;
+        s.p = mpz_class(6*a - 5) * (2*a - 1) * (6*a - 1);
+        s.p = -s.p;
+        s.q = mpz_class(a) * a * a * 10939058860032000ul;    // 640320^3 / 24
+        s.t = s.p * (13591409 + mpz_class(545140134) * a);
+        return s;
+    }
+    unsigned long m = a + (b - a)/2;
+    Split x = chudnovsky(a, m);
+    Split y = chudnovsky(m, b);
+    Split s;
+    s.t = x.t*y.q + x.p*y.t;
+    s.p = x.p*y.p;
+    s.q = x.q*y.q;
+    return s;
+}
+
+inline mpz_class compute_pi(unsigned long digits)
+    // floor(pi * 10^digits), digits includes the guard digits
+{
+    unsigned long n = digits/14 + 2;        // each term gives 14.18 digits
+    Split s = chudnovsky(1, n);
+    mpz_class root = sqrt(10005 * power_of_10(2*digits));    // sqrt(10005) * 10^digits
+    return 426880 * root * s.q / (13591409 * s.q + s.t);
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+// e = 1 + T/Q with T/Q = 1/1! + 1/2! + ... + 1/(n-1)!
+
+inline Split e_series(unsigned long a, unsigned long b)
+    // Q = a(a+1)...(b-1), T/Q = 1/a + 1/(a(a+1)) + ... (p is not needed)
+{
+    if (b - a == 1) return Split{1, a, 1};
+    unsigned long m = a + (b - a)/2;
+    Split x = e_series(a, m);
+    Split y = e_series(m, b);
+    return Split{1, x.q*y.q, x.t*y.q + y.t};
+}
+
+inline mpz_class compute_e(unsigned long digits)
+{
+    double logf = 0;                        // log10(n!)
+    unsigned long n = 1;
+    while (logf <= digits + 1) logf += log10(double(++n));
+    Split s = e_series(1, n + 1);
+    return (s.q + s.t) * power_of_10(digits) / s.q;
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  atanh(1/x) = 1/x + 1/(3 x^3) + 1/(5 x^5) + ...
+    Term k is 1/(2k+1) times 1/(q(0)...q(k)) with q(0) = x and q(k) = x^2, so
+    here the tree also multiplies up B = (2a+1)...(2b-1) and the sum over
+    [a, b) is T/(B Q):
+        leaf k:  Q = q(k), B = 2k+1, T = 1
+        [a,m) + [m,b):  Q = Q1*Q2, B = B1*B2, T = T1*B2*Q2 + T2*B1
+*/
+
+struct Split_b {
+    mpz_class q;
+    mpz_class b;
+    mpz_class t;
+};
+
+inline Split_b atanh_series(unsigned long x, unsigned long a, unsigned long b)
+{
+    if (b - a == 1) return Split_b{a == 0 ? mpz_class(x) : mpz_class(x) * x, 2*a + 1, 1};
+    unsigned long m = a + (b - a)/2;
+    Split_b l = atanh_series(x, a, m);
+    Split_b r = atanh_series(x, m, b);
+    return Split_b{l.q*r.q, l.b*r.b, l.t*r.b*r.q + r.t*l.b};
+}
+
+inline mpz_class atanh_inverse(unsigned long x, unsigned long digits)
+    // floor(atanh(1/x) * 10^digits)
+{
+    unsigned long n = digits / (2*log10(double(x))) + 2;
+    Split_b s = atanh_series(x, 0, n);
+    return s.t * power_of_10(digits) / (s.b * s.q);
+}
+
+inline mpz_class compute_constant(Constant c, unsigned long digits)
+{
+    switch (c) {
+        case Constant::pi:   return compute_pi(digits);
+        case Constant::e:    return compute_e(digits);
+        case Constant::ln2:  return 2 * atanh_inverse(3, digits);
+        case Constant::ln10: return 6 * atanh_inverse(3, digits) + 2 * atanh_inverse(9, digits);
+    }
+    return 0;
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+
+class Constant_cache {
+public:
+    mpz_class get(Constant c, unsigned long digits);     // floor(c * 10^digits)
+
+private:
+    struct Entry {
+        bool known = false;
+        unsigned long digits = 0;
+        mpz_class value;                // floor(c * 10^digits)
+    };
+    map<Constant, Entry> entries;
+    mutex guard;
+
+    string dir();                       // "" without CALC_CACHE
+    void load(Constant c, Entry& e);
+    void save(Constant c, const Entry& e);
+};
+
+inline mpz_class Constant_cache::get(Constant c, unsigned long digits)
+{
+    if (digits > max_constant_digits)
+        error(constant_name(c), ": too many digits");
+    lock_guard<mutex> held(guard);
+    Entry& e = entries[c];
+    if (!e.known || e.digits < digits) load(c, e);
+    if (!e.known || e.digits < digits) {
+        e.value = compute_constant(c, digits + guard_digits) / power_of_10(guard_digits);
+        e.known = true;
+        e.digits = digits;
+        save(c, e);
+    }
+    if (e.digits == digits) return e.value;
+    return e.value / power_of_10(e.digits - digits);     // truncate, all positive
+}
+
+inline string Constant_cache::dir()
+{
+    const char* d = getenv("CALC_CACHE");
+    return d ? d : "";
+}
+
+const unsigned long checked_digits = 30;   // load() recomputes this many
+
+inline void Constant_cache::load(Constant c, Entry& e)
+    // take what the cache file has, if it is more than we have and it is
+    // what it says it is: the right name, no more than max_constant_digits,
+    // nothing after the value, and the value has the first checked_digits
+    // digits of c and no more or fewer digits than it should
+{
+    string d = dir();
+    if (d.empty()) return;
+    string name = constant_name(c);
+    FILE* f = fopen((d + "/" + name + ".mpz").c_str(), "rb");
+    if (!f) return;
+    char stored[8] = "";
+    unsigned long digits = 0;
+    mpz_class v;
+    bool ok = fscanf(f, "%7s %lu", stored, &digits) == 2 && fgetc(f) == '\n'
+        && stored == name && digits <= max_constant_digits
+        && (!e.known || digits > e.digits)
+        && mpz_inp_raw(v.get_mpz_t(), f) != 0 && fgetc(f) == EOF;
+    fclose(f);
+    if (!ok) return;
+    unsigned long k = min(digits, checked_digits);
+    mpz_class first = compute_constant(c, k + guard_digits) / power_of_10(guard_digits);
+    if (v / power_of_10(digits - k) != first || v < 0) return;
+    e.known = true;
+    e.digits = digits;
+    e.value = v;
+}
+
+inline void Constant_cache::save(Constant c, const Entry& e)
+    // write a new file and rename it over the old one, so that a reader
+    // never sees half a file; a cache we can't write is no error
+{
+    string d = dir();
+    if (d.empty()) return;
+    string name = constant_name(c);
+    string tmp = d + "/" + name + ".XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0) return;
+    fchmod(fd, 0644);               // mkstemp makes it 0600, but it is no secret
+    FILE* f = fdopen(fd, "wb");
+    if (!f) {
+        close(fd);
+        remove(tmp.c_str());
+        return;
+    }
+    bool ok = fprintf(f, "%s %lu\n", name.c_str(), e.digits) > 0
+        && mpz_out_raw(f, e.value.get_mpz_t()) != 0;
+    ok = fclose(f) == 0 && ok;
+    if (ok) ok = rename(tmp.c_str(), (d + "/" + name + ".mpz").c_str()) == 0;
+    if (!ok) remove(tmp.c_str());
+}
+
+inline Constant_cache& constant_cache()
+{
+    static Constant_cache cache;
+    return cache;
+}
+
+inline mpz_class constant_digits(Constant c, unsigned long digits)
+{
+    return constant_cache().get(c, digits);
+}
+
+#endif // CONSTANTS_H
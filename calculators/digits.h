@@ -0,0 +1,143 @@
+/*
+   digits.h
+
+   Printing big integers, shared by integer_calculator.cpp (count) and
+   rational_calculator.cpp (qc).  200000! has 973351 digits: building that
+   string and sending it to a terminal takes longer than computing it, so
+   a result can also be shown as
+
+       digits count      (973351 digits)
+       digits N          the first N and the last N digits, when there are
+                         more than 2N:  12024...00000 (973351 digits)
+       digits all        every digit
+
+   Neither the count nor the ends need the full decimal string: the count
+   comes from mpz_sizeinbase (which may be one too many, so we check against
+   a power of 10), the first digits from one division and the last from one
+   remainder.
+
+   write_decimal() writes every digit, converting divide-and-conquer style:
+   x = hi * 10^m + lo with m = leaf_digits * 2^i, so the multiplications stay
+   balanced (subquadratic with GMP's fast division), and the digits come out
+   a leaf at a time, most significant first, so they can be streamed into a
+   file instead of being built up as one string.
+
+   "Out" is anything with put(const char* s, size_t n), like Output_buffer.
+*/
+
+#ifndef DIGITS_H
+#define DIGITS_H
+
+#include "std_lib_facilities.h"
+#include <gmpxx.h>
+
+enum class Digits_mode { all, count, ends };
+
+struct Digits_format {
+    Digits_mode mode = Digits_mode::all;
+    size_t n = 0;                   // for ends
+};
+
+const size_t leaf_digits = 1 << 12;
+
+inline mpz_class ten_to(size_t n)
+{
+    mpz_class r;
+    mpz_ui_pow_ui(r.get_mpz_t(), 10, n);
+    return r;
+}
+
+inline size_t digit_count(const mpz_class& x)
+    // the number of decimal digits of |x| (1 for 0)
+{
+    size_t k = mpz_sizeinbase(x.get_mpz_t(), 10);      // exact or one too many
+    if (k > 1 && mpz_cmpabs(x.get_mpz_t(), ten_to(k-1).get_mpz_t()) < 0) --k;
+    return k;
+}
+
+inline string first_digits(const mpz_class& x, size_t n)
+    // the leading n digits of |x|, or all of them if there are fewer
+{
+    mpz_class a = abs(x);
+    size_t k = digit_count(a);
+    if (k > n) a /= ten_to(k - n);
+    return a.get_str();
+}
+
+inline string last_digits(const mpz_class& x, size_t n)
+    // the trailing n digits of |x|, zeros included
+{
+    mpz_class a = abs(x) % ten_to(n);
+    string s = a.get_str();
+    if (s.size() < n) s.insert(0, n - s.size(), '0');
+    return s;
+}
+
+inline string scientific(const mpz_class& x)
+    // like %g for an integer too big for a double: 1.20242e+973350
+    // (the digits are cut off, not rounded)
+{
+    string d = first_digits(x, 6);
+    string s = x < 0 ? "-" : "";
+    s += d[0];
+    size_t last = d.find_last_not_of('0');
+    if (last != string::npos && last > 0) s += '.' + d.substr(1, last);
+    return s + "e+" + to_string(digit_count(x) - 1);
+}
+
+template<class Out>
+void write_padded(Out& out, const mpz_class& x, size_t width, vector<mpz_class>& pow)
+    // x >= 0 in exactly width digits, with leading zeros;
+    // pow[i] = 10^(leaf_digits * 2^i), computed when first needed
+{
+    if (width <= leaf_digits) {
+        string s = x.get_str();
+        if (s.size() < width) {
+            string zeros(width - s.size(), '0');
+            out.put(zeros.data(), zeros.size());
+        }
+        out.put(s.data(), s.size());
+        return;
+    }
+    size_t i = 0;
+    while ((leaf_digits << (i+1)) < width) ++i;    // leaf*2^i < width <= leaf*2^(i+1)
+    if (pow.empty()) pow.push_back(ten_to(leaf_digits));
+    while (pow.size() <= i) pow.push_back(pow.back() * pow.back());
+    size_t low = leaf_digits << i;
+    mpz_class hi, lo;
+    mpz_tdiv_qr(hi.get_mpz_t(), lo.get_mpz_t(), x.get_mpz_t(), pow[i].get_mpz_t());
+    write_padded(out, hi, width - low, pow);
+    write_padded(out, lo, low, pow);
+}
+
+template<class Out>
+void write_decimal(Out& out, const mpz_class& x)
+    // every digit of x
+{
+    if (x < 0) out.put("-", 1);
+    mpz_class a = abs(x);
+    vector<mpz_class> pow;
+    write_padded(out, a, digit_count(a), pow);
+}
+
+template<class Out>
+void put_integer(Out& out, const mpz_class& x, const Digits_format& f)
+    // x as f says
+{
+    if (f.mode == Digits_mode::all) {
+        write_decimal(out, x);
+        return;
+    }
+    size_t k = digit_count(x);
+    if (f.mode == Digits_mode::ends && k <= 2*f.n) {
+        write_decimal(out, x);
+        return;
+    }
+    string s = x < 0 ? "-" : "";
+    if (f.mode == Digits_mode::ends)
+        s += first_digits(x, f.n) + "..." + last_digits(x, f.n) + ' ';
+    s += '(' + to_string(k) + " digits)";
+    out.put(s.data(), s.size());
+}
+
+#endif // DIGITS_H
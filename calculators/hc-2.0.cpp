@@ -93,6 +93,8 @@
 
 
 #include "std_lib_facilities.h"
+#include <string_view>
+#include "symbol_table.h"   // variables: names interned to slots
 
 // SYMBOLIC CONSTANTS
 const char number = '8';
@@ -137,6 +139,10 @@ public:
 
 class Token_stream {
 public:
+    Token_stream() { }                          // no input until told
+    explicit Token_stream(istream& s) : is{&s} { }
+    void from_stream(istream& s) { is = &s; full = false; }
+
     Token get();                // get a Token
     void putback(Token t);      // put a token back
     void ignore(char c);   // discard characters up to and including a c
@@ -145,6 +151,7 @@ private:
     bool full { false };   // is there a Token in the buffer?
     Token buffer {' '};    // here is where putback() stores a Token
                      // put back using putback()
+    istream* is { nullptr };   // where the characters come from (it used to be cin)
 };
 
 
@@ -160,7 +167,7 @@ void Token_stream::ignore(char c)
 
   // now search input
   char ch = 0;
-  while (cin >> ch)
+  while (is && *is >> ch)
       if (ch == c) return;
  }
 
@@ -181,10 +188,10 @@ Token Token_stream::get()
 
     char ch;
     //cin >> ch;              // note that >> skips whitespace
-    cin.get(ch);    // note that cin.get() does NOT skip whitespace
+    if (!is || !is->get(ch)) return Token(quit);    // get() does NOT skip whitespace
     while (isspace(ch)) {
        if (ch == '\n') return Token(print); // if newline detected,
-       cin.get(ch);                         // return print Token
+       if (!is->get(ch)) return Token(quit);  // return print Token
     }
 
     switch (ch) {
@@ -212,20 +219,20 @@ Token Token_stream::get()
         case '0': case '1': case '2': case '3': case '4':
         case '5': case '6': case '7': case '8': case '9':
             {
-                cin.putback(ch);    // put digit back into input stream
+                is->putback(ch);    // put digit back into input stream
                 double val;
-                cin >> val;
+                *is >> val;
                 return Token { number, val };  // let '8' represent a number
             }
         default:
             if (isalpha(ch)) {  // if it is a letter
                 string s;
                 s += ch;  // Put the letter in 's' because it has been already read
-                while (cin.get(ch) &&
+                while (is->get(ch) &&
                         ((isalpha(ch) || isdigit(ch) || ch == '_'))
                       )
                       s += ch;     // Continue to read in 's'
-               cin.putback(ch);    // Return the character into the stream
+               if (*is) is->putback(ch);    // Return the character into the stream
                if (s == declkey) return Token{let};    // declaration keyword
                else if (s == constkey) return Token{constant};
                else if (s == sqrtkey) return Token{square_root};
@@ -250,89 +257,60 @@ Token Token_stream::get()
 */
 // * * * *
 
-class Variable {
-public:
-    string name;
-    double value;
-    bool constant;
-    Variable(string n, double v, bool c = false)
-        : name{n}, value{v}, constant{c} { }
-};
-
-class Symbol_table {
-    vector<Variable> var_table;
-public:
-    bool is_declared(string);
-    double get(string);
-    double set(string, double);
-    double declare(string, double, bool con = false);
-};
-
-bool Symbol_table::is_declared(string var)
-    // is var already in var_table?
-{
-    for (const Variable& v : var_table)
-        if (v.name == var) return true;
-    return false;
-}
+using Symbol_table = Basic_symbol_table<double>;    // see symbol_table.h
+using Variable = Symbol_table::Variable;
 
-double Symbol_table::get(string s)
-    // return the value of the Variable named s
-{
-    for (const Variable& v : var_table)
-        if (v.name == s) return v.value;
-    error("get: undefined variable ", s);
-}
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+// the variables and the input belong to a Calculator (see README.md)
 
-double Symbol_table::set(string s, double d)
-    // set the Variable named s to d
-{
-    for (Variable& v : var_table)
-        if (v.name == s) {
-            if (v.constant) error("Can't overwrite constant variable");
-            v.value = d;
-            return d;
-        }
-    error("set: undefined variable ", s);
-}
+class Calculator {
+public:
+    Calculator();
+    double evaluate(string_view s);   // run the statements in s, the value of the last
 
-double Symbol_table::declare(string var, double val, bool con)
-    // add {var,val,con} to var_table
-{
-    if (is_declared(var)) error(var, " declared twice");
-    var_table.push_back(Variable{var,val,con});
-    return val;
-}
+    Symbol_table st;            // allows Variable storage and retrieval
+    Token_stream ts;            // provides get() and putback()
 
-// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
-// globals(?)
+    double statement();
+    void clean_up_mess();
 
-Symbol_table st;            // allows Variable storage and retrieval
-Token_stream ts;            // provides get() and putback()
+private:
+    double declaration(bool b);
+    double expression();
+    double term();
+    double secondary();
+    double primary();
+    double handle_variable(Token& t);
+    double calc_sqrt();
+    double calc_pow();
+    double calc_sin();
+    double calc_cos();
+};
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
-// forward declaration for primary() to call
-double expression();
+// (expression() is declared in Calculator, for primary() to call)
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
 // additional calculator functions
 
+const int max_factorial = 20;       // 21! does not fit in a long long
+
 long long factorial(int integer){
    if(integer <= 1) return 1;
    return integer*factorial(integer-1);
 }
 
-double calc_sqrt()
+double Calculator::calc_sqrt()
 {
-    char ch;
-    if (cin.get(ch) && ch != '(') error("'(' expected");
-    cin.putback(ch);
+    Token t = ts.get();             // not cin: ts may have a Token already
+    if (t.kind != '(') error("'(' expected");
+    ts.putback(t);
     double d = expression();
     if (d < 0) error("sqrt: negative val is imaginary");
     return sqrt(d);
 }
 
-double calc_pow()
+double Calculator::calc_pow()
 {
     Token t = ts.get();
     if (t.kind != '(') error("'(' expected");
@@ -347,45 +325,49 @@ double calc_pow()
 
 
 
-double calc_sin()
+double Calculator::calc_sin()
 {
-    char ch;
-    if (cin.get(ch) && ch != '(') error("'(' expected");
-    cin.putback(ch);
+    Token t = ts.get();             // not cin: ts may have a Token already
+    if (t.kind != '(') error("'(' expected");
+    ts.putback(t);
     double d = expression();
     if (d == 0 || d == 180) return 0;       // return true zero
     return sin(d*3.1415926535/180);
 }
 
-double calc_cos()
+double Calculator::calc_cos()
 {
-    char ch;
-    if (cin.get(ch) && ch != '(') error("'(' expected");
-    cin.putback(ch);
+    Token t = ts.get();             // not cin: ts may have a Token already
+    if (t.kind != '(') error("'(' expected");
+    ts.putback(t);
     double d = expression();
     if (d == 90 || d == 270) return 0;      // return 0 instead of 8.766e-11
     return cos(d*3.1415926535/180);
 }
 
-double handle_variable(Token& t)
+double Calculator::handle_variable(Token& t)
 {
+    int var = st.find(t.name);      // resolve the name once, use the slot
     Token t2 = ts.get();
-    if (t2.kind == '=')
-        return st.set(t.name, expression());
+    if (t2.kind == '=') {
+        if (var < 0) error("set: undefined variable ", t.name);
+        return st.set(var, expression());
+    }
     else {
         ts.putback(t2);
-        return st.get(t.name);       // missing in text!
+        if (var < 0) error("get: undefined variable ", t.name);
+        return st.get(var);       // missing in text!
     }
 }
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
 // input grammar functions
-double secondary();  // declare here so as to allow square_root unary operator
+// secondary() is declared in Calculator so as to allow square_root unary operator
                      // to bind factorial ! tighter than @ (sqrt)
                      // This makes @6! ---> @(6!), otherwise if r = primary(),
                      // then @6! ---> (@6)! which is factorial of double. not int
 
-double primary()            // deal with numbers and parenthesis/braces
+double Calculator::primary()            // deal with numbers and parenthesis/braces
 {
     Token t = ts.get();
     switch (t.kind) {
@@ -432,7 +414,7 @@ double primary()            // deal with numbers and parenthesis/braces
     }
 }
 
-double secondary()
+double Calculator::secondary()
     // ex 3 - Add a factorial operator '!'
 {
     double left = primary();
@@ -447,6 +429,8 @@ double secondary()
                 left *= i;
 */
 // replace with recursive definition
+        // (1000000000! used to recurse until the stack ran out)
+        if (left > max_factorial) error("factorial: value too large");
         long long fac  = factorial(int(left));
         left = fac;
          t = ts.get();
@@ -458,7 +442,7 @@ double secondary()
     }
 }
 
-double term()               // deal with * and /
+double Calculator::term()               // deal with * and /
 {
     double left = secondary();
     Token t = ts.get();             // get next token from Token_stream
@@ -497,7 +481,7 @@ double term()               // deal with * and /
     }
 }
 
-double expression()         // deal with + and -
+double Calculator::expression()         // deal with + and -
 {
     double left = term();           // read and evaluate a term
     Token t = ts.get();             // get next token from Token_stream
@@ -520,7 +504,7 @@ double expression()         // deal with + and -
 }
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
-double declaration(bool b)
+double Calculator::declaration(bool b)
     // assume we have seen "let" or "constant"
     // handle: name = expression
     // declare a variable called "name" with the initial value "expression"
@@ -528,16 +512,17 @@ double declaration(bool b)
     Token t = ts.get();
     if (t.kind != name) error("name expected in declaration");
     string var_name = t.name;
+    int var = st.slot(var_name);
 
     Token t2 = ts.get();
     if (t2.kind != '=') error("= missing in declaration of ", var_name);
 
     double d = expression();
-    st.declare(var_name, d, b);
+    st.declare(var, d, b);
     return d;
 }
 
-double statement()  // handles declarations and expressions
+double Calculator::statement()  // handles declarations and expressions
 {
     Token t = ts.get();
     switch (t.kind) {
@@ -574,12 +559,44 @@ void print_help()
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
 
-void clean_up_mess()  {
+void Calculator::clean_up_mess()  {
     ts.ignore(print);
 }
 
-void calculate()   //expression evaluation loop
+Calculator::Calculator()
+    // every Calculator starts out with these
+{
+    st.declare("pi", 4*atan(1), true);       // hardcoded constants
+    st.declare("e", exp(1.0), true);         // 2.7182818284 was short of a double
+}
+
+double Calculator::evaluate(string_view s)
+    // run the statements in s; help is ignored and errors are thrown
+{
+    istringstream in{string(s)};
+    ts.from_stream(in);
+    double last = 0;
+    try {
+        while (true) {
+            Token t = ts.get();
+            while (t.kind == print) t = ts.get();
+            if (t.kind == quit) break;
+            if (t.kind == help) continue;
+            ts.putback(t);
+            last = statement();
+        }
+    }
+    catch (...) {
+        ts = Token_stream{};        // in is gone after this
+        throw;
+    }
+    ts = Token_stream{};
+    return last;
+}
+
+void calculate(Calculator& calc)   //expression evaluation loop
 {
+  Token_stream& ts = calc.ts;
   while (cin)
     try {
       cout << prompt;
@@ -589,24 +606,24 @@ void calculate()   //expression evaluation loop
       else if (t.kind == quit)  return;  // for a clean exit!
       else {
         ts.putback(t);
-        cout << result << statement() << '\n';
+        cout << result << calc.statement() << '\n';
       }
 
     }
     catch(exception& e) {
         cerr << e.what() << '\n';
-        clean_up_mess();
+        calc.clean_up_mess();
       }
 }
 
 
 int main()
 try {
-   st.declare("pi", 4*atan(1), true);       // hardcoded constants
-   st.declare("e", 2.7182818284, true);
+   Calculator calc;
+   calc.ts.from_stream(cin);
 
    cout << "Simple Calculator (type ? for help)\n";
-   calculate();
+   calculate(calc);
    // keep_window_open();  // cope with Windows console mode
    return 0;
 }
@@ -0,0 +1,422 @@
+/*
+   hybrid_number.h
+
+   Integer and Rational: numbers that live in machine words while they are
+   small and move into GMP (mpz_class, mpq_class) only when they have to.
+
+   Every value in count and qc used to be an mpz_class or mpq_class, so even
+   2+3 allocated limbs for each Token, each variable and each intermediate
+   result.  Nearly all of the expressions we evaluate never leave 64 bits.
+   Here a value is kept as a long (or a long numerator over a long
+   denominator) and the arithmetic is checked with __builtin_*_overflow; when
+   a result does not fit, the operation is redone in GMP and the value is
+   "promoted".  A GMP result that fits in a long again is demoted back.
+
+   LONG_MIN is never stored as a small value, so negating a small value or
+   taking the gcd of its absolute value can never overflow.
+*/
+
+#ifndef HYBRID_NUMBER_H
+#define HYBRID_NUMBER_H
+
+#include "std_lib_facilities.h"
+#include <climits>
+#include <numeric>      // gcd
+#include <gmpxx.h>
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+
+inline bool fits_small(const mpz_class& z)
+{
+    return z.fits_slong_p() && z.get_si() != LONG_MIN;
+}
+
+inline int sign_of(int c) { return (c > 0) - (c < 0); }    // mpz_cmp gives any int
+
+class Integer {
+public:
+    Integer(long i = 0) : v{i}, small{i != LONG_MIN} { if (!small) big = i; }
+    Integer(int i) : v{i} { }
+    Integer(const mpz_class& z) { assign(z); }
+    Integer(const Integer& x) : v{x.v}, small{x.small} { if (!small) big = x.big; }
+    Integer(Integer&&) = default;
+
+    Integer& operator=(const Integer& x);
+    Integer& operator=(Integer&&) = default;
+
+    bool is_small() const { return small; }
+    long small_value() const { return v; }      // only if is_small()
+    mpz_class to_mpz() const { return small ? mpz_class(v) : big; }
+    double get_d() const { return small ? double(v) : big.get_d(); }
+    int sign() const { return small ? (v > 0) - (v < 0) : sgn(big); }
+
+    Integer& operator+=(const Integer& b);
+    Integer& operator-=(const Integer& b);
+    Integer& operator*=(const Integer& b);
+    Integer& operator/=(const Integer& b);      // truncates, like mpz_class
+    Integer& operator%=(const Integer& b);      // sign of the dividend
+    Integer operator-() const;
+
+    friend int cmp(const Integer& a, const Integer& b);
+    friend ostream& operator<<(ostream& os, const Integer& x);
+
+private:
+    long v;
+    bool small { true };
+    mpz_class big;          // the value, when it does not fit in v
+
+    void assign(const mpz_class& z);
+    void grow() { if (small) { big = v; small = false; } }
+    void shrink() { if (fits_small(big)) { v = big.get_si(); small = true; } }
+};
+
+inline Integer& Integer::operator=(const Integer& x)
+{
+    v = x.v;
+    small = x.small;
+    if (!small) big = x.big;
+    return *this;
+}
+
+inline void Integer::assign(const mpz_class& z)
+{
+    small = fits_small(z);
+    if (small) v = z.get_si();
+    else big = z;
+}
+
+inline Integer& Integer::operator+=(const Integer& b)
+{
+    long r;
+    if (small && b.small && !__builtin_add_overflow(v, b.v, &r) && r != LONG_MIN) {
+        v = r;
+        return *this;
+    }
+    grow();
+    if (b.small) big += b.v;
+    else big += b.big;
+    shrink();
+    return *this;
+}
+
+inline Integer& Integer::operator-=(const Integer& b)
+{
+    long r;
+    if (small && b.small && !__builtin_sub_overflow(v, b.v, &r) && r != LONG_MIN) {
+        v = r;
+        return *this;
+    }
+    grow();
+    if (b.small) big -= b.v;
+    else big -= b.big;
+    shrink();
+    return *this;
+}
+
+inline Integer& Integer::operator*=(const Integer& b)
+{
+    long r;
+    if (small && b.small && !__builtin_mul_overflow(v, b.v, &r) && r != LONG_MIN) {
+        v = r;
+        return *this;
+    }
+    grow();
+    if (b.small) big *= b.v;
+    else big *= b.big;
+    shrink();
+    return *this;
+}
+
+inline Integer& Integer::operator/=(const Integer& b)
+{
+    if (b.sign() == 0) error("divide by zero");
+    if (small && b.small) {
+        v /= b.v;       // no LONG_MIN, so no overflow
+        return *this;
+    }
+    grow();
+    if (b.small) big /= b.v;
+    else big /= b.big;
+    shrink();
+    return *this;
+}
+
+inline Integer& Integer::operator%=(const Integer& b)
+{
+    if (b.sign() == 0) error("%:divide by zero");
+    if (small && b.small) {
+        v %= b.v;
+        return *this;
+    }
+    grow();
+    if (b.small) big %= b.v;
+    else big %= b.big;
+    shrink();
+    return *this;
+}
+
+inline Integer Integer::operator-() const
+{
+    if (small) return Integer(-v);
+    return Integer(mpz_class(-big));
+}
+
+inline int cmp(const Integer& a, const Integer& b)
+{
+    if (a.small && b.small) return (a.v > b.v) - (a.v < b.v);
+    if (a.small) return -sign_of(mpz_cmp_si(b.big.get_mpz_t(), a.v));
+    if (b.small) return sign_of(mpz_cmp_si(a.big.get_mpz_t(), b.v));
+    return sign_of(cmp(a.big, b.big));
+}
+
+inline ostream& operator<<(ostream& os, const Integer& x)
+{
+    if (x.small) return os << x.v;
+    return os << x.big;
+}
+
+inline Integer operator+(Integer a, const Integer& b) { return a += b; }
+inline Integer operator-(Integer a, const Integer& b) { return a -= b; }
+inline Integer operator*(Integer a, const Integer& b) { return a *= b; }
+inline Integer operator/(Integer a, const Integer& b) { return a /= b; }
+inline Integer operator%(Integer a, const Integer& b) { return a %= b; }
+
+inline bool operator==(const Integer& a, const Integer& b) { return cmp(a, b) == 0; }
+inline bool operator!=(const Integer& a, const Integer& b) { return cmp(a, b) != 0; }
+inline bool operator<(const Integer& a, const Integer& b) { return cmp(a, b) < 0; }
+inline bool operator<=(const Integer& a, const Integer& b) { return cmp(a, b) <= 0; }
+inline bool operator>(const Integer& a, const Integer& b) { return cmp(a, b) > 0; }
+inline bool operator>=(const Integer& a, const Integer& b) { return cmp(a, b) >= 0; }
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  mpq_init() (so every mpq_class, even one that is never used) allocates
+    a limb for the denominator 1, while mpz_init() allocates nothing.  A
+    Rational only needs its mpq once it is big, so it keeps a bare mpq_t whose
+    two halves are set up with mpz_init(); the value is garbage (0/0) until the
+    first mpq_set.
+*/
+
+struct Lazy_mpq {
+    mpq_t q;
+    Lazy_mpq() { mpz_init(mpq_numref(q)); mpz_init(mpq_denref(q)); }
+    Lazy_mpq(const Lazy_mpq& x) : Lazy_mpq() { mpq_set(q, x.q); }
+    Lazy_mpq(Lazy_mpq&& x) noexcept : Lazy_mpq() { mpq_swap(q, x.q); }
+    Lazy_mpq& operator=(const Lazy_mpq& x) { mpq_set(q, x.q); return *this; }
+    Lazy_mpq& operator=(Lazy_mpq&& x) noexcept { mpq_swap(q, x.q); return *this; }
+    ~Lazy_mpq() { mpq_clear(q); }
+};
+
+/*  A small Rational is n/d in lowest terms with d > 0, just like mpq_class,
+    so two equal values always have the same representation.
+*/
+
+class Rational {
+public:
+    Rational(long i = 0) : n{i}, small{i != LONG_MIN} { if (!small) mpq_set_si(big.q, i, 1); }
+    Rational(int i) : n{i} { }
+    Rational(const mpz_class& z) { assign(z); }
+    Rational(const mpq_class& q) { assign(q); }
+    Rational(const Rational& x) : n{x.n}, d{x.d}, small{x.small} { if (!small) big = x.big; }
+    Rational(Rational&&) = default;
+
+    Rational& operator=(const Rational& x);
+    Rational& operator=(Rational&&) = default;
+
+    bool is_small() const { return small; }
+    long small_num() const { return n; }        // only if is_small()
+    long small_den() const { return d; }
+    mpq_class to_mpq() const;
+    mpz_class get_num() const { return small ? mpz_class(n) : mpz_class(mpq_numref(big.q)); }
+    mpz_class get_den() const { return small ? mpz_class(d) : mpz_class(mpq_denref(big.q)); }
+    double get_d() const;
+    int sign() const { return small ? (n > 0) - (n < 0) : mpq_sgn(big.q); }
+
+    Rational& operator+=(const Rational& b);
+    Rational& operator-=(const Rational& b) { return *this += -b; }
+    Rational& operator*=(const Rational& b);
+    Rational& operator/=(const Rational& b);
+    Rational operator-() const;
+
+    friend int cmp(const Rational& a, const Rational& b);
+    friend ostream& operator<<(ostream& os, const Rational& x);
+
+private:
+    long n;
+    long d { 1 };
+    bool small { true };
+    Lazy_mpq big;           // the value, when n/d does not fit in longs
+
+    void assign(const mpz_class& z);
+    void assign(const mpq_class& q);
+    void grow() { if (small) { mpq_set_si(big.q, n, d); small = false; } }
+    void shrink();
+};
+
+inline Rational& Rational::operator=(const Rational& x)
+{
+    n = x.n;
+    d = x.d;
+    small = x.small;
+    if (!small) big = x.big;
+    return *this;
+}
+
+inline void Rational::assign(const mpz_class& z)
+{
+    small = fits_small(z);
+    if (small) n = z.get_si();
+    else mpq_set_z(big.q, z.get_mpz_t());
+}
+
+inline void Rational::assign(const mpq_class& q)
+{
+    small = fits_small(q.get_num()) && fits_small(q.get_den());
+    if (small) {
+        n = q.get_num().get_si();
+        d = q.get_den().get_si();
+    }
+    else mpq_set(big.q, q.get_mpq_t());
+}
+
+inline void Rational::shrink()
+{
+    mpz_srcptr num = mpq_numref(big.q);
+    mpz_srcptr den = mpq_denref(big.q);
+    if (mpz_fits_slong_p(num) && mpz_get_si(num) != LONG_MIN && mpz_fits_slong_p(den)) {
+        n = mpz_get_si(num);
+        d = mpz_get_si(den);
+        small = true;
+    }
+}
+
+inline mpq_class Rational::to_mpq() const
+{
+    mpq_class q;
+    if (small) mpq_set_si(q.get_mpq_t(), n, d);     // already in lowest terms
+    else mpq_set(q.get_mpq_t(), big.q);
+    return q;
+}
+
+inline double Rational::get_d() const
+    // truncated toward zero like mpq_get_d, so results print as they always did
+{
+    if (!small) return mpq_get_d(big.q);
+    const long exact = 1L << 53;
+    if (n <= -exact || n >= exact || d >= exact) return to_mpq().get_d();
+    double q = double(n)/double(d);
+    double r = fma(q, double(d), -double(n));       // q*d - n, exactly
+    if (n > 0 ? r > 0 : r < 0) q = nextafter(q, 0.0);
+    return q;
+}
+
+inline Rational& Rational::operator+=(const Rational& b)
+{
+    if (small && b.small) {
+        long num, x, y, den;
+        if (d == 1 && b.d == 1) {
+            if (!__builtin_add_overflow(n, b.n, &num) && num != LONG_MIN) {
+                n = num;
+                return *this;
+            }
+        }
+        else {
+            // n/d + b.n/b.d with g = gcd(d, b.d) taken out first (Knuth 4.5.1)
+            long g = gcd(d, b.d);
+            if (!__builtin_mul_overflow(n, b.d/g, &x)
+                && !__builtin_mul_overflow(b.n, d/g, &y)
+                && !__builtin_add_overflow(x, y, &num) && num != LONG_MIN) {
+                long g2 = gcd(num, g);
+                if (!__builtin_mul_overflow(d/g, b.d/g2, &den)) {
+                    n = num/g2;
+                    d = den;
+                    return *this;
+                }
+            }
+        }
+    }
+    grow();
+    if (b.small) mpq_add(big.q, big.q, b.to_mpq().get_mpq_t());
+    else mpq_add(big.q, big.q, b.big.q);
+    shrink();
+    return *this;
+}
+
+inline Rational& Rational::operator*=(const Rational& b)
+{
+    if (small && b.small) {
+        // cancel across first, so the products are already in lowest terms
+        long g1 = gcd(n, b.d);
+        long g2 = gcd(b.n, d);
+        long num, den;
+        if (g1 == 0) g1 = 1;        // n == 0 and b.d == 0 can't both happen,
+        if (g2 == 0) g2 = 1;        // but be safe
+        if (!__builtin_mul_overflow(n/g1, b.n/g2, &num) && num != LONG_MIN
+            && !__builtin_mul_overflow(d/g2, b.d/g1, &den)) {
+            if (num == 0) den = 1;
+            n = num;
+            d = den;
+            return *this;
+        }
+    }
+    grow();
+    if (b.small) mpq_mul(big.q, big.q, b.to_mpq().get_mpq_t());
+    else mpq_mul(big.q, big.q, b.big.q);
+    shrink();
+    return *this;
+}
+
+inline Rational& Rational::operator/=(const Rational& b)
+{
+    if (b.sign() == 0) error("divide by zero");
+    if (b.small) {
+        Rational inverse;
+        inverse.n = b.n < 0 ? -b.d : b.d;
+        inverse.d = b.n < 0 ? -b.n : b.n;
+        return *this *= inverse;
+    }
+    grow();
+    mpq_div(big.q, big.q, b.big.q);
+    shrink();
+    return *this;
+}
+
+inline Rational Rational::operator-() const
+{
+    Rational r = *this;
+    if (small) r.n = -n;
+    else mpq_neg(r.big.q, r.big.q);
+    return r;
+}
+
+inline int cmp(const Rational& a, const Rational& b)
+{
+    if (a.small && b.small) {
+        __int128 x = (__int128)a.n * b.d;
+        __int128 y = (__int128)b.n * a.d;
+        return (x > y) - (x < y);
+    }
+    if (!a.small && !b.small) return sign_of(mpq_cmp(a.big.q, b.big.q));
+    return sign_of(cmp(a.to_mpq(), b.to_mpq()));
+}
+
+inline ostream& operator<<(ostream& os, const Rational& x)
+{
+    if (!x.small) return os << x.big.q;
+    os << x.n;
+    if (x.d != 1) os << '/' << x.d;
+    return os;
+}
+
+inline Rational operator+(Rational a, const Rational& b) { return a += b; }
+inline Rational operator-(Rational a, const Rational& b) { return a -= b; }
+inline Rational operator*(Rational a, const Rational& b) { return a *= b; }
+inline Rational operator/(Rational a, const Rational& b) { return a /= b; }
+
+inline bool operator==(const Rational& a, const Rational& b) { return cmp(a, b) == 0; }
+inline bool operator!=(const Rational& a, const Rational& b) { return cmp(a, b) != 0; }
+inline bool operator<(const Rational& a, const Rational& b) { return cmp(a, b) < 0; }
+inline bool operator<=(const Rational& a, const Rational& b) { return cmp(a, b) <= 0; }
+inline bool operator>(const Rational& a, const Rational& b) { return cmp(a, b) > 0; }
+inline bool operator>=(const Rational& a, const Rational& b) { return cmp(a, b) >= 0; }
+
+#endif // HYBRID_NUMBER_H
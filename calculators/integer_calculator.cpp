@@ -7,7 +7,7 @@
              Also plans to implement C(n, r) for "combinations"
              and P(n,r) for "permutations" using this new factorial function
 
-   g++ -lgmpxx -lgmp -g integer_calculator.cpp -std=c++11 -o count
+   g++ -pthread -lgmpxx -lgmp -g integer_calculator.cpp -std=c++17 -o count
 
    I removed power (exponentiation) and modular arithmetic until
    I learn more about:
@@ -76,6 +76,7 @@ Original:  2 December 2018
    Secondary:
        Primary
        Number !
+       Primary ^ Secondary
 
    Primary:
        Number
@@ -112,9 +113,25 @@ Original:  2 December 2018
 
 #include "std_lib_facilities.h"
 #include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <string_view>
+#include <map>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
 //#include <iomanip>
 //#include <cmath>  // for lgamma()
 #include <gmpxx.h>   // g++ -lgmpxx -lgmp -g nPk_gmp.cpp -std=c++17 -o nPk
+#include "combinatorics.h"
+#include "hybrid_number.h"   // Integer: a long until it outgrows it
+#include "constants.h"
+#include "digits.h"      // digit counts, first/last digits, streamed output
+#include "symbol_table.h"  // variables: names interned to slots
+#include "modular.h"     // mod p: Montgomery words, factorial tables
+#include "server.h"      // --serve: sessions on a Unix-domain socket
+#include "jobs.h"        // ^C, and statements that end with '&'
+#include "buffered_io.h" // where the statements are read from
 
 // SYMBOLIC CONSTANTS
 const char number = '8';
@@ -142,6 +159,14 @@ const char nCr = 'C';
 const char fnCr = 'c';    // don't need 'c' for cos when dealing with integers only
 const char nPr = 'P';
 const char fnPr = 'p';
+const char fnConst = 'k';     // pi(n), e(n), ln2(n), ln10(n): the name is in the Token
+const char digitscmd = 'D';
+const char savecmd = 'S';
+const char defcmd = 'F';
+const char fnIf = 'i';
+const char modcmd = 'M';
+const char jobscmd = 'J';
+const char waitcmd = 'T';
 //const string sqrtkey = "sqrt";
 const string expkey = "pow";
 const string ncrkey = "nCr";
@@ -150,33 +175,63 @@ const string nprkey = "nPr";
 //const string coskey = "cos";
 const string quitkey = "quit";
 const string helpkey = "help";
+const string digitskey = "digits";
+const string savekey = "save";
+const string defkey = "def";
+const string ifkey = "if";
+const string modkey = "mod";
+const string jobskey = "jobs";
+const string waitkey = "wait";
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
 
 class Token {  // altered for different calculator ***************************
 public:
     char kind;
-    mpz_class value;  // for Big Integers
+    Integer value;  // a long, or a Big Integer once it gets too big
     string name;
 
     Token(char k) : kind{k}, value{0} { }
-    Token(char k, mpz_class v) : kind{k}, value{v} { }
+    Token(char k, const Integer& v) : kind{k}, value{v} { }
     Token(char k, string n) : kind{k}, value{0}, name{n} { }
 };
 
-class Token_stream {
+class Token_stream : public Input_buffer {     // see buffered_io.h
 public:
     Token get();                // get a Token
     void putback(Token t);      // put a token back
+    void putback(const vector<Token>& v);  // put several back, v[0] is got first
     void ignore(char c);   // discard characters up to and including a c
+    bool background(string& s); // is the next statement "... &"? see jobs.h
+
+    // the body of a user function: get() takes its Tokens instead of the
+    // input, then gives print; end_replay() goes back to where we were
+    struct Replay {
+        const vector<Token>* tokens;
+        size_t next;
+        bool full;
+        Token buffer;
+        vector<Token> pending;
+    };
+    Replay replay(const vector<Token>& body);
+    void end_replay(Replay& r);
 
 private:
     bool full { false };   // is there a Token in the buffer?
     Token buffer {' '};    // here is where putback() stores a Token
                      // put back using putback()
+    const vector<Token>* tokens { nullptr };    // being replayed
+    size_t next { 0 };
+    vector<Token> pending;      // from putback(v), the next one last
+
+    void new_source() override
+    {
+        full = false;
+        tokens = nullptr;
+        pending.clear();
+    }
 };
 
-
 void Token_stream::ignore(char c)
  // c represents the kind of Token
  {
@@ -186,19 +241,114 @@ void Token_stream::ignore(char c)
     return;
   }
   full = false;
+  while (!pending.empty()) {
+    char k = pending.back().kind;
+    pending.pop_back();
+    if (k == c) return;
+  }
 
-  // now search input
-  char ch = 0;
-  while (cin >> ch)
-      if (ch == c) return;
+  // now search input (a newline is a print too)
+  skip_past(c);
  }
 
+bool Token_stream::background(string& s)
+{
+    if (tokens || (full && buffer.kind != print) || !pending.empty()) return false;
+    full = false;               // the end of the statement before
+    return take_background(s);
+}
+
+Token_stream::Replay Token_stream::replay(const vector<Token>& body)
+{
+    Replay old { tokens, next, full, buffer, move(pending) };
+    tokens = &body;
+    next = 0;
+    full = false;
+    pending.clear();
+    return old;
+}
+
+void Token_stream::end_replay(Replay& r)
+{
+    tokens = r.tokens;
+    next = r.next;
+    full = r.full;
+    buffer = move(r.buffer);
+    pending = move(r.pending);
+}
+
 void Token_stream::putback(Token t)
 {
     buffer = t;                 // copy t to buffer
     full = true;                // buffer is now full
 };
 
+void Token_stream::putback(const vector<Token>& v)
+{
+    if (full) pending.push_back(buffer);    // it was to come next, now after v
+    full = false;
+    for (size_t i = v.size(); i > 0; --i) pending.push_back(v[i-1]);
+}
+
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  Literals are read exactly.  They used to go through strtod, so anything
+    past 2^53 was quietly rounded ("mod 1000000000000000003" was mod 10^18)
+    and 2.5 was cut down to 2.  Now the digits make the integer and the point
+    and the exponent a power of 10, as in qc; 2.5e3 and 1e6 are fine, 2.5 is
+    not a whole number and is an error.
+*/
+
+const long max_exponent = 1000000;     // 1e1000000 is a million digits already
+
+Integer integer_literal(const char* s, const char* e)
+    // [s, e) is digits with at most one '.', then maybe an exponent
+{
+    string digits;
+    digits.reserve(e - s);
+    long scale = 0;                 // the value is digits * 10^scale
+    bool point = false;
+    for (; s < e && *s != 'e' && *s != 'E'; ++s) {
+        if (*s == '.') point = true;
+        else {
+            digits += *s;
+            if (point) --scale;
+        }
+    }
+    if (s < e) {                    // the exponent
+        ++s;
+        bool neg = *s == '-';
+        if (*s == '+' || *s == '-') ++s;
+        long x = 0;
+        for (; s < e; ++s) {
+            x = x*10 + (*s - '0');
+            if (x > max_exponent) error("number: exponent too large");
+        }
+        scale += neg ? -x : x;
+    }
+
+    size_t z = digits.find_first_not_of('0');
+    if (z == string::npos) return 0;
+    digits.erase(0, z);
+    while (scale < 0 && digits.back() == '0') {     // 2.50 and 2500e-3 are whole
+        digits.pop_back();
+        ++scale;
+    }
+    if (scale < 0) error("number: not a whole number");
+    if (digits.size() + scale <= 18) {              // fits in a long
+        long v = 0;
+        for (char c : digits) v = v*10 + (c - '0');
+        for (long i = 0; i < scale; ++i) v *= 10;
+        return Integer(v);
+    }
+    mpz_class v(digits, 10);
+    if (scale > 0) {
+        mpz_class p10;
+        mpz_ui_pow_ui(p10.get_mpz_t(), 10, scale);
+        v *= p10;
+    }
+    return Integer(v);
+}
 
 Token Token_stream::get()
     // added '%'
@@ -207,14 +357,25 @@ Token Token_stream::get()
         full = false;       // remove Token from buffer
         return buffer;
     }
+    if (!pending.empty()) {
+        Token t = pending.back();
+        pending.pop_back();
+        return t;
+    }
+    if (tokens) {           // a function body ends like a statement
+        if (next < tokens->size()) return (*tokens)[next++];
+        return Token{print};
+    }
 
     char ch;
-    //cin >> ch;              // note that >> skips whitespace
-    cin.get(ch);    // note that cin.get() does NOT skip whitespace
-    while (isspace(ch)) {
-       if (ch == '\n') return Token(print); // if newline detected,
-       cin.get(ch);                         // return print Token
-    }
+    do {                    // note that we do NOT skip newlines
+        if (p == end && !refill(p)) return Token(quit);   // end of input
+        ch = *p++;
+        if (ch == '\n') {      // if newline detected, return print Token
+            ++lines;
+            return Token(print);
+        }
+    } while (isspace(ch));
 
     switch (ch) {
         case print:           // for "print"
@@ -234,7 +395,6 @@ Token Token_stream::get()
         case ',':
         case '^':
         //case '@':
-        case 'e':
         case 'C':
         case 'P':
             return Token { ch };  // let each character represent itself
@@ -242,30 +402,52 @@ Token Token_stream::get()
         case '0': case '1': case '2': case '3': case '4':
         case '5': case '6': case '7': case '8': case '9':
             {
-                cin.putback(ch);    // put digit back into input stream
-                double val;
-                cin >> val;
-                return Token { number, val };  // let '8' represent a number
+                // scan what cin >> double used to read: digits, one '.'
+                // and an exponent if a digit follows the 'e'
+                const char* s = p - 1;
+                bool point = ch == '.';
+                while (available(s, 1) && (isdigit(*p) || (*p == '.' && !point))) {
+                    if (*p == '.') point = true;
+                    ++p;
+                }
+                // one character at a time: at the end of a line only the
+                // '\n' is there, and asking for more waits for the next line
+                if (available(s, 1) && (*p == 'e' || *p == 'E') && available(s, 2)) {
+                    size_t sign = (p[1] == '+' || p[1] == '-');
+                    if ((!sign || available(s, 3)) && isdigit(p[1+sign])) {
+                        p += 1 + sign;
+                        while (available(s, 1) && isdigit(*p)) ++p;
+                    }
+                }
+                return Token { number, integer_literal(s, p) };  // let '8' represent a number
             }
         default:
             if (isalpha(ch)) {  // if it is a letter
-                string s;
-                s += ch;  // Put the letter in 's' because it has been already read
-                while (cin.get(ch) &&
-                        ((isalpha(ch) || isdigit(ch) || ch == '_'))
+                const char* b = p - 1;  // the letter has been already read
+                while (available(b, 1) &&
+                        ((isalpha(*p) || isdigit(*p) || *p == '_'))
                       )
-                      s += ch;     // Continue to read in 's'
-               cin.putback(ch);    // Return the character into the stream
+                      ++p;     // Continue to scan the name
+               string s(b, p);
+               Constant c = Constant::pi;
                if (s == declkey) return Token{let};    // declaration keyword
                else if (s == constkey) return Token{constant};
                else if (s == expkey) return Token{powexp};
                else if (s == ncrkey) return Token{fnCr};
                else if (s == nprkey) return Token{fnPr};
+               else if (constant_named(s, c)) return Token{fnConst, s};
                //else if (s == sqrtkey) return Token{square_root};
               // else if (s == sinkey) return Token{c_sin};
               // else if (s == coskey) return Token{c_cos};
                else if (s == quitkey) return Token{quit};
                else if (s == helpkey) return Token{help};
+               else if (s == digitskey) return Token{digitscmd};
+               else if (s == savekey) return Token{savecmd};
+               else if (s == defkey) return Token{defcmd};
+               else if (s == ifkey) return Token{fnIf};
+               else if (s == modkey) return Token{modcmd};
+               else if (s == jobskey) return Token{jobscmd};
+               else if (s == waitkey) return Token{waitcmd};
                else return Token{name, s};
             }            // exercise 05 (Chapter 7)
             error("Bad token");
@@ -282,198 +464,442 @@ Token Token_stream::get()
 */
 // * * * *
 
-class Variable {
-public:
+using Symbol_table = Basic_symbol_table<Integer>;    // see symbol_table.h
+using Variable = Symbol_table::Variable;
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  User functions:
+
+        def f(n, k) = n! / (k! * (n-k)!)
+        def memo ways(n, k) = if(k, if(n-k, ways(n-1, k-1) + ways(n-1, k), 1), 1)
+
+    count works out a statement while it reads it, so there is no compiled
+    form to keep.  Instead def lexes the body once and keeps its Tokens; a call
+    has the Token_stream replay them (no text is scanned again) with the
+    parameters bound for the call, the old values put back afterwards.  That
+    also makes recursion work.  if(c, a, b) reads the branch it doesn't take
+    without working it out, so a recursion can stop.
+
+    So a call runs the parser over the body again.  A tree built by def would
+    save that, but it would be a second copy of the grammar (the lookahead
+    for ! and C, the mod rules of Unreduced, the lazy if) to keep in step
+    with the first; the replay costs a few microseconds a call, and qc, which
+    does compile its statements, is the calculator for long loops.
+
+    A "memo" function keeps every result, keyed by its arguments, which turns
+    recursions like ways() above from exponential into polynomial.  That is
+    only right if nothing but the arguments goes in, so such a function may
+    not use any variable but its parameters, nor call a function that does.
+    A new def drops what all the memo tables have, since the function it
+    replaces may be called from one of them.
+*/
+
+struct Function {
     string name;
-    mpz_class value;
-    bool constant;
-    Variable(string n, mpz_class v, bool c = false)
-        : name{n}, value{v}, constant{c} { }
+    vector<int> params;         // slots, bound for each call
+    vector<Token> body;
+    bool pure { false };        // depends on its arguments only
+    bool memo { false };
+    map<vector<Integer>, Integer> memo_table;
+};
+
+const size_t max_call_stack = 6 << 20;     // bytes of stack the calls may use
+thread_local int call_depth = 0;            // calls under way in this thread
+thread_local uintptr_t call_stack_base;     // where the outermost one started
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  After "mod p", + - * / ^ ! C P (and nCr, nPr) give residues mod p, with
+    / multiplying by the inverse, and so does every statement.  "mod off"
+    goes back to plain integers.  Numbers and variables are taken as they
+    are, since 20! and C(20,10) mod 7 are not 6! and C(6,3).  Exponents are
+    worked out with plain integers too, as 2^(p-1) must not become 2^0; a
+    negative one takes the inverse.  So are the operands of ! C P, the
+    arguments of nCr, nPr and user functions, and the condition of if():
+    (3+4)! is 7! = 0 mod 7, not 0! = 1.  count works a statement out while
+    it reads it, so secondary() and term() look at the Tokens ahead to see
+    whether what comes is such an operand (see factorial_ahead()).
+    For p < 2^63 the residues are words and the products are Montgomery
+    products; n! and C(n,k) are table lookups when p is prime (modular.h).
+*/
+
+struct Unreduced {
+    // work without the modulus for a while: an exponent, a new modulus
+    unique_ptr<Modulus>& slot;
+    unique_ptr<Modulus> saved;
+    explicit Unreduced(unique_ptr<Modulus>& m) : slot{m}, saved{move(m)} { }
+    ~Unreduced() { slot = move(saved); }
 };
 
-class Symbol_table {
-    vector<Variable> var_table;
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+// one Calculator per REPL, batch run, job or server session (see README.md)
+
+class Calculator {
 public:
-    bool is_declared(string);
-    mpz_class get(string);
-    mpz_class set(string, mpz_class);
-    mpz_class declare(string, mpz_class, bool con = false);
+    Integer evaluate(string_view s);    // run the statements in s, the value of the last
+
+    Symbol_table st;            // allows Variable storage and retrieval
+    Token_stream ts;            // provides get() and putback()
+    Digits_format digits_format;  // how results are shown: see digits.h
+    Integer last_result;        // for save
+    bool allow_save { true };   // not for the clients of a server
+    map<string, Function> functions;
+    unique_ptr<Modulus> modulus;  // "mod p": everything is reduced, see below
+
+    Integer statement();        // read and evaluate the next statement in ts
+    void set_digits();
+    void set_mod();
+    void def_function();
+    void save_result();
+    void clean_up_mess();
+
+private:
+    Integer declaration(bool b);
+    Integer expression();
+    Integer term();
+    Integer secondary();
+    Integer primary();
+    Integer handle_variable(Token& t);
+    Integer calc_nCk();
+    Integer calc_nPk();
+    Integer choose(const Integer& n, const Integer& k);
+    Integer permute(const Integer& n, const Integer& k);
+    Integer factorial_of(const Integer& n);
+    Integer power_of(const Integer& a, const Integer& e);
+    Integer calc_constant(const string& s);
+    Integer calc_if();
+    void skip_expression();
+    void read_primary(vector<Token>& v);
+    bool factorial_ahead();
+    int choices_ahead();
+    Integer calc_call(Function& f);
+    Integer call(Function& f, const vector<Integer>& args);
 };
 
-bool Symbol_table::is_declared(string var)
-    // is var already in var_table?
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+// additional calculator functions
+
+// factorial(n) is in combinatorics.h: mpz_fac_ui plus a cache of big results
+
+Integer nCk(const Integer& n, const Integer& k)  {
+    long r;
+    if (n.is_small() && k.is_small() && small_binomial(n.small_value(), k.small_value(), r))
+        return r;
+    return binomial(n.to_mpz(), k.to_mpz());       // combinatorics.h: no factorials involved
+}
+
+Integer Calculator::calc_nCk()
 {
-    for (const Variable& v : var_table)
-        if (v.name == var) return true;
-    return false;
+    Token t = ts.get();
+    if (t.kind != '(') error("'(' expected");
+    Integer n, k;
+    {
+        Unreduced exact(modulus);       // nCr(12+2, 7) is nCr(14, 7)
+        n = expression();
+        t = ts.get();
+        if (t.kind != ',') error("',' expected");
+        k = expression();
+    }
+    t = ts.get();
+    if (t.kind != ')') error("')' expected");
+    return choose(n, k);
 }
 
-mpz_class Symbol_table::get(string s)
-    // return the value of the Variable named s
+Integer nPk(const Integer& n, const Integer& k)  {
+    long r;
+    if (n.is_small() && k.is_small() && small_falling(n.small_value(), k.small_value(), r))
+        return r;
+    return falling(n.to_mpz(), k.to_mpz());        // n*(n-1)*...*(n-k+1)
+}
+
+Integer fact(const Integer& n)
 {
-    for (const Variable& v : var_table)
-        if (v.name == s) return v.value;
-    error("get: undefined variable ", s);
+    long r;
+    if (n.is_small() && small_factorial(n.small_value(), r)) return r;
+    return factorial(n.to_mpz());
 }
 
-mpz_class Symbol_table::set(string s, mpz_class d)
-    // set the Variable named s to d
+Integer power(const Integer& a, const Integer& e)
 {
-    for (Variable& v : var_table)
-        if (v.name == s) {
-            if (v.constant) error("Can't overwrite constant variable");
-            v.value = d;
-            return d;
-        }
-    error("set: undefined variable ", s);
+    if (e < 0) error("^: negative exponent");
+    if (a == 0 || a == 1) return e == 0 ? 1 : a;
+    if (a == -1) return e.to_mpz() % 2 == 0 ? 1 : -1;
+    if (!e.is_small() || e.small_value() > long(ULONG_MAX >> 1))
+        error("^: exponent too large");
+    check_result_bits(power_bits(a.to_mpz(), e.to_mpz()), "^");
+    mpz_class r;
+    mpz_pow_ui(r.get_mpz_t(), a.to_mpz().get_mpz_t(), e.small_value());
+    return r;
 }
 
-mpz_class Symbol_table::declare(string var, mpz_class val, bool con)
-    // add {var,val,con} to var_table
+// the operators, mod p or not
+
+Integer Calculator::choose(const Integer& n, const Integer& k)
 {
-    if (is_declared(var)) error(var, " declared twice");
-    var_table.push_back(Variable{var,val,con});
-    return val;
+    return modulus ? modulus->binomial(n, k) : nCk(n, k);
 }
 
-// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
-// globals(?)
+Integer Calculator::permute(const Integer& n, const Integer& k)
+{
+    return modulus ? modulus->falling(n, k) : nPk(n, k);
+}
 
-Symbol_table st;            // allows Variable storage and retrieval
-Token_stream ts;            // provides get() and putback()
+Integer Calculator::factorial_of(const Integer& n)
+{
+    return modulus ? modulus->factorial(n) : fact(n);
+}
 
-// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
-// forward declaration for primary() to call
-mpz_class expression();
+Integer Calculator::power_of(const Integer& a, const Integer& e)
+{
+    return modulus ? modulus->pow(a, e) : power(a, e);
+}
 
-// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
-// additional calculator functions
-/*  REPLACED for mpz_class version
-long long factorial(int integer){
-   if(integer <= 1) return 1;
-   return integer*factorial(integer-1);
+Integer Calculator::calc_nPk()
+{
+    Token t = ts.get();
+    if (t.kind != '(') error("'(' expected");
+    Integer n, k;
+    {
+        Unreduced exact(modulus);       // nCr(12+2, 7) is nCr(14, 7)
+        n = expression();
+        t = ts.get();
+        if (t.kind != ',') error("',' expected");
+        k = expression();
+    }
+    t = ts.get();
+    if (t.kind != ')') error("')' expected");
+    return permute(n, k);
 }
 
 
-double calc_sqrt()
+Integer Calculator::calc_constant(const string& s)
+    // pi(n) is pi with its first n decimals, as a whole number: pi(4) = 31415
 {
-    char ch;
-    if (cin.get(ch) && ch != '(') error("'(' expected");
-    cin.putback(ch);
-    double d = expression();
-    if (d < 0) error("sqrt: negative val is imaginary");
-    return sqrt(d);
+    Constant c = Constant::pi;
+    constant_named(s, c);
+    Token t = ts.get();
+    if (t.kind != '(') error("'(' expected");
+    Integer n = expression();
+    t = ts.get();
+    if (t.kind != ')') error("')' expected");
+    if (!n.is_small() || n.small_value() < 0)
+        error(constant_name(c), ": the number of digits must be >= 0");
+    return constant_digits(c, n.small_value());
 }
 
-mpz_class calc_pow()
+Integer Calculator::calc_if()
+    // if(c, a, b): a if c is not 0, else b; the other one is only read
 {
     Token t = ts.get();
     if (t.kind != '(') error("'(' expected");
-    double base = narrow_cast<double>(expression());
+    Integer c;
+    {
+        Unreduced exact(modulus);       // if(7, a, b) is a, mod 7 or not
+        c = expression();
+    }
     t = ts.get();
     if (t.kind != ',') error("',' expected");
-    double power = narrow_cast<double>(expression());
+    Integer d;
+    if (c != 0) {
+        d = expression();
+        t = ts.get();
+        if (t.kind != ',') error("',' expected");
+        skip_expression();
+    }
+    else {
+        skip_expression();
+        t = ts.get();
+        if (t.kind != ',') error("',' expected");
+        d = expression();
+    }
     t = ts.get();
     if (t.kind != ')') error("')' expected");
-    return mpz_class( pow(base, power) );
+    return d;
 }
-/*
-double calc_sin()
+
+void Calculator::skip_expression()
+    // pass over the Tokens of an expression, up to the ',' or ')' after it
 {
-    char ch;
-    if (cin.get(ch) && ch != '(') error("'(' expected");
-    cin.putback(ch);
-    double d = expression();
-    if (d == 0 || d == 180) return 0;       // return true zero
-    return sin(d*3.1415926535/180);
+    int depth = 0;
+    while (true) {
+        Token t = ts.get();
+        if (t.kind == '(' || t.kind == '{') ++depth;
+        else if (depth > 0 && (t.kind == ')' || t.kind == '}')) --depth;
+        else if (t.kind == print || t.kind == quit
+                 || (depth == 0 && (t.kind == ',' || t.kind == ')' || t.kind == '}'))) {
+            ts.putback(t);
+            return;
+        }
+    }
 }
 
-double calc_cos()
+void Calculator::read_primary(vector<Token>& v)
+    // append the Tokens of the primary ahead to v, without working it out;
+    // stops at the end of the statement
 {
-    char ch;
-    if (cin.get(ch) && ch != '(') error("'(' expected");
-    cin.putback(ch);
-    double d = expression();
-    if (d == 90 || d == 270) return 0;      // return 0 instead of 8.766e-11
-    return cos(d*3.1415926535/180);
+    Token t = ts.get();
+    v.push_back(t);
+    while (t.kind == '-' || t.kind == '+') {
+        t = ts.get();
+        v.push_back(t);
+    }
+    if (t.kind == name || t.kind == fnConst || t.kind == fnCr || t.kind == fnPr || t.kind == fnIf) {
+        t = ts.get();
+        if (t.kind != '(') {
+            ts.putback(t);
+            return;
+        }
+        v.push_back(t);
+    }
+    if (t.kind != '(' && t.kind != '{') return;
+    for (int depth = 1; depth > 0; ) {
+        t = ts.get();
+        v.push_back(t);
+        if (t.kind == print || t.kind == quit) return;
+        if (t.kind == '(' || t.kind == '{') ++depth;
+        else if (t.kind == ')' || t.kind == '}') --depth;
+    }
 }
-*/
 
-mpz_class factorial(mpz_class n)
+bool Calculator::factorial_ahead()
+    // is the primary ahead followed by '!'?  The Tokens stay where they are
 {
-    mpz_class result(n); // initialize an arbitrary-sized integer with 'n'
-    if (n == 0) return 1;
-    while(n-- > 1) result *= n; // compute the product with every integers < n
-    return result;
+    vector<Token> v;
+    read_primary(v);
+    if (v.back().kind != print && v.back().kind != quit) v.push_back(ts.get());
+    ts.putback(v);
+    return v.back().kind == '!';
 }
 
-mpz_class nCk(mpz_class n, mpz_class k)  {
-    return factorial(n)/(factorial(n-k) * factorial(k) );
+int Calculator::choices_ahead()
+    // how many C and P are there in the term ahead, outside parentheses?
+{
+    vector<Token> v;
+    int n = 0;
+    int depth = 0;
+    bool operand = false;           // a + or - after an operand ends the term
+    while (true) {
+        Token t = ts.get();
+        v.push_back(t);
+        if (t.kind == print || t.kind == quit) break;
+        if (t.kind == '(' || t.kind == '{') ++depth;
+        else if (t.kind == ')' || t.kind == '}') {
+            if (depth == 0) break;
+            --depth;
+        }
+        else if (depth == 0) {
+            if (t.kind == ',' || t.kind == '=') break;
+            if (operand && (t.kind == '+' || t.kind == '-')) break;
+            if (t.kind == nCr || t.kind == nPr) ++n;
+        }
+        operand = t.kind == number || t.kind == name || t.kind == fnConst
+                  || t.kind == ')' || t.kind == '}' || t.kind == '!';
+    }
+    ts.putback(v);
+    return n;
 }
 
-mpz_class calc_nCk()
+Integer Calculator::calc_call(Function& f)
+    // assume we have seen "name("
+    // handle: argument, ... )
 {
+    vector<Integer> args;
     Token t = ts.get();
-    if (t.kind != '(') error("'(' expected");
-    mpz_class n = expression();
-    t = ts.get();
-    if (t.kind != ',') error("',' expected");
-    mpz_class k = expression();
-    t = ts.get();
-    if (t.kind != ')') error("')' expected");
-    return nCk(n, k);
-}
-
-mpz_class nPk(mpz_class n, mpz_class k)  {
-    return factorial(n)/factorial(n-k);
+    if (t.kind != ')') {
+        ts.putback(t);
+        Unreduced exact(modulus);       // f(12+2) is f(14), see above
+        do {
+            args.push_back(expression());
+            t = ts.get();
+        } while (t.kind == ',');
+        if (t.kind != ')') error("')' expected");
+    }
+    if (args.size() != f.params.size())
+        error(f.name + ": ", to_string(f.params.size()) + " arguments expected");
+    return call(f, args);
 }
 
-mpz_class calc_nPk()
+Integer Calculator::call(Function& f, const vector<Integer>& args)
+    // bind the parameters, replay the body, and put the old values back
 {
-    Token t = ts.get();
-    if (t.kind != '(') error("'(' expected");
-    mpz_class n = expression();
-    t = ts.get();
-    if (t.kind != ',') error("',' expected");
-    mpz_class k = expression();
-    t = ts.get();
-    if (t.kind != ')') error("')' expected");
-    return nPk(n, k);
-}
+    // the same arguments give another result under another modulus
+    vector<Integer> key;
+    if (f.memo) {
+        key = args;
+        key.push_back(modulus ? modulus->value() : 0);
+        auto p = f.memo_table.find(key);
+        if (p != f.memo_table.end()) return p->second;
+    }
+    // a recursion that doesn't stop runs out of stack long before memory:
+    // stop it at three quarters of the usual 8 MB
+    char here;
+    if (call_depth == 0) call_stack_base = uintptr_t(&here);
+    else if (call_stack_base - uintptr_t(&here) > max_call_stack)
+        error(f.name, ": calls nested too deep");
+    check_budget();
+
+    vector<Variable> old;
+    for (int s : f.params) old.push_back(st.saved(s));
+    Token_stream::Replay where = ts.replay(f.body);
+    auto put_back = [&] {
+        ts.end_replay(where);
+        for (size_t i = old.size(); i > 0; --i) st.restore(f.params[i-1], old[i-1]);
+        --call_depth;
+    };
+    ++call_depth;
+    Integer d;
+    try {
+        for (size_t i = 0; i < f.params.size(); ++i) st.bind(f.params[i], args[i]);
+        d = expression();
+        if (ts.get().kind != print) error(f.name, ": bad function body");
+    }
+    catch (...) {
+        put_back();
+        throw;
+    }
+    put_back();
 
+    if (f.memo) f.memo_table.emplace(move(key), d);
+    return d;
+}
 
-mpz_class handle_variable(Token& t)
+Integer Calculator::handle_variable(Token& t)
 {
+    int var = st.find(t.name);      // resolve the name once, use the slot
     Token t2 = ts.get();
-    if (t2.kind == '=')
-        return st.set(t.name, expression());
-    else {
-        ts.putback(t2);
-        return st.get(t.name);       // missing in text!
+    if (t2.kind == '=') {
+        if (var < 0) error("set: undefined variable ", t.name);
+        return st.set(var, expression());
     }
+    if (t2.kind == '(') {
+        auto f = functions.find(t.name);    // once: it is looked up on every call
+        if (f != functions.end()) return calc_call(f->second);
+    }
+    ts.putback(t2);
+    if (var < 0) error("get: undefined variable ", t.name);
+    return st.get(var);       // missing in text!
 }
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
 // input grammar functions
-mpz_class secondary();  // declare here so as to allow square_root unary operator
+// secondary() is declared in Calculator so as to allow square_root unary operator
                      // to bind factorial ! tighter than @ (sqrt)
                      // This makes @6! ---> @(6!), otherwise if r = primary(),
                      // then @6! ---> (@6)! which is factorial of double. not int
 
-mpz_class primary()            // deal with numbers and parenthesis/braces
+Integer Calculator::primary()            // deal with numbers and parenthesis/braces
 {
     Token t = ts.get();
     switch (t.kind) {
         case '(':                   // handle '(' expression ')'
             {
-                mpz_class d = expression();
+                Integer d = expression();
                 t = ts.get();
                 if (t.kind != ')') error("')' expected");
                 return d;
             }
         case '{':
             {
-                mpz_class d = expression();
+                Integer d = expression();
                 t = ts.get();
                 if (t.kind != '}') error("'}' expected");
                 return d;
@@ -505,15 +931,32 @@ mpz_class primary()            // deal with numbers and parenthesis/braces
              return calc_nCk();
         case fnPr:
              return calc_nPk();
+        case fnConst:
+            {
+                Token t2 = ts.get();
+                ts.putback(t2);
+                if (t2.kind == '(') return calc_constant(t.name);
+                Token v{name, t.name};      // no '(': a variable called pi, e, ...
+                return handle_variable(v);
+            }
+        case fnIf:
+             return calc_if();
         default:
             error("primary expected");
     }
 }
 
-mpz_class secondary()
+Integer Calculator::secondary()
     // ex 3 - Add a factorial operator '!'
+    // and '^', which binds tighter than * and groups from the right:
+    // 2*3^2 = 18, 2^3^2 = 2^9
 {
-    mpz_class left = primary();
+    Integer left;
+    if (modulus && factorial_ahead()) {
+        Unreduced exact(modulus);       // (3+4)! is 7!, not 0!
+        left = primary();
+    }
+    else left = primary();
     Token t = ts.get();
 
   while (true) {
@@ -525,9 +968,20 @@ mpz_class secondary()
                 left *= i;
 */
 // replace with Big Integer mpz_class version
-        mpz_class fac  = factorial(left);
-        left = fac;
          t = ts.get();
+         if (t.kind == '!' && modulus) {   // 3!! is 6!, so keep 3! as it is
+             Unreduced exact(modulus);
+             left = factorial_of(left);
+         }
+         else left = factorial_of(left);
+        }
+        else if (t.kind == exponent) {
+            Integer e;
+            {
+                Unreduced exact(modulus);   // 2^(p-1) is not 2^0
+                e = secondary();
+            }
+            return power_of(left, e);
         }
         else {
             ts.putback(t);
@@ -536,22 +990,30 @@ mpz_class secondary()
     }
 }
 
-mpz_class term()               // deal with * and /
+Integer Calculator::term()               // deal with * and /
 {
-    mpz_class left = secondary();
+    // in mod mode, all up to the right operand of the last C or P is worked
+    // out with plain integers: 2*7C3 is 14C3 = 0 mod 7, not 0C3
+    int choices = modulus ? choices_ahead() : 0;
+    unique_ptr<Unreduced> exact;
+    if (choices > 0) exact = make_unique<Unreduced>(modulus);
+    Integer left = secondary();
     Token t = ts.get();             // get next token from Token_stream
 
     while (true) {
+        check_budget();
         switch (t.kind) {
             case '*':
-                left *= secondary();
+                if (modulus) left = modulus->mul(left, secondary());
+                else left *= secondary();
                 t = ts.get();
                 break;
             case '/':
                 {
-                    mpz_class d = secondary();
+                    Integer d = secondary();
                     if (d == 0) error("divide by zero");
-                    left /= d;
+                    if (modulus) left = modulus->div(left, d);
+                    else left /= d;
                     t = ts.get();
                     break;
                 }
@@ -573,14 +1035,14 @@ mpz_class term()               // deal with * and /
                 break;
     */
           case nCr:
-               left = nCk(left, secondary());
-               t = ts.get();
-               break;
-
           case nPr:
-              left = nPk(left, secondary());
-              t = ts.get();
-              break;
+              {
+                  Integer k = secondary();
+                  if (exact && --choices == 0) exact.reset();   // the last one is reduced
+                  left = t.kind == nCr ? choose(left, k) : permute(left, k);
+                  t = ts.get();
+                  break;
+              }
           default:
                 ts.putback(t);      // put t back into the Token_stream
                 return left;
@@ -588,19 +1050,22 @@ mpz_class term()               // deal with * and /
     }
 }
 
-mpz_class expression()         // deal with + and -
+Integer Calculator::expression()         // deal with + and -
 {
-    mpz_class left = term();           // read and evaluate a term
+    Integer left = term();           // read and evaluate a term
     Token t = ts.get();             // get next token from Token_stream
 
     while (true) {
+        check_budget();
         switch (t.kind) {
             case '+':
-                left += term();     // evaluate term and add
+                if (modulus) left = modulus->add(left, term());
+                else left += term();     // evaluate term and add
                 t = ts.get();
                 break;
             case '-':
-                left -= term();     // evaluate term and subtract
+                if (modulus) left = modulus->sub(left, term());
+                else left -= term();     // evaluate term and subtract
                 t = ts.get();
                 break;
             default:
@@ -611,37 +1076,105 @@ mpz_class expression()         // deal with + and -
 }
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
-mpz_class declaration(bool b)
+Integer Calculator::declaration(bool b)
     // assume we have seen "let" or "constant"
     // handle: name = expression
     // declare a variable called "name" with the initial value "expression"
 {
     Token t = ts.get();
-    if (t.kind != name) error("name expected in declaration");
+    if (t.kind != name && t.kind != fnConst) error("name expected in declaration");
     string var_name = t.name;
+    int var = st.slot(var_name);
 
     Token t2 = ts.get();
     if (t2.kind != '=') error("= missing in declaration of ", var_name);
 
-    mpz_class d = expression();
-    st.declare(var_name, d, b);
+    Integer d = expression();
+    st.declare(var, d, b);
     return d;
 }
 
-mpz_class statement()  // handles declarations and expressions
+void Calculator::def_function()
+    // assume we have seen "def"
+    // handle: [memo] name(parameter, ...) = expression
 {
     Token t = ts.get();
+    Function f;
+    if (t.kind == name && t.name == "memo") {
+        Token t2 = ts.get();
+        if (t2.kind == name) {
+            f.memo = true;
+            t = t2;
+        }
+        else ts.putback(t2);            // a function called memo
+    }
+    if (t.kind != name) error("function name expected in def");
+    f.name = t.name;
+
+    t = ts.get();
+    if (t.kind != '(') error("'(' expected");
+    t = ts.get();
+    while (t.kind == name || t.kind == fnConst) {
+        int s = st.slot(t.name);
+        if (find(f.params.begin(), f.params.end(), s) != f.params.end())
+            error(f.name + ": parameter twice: ", t.name);
+        f.params.push_back(s);
+        t = ts.get();
+        if (t.kind != ',') break;
+        t = ts.get();
+        if (t.kind != name && t.kind != fnConst) error("parameter name expected");
+    }
+    if (t.kind != ')') error("')' expected");
+    t = ts.get();
+    if (t.kind != '=') error("= missing in def of ", f.name);
+
+    for (t = ts.get(); t.kind != print && t.kind != quit; t = ts.get())
+        f.body.push_back(t);
+    ts.putback(t);
+    if (f.body.empty()) error("def: expression expected for ", f.name);
+
+    // pure: every name is a parameter or a call of a pure function (or of f)
+    f.pure = true;
+    for (size_t i = 0; i < f.body.size(); ++i) {
+        char after = i+1 < f.body.size() ? f.body[i+1].kind : print;
+        if (f.body[i].kind == fnConst && after == '(') continue;     // pi(n)
+        if (f.body[i].kind != name && f.body[i].kind != fnConst) continue;
+        const string& n = f.body[i].name;
+        if (after == '(' && n == f.name) continue;
+        auto g = functions.find(n);
+        if (after == '(' && g != functions.end()) {
+            if (!g->second.pure) f.pure = false;
+        }
+        else if (after == '=' || find(f.params.begin(), f.params.end(), st.find(n)) == f.params.end()) {
+            if (f.memo) error(f.name + ": a memo function may only use its parameters, not ", n);
+            f.pure = false;
+        }
+    }
+    if (f.memo && !f.pure) error(f.name, ": a memo function may only call memo or pure functions");
+
+    for (auto& g : functions) g.second.memo_table.clear();
+    functions[f.name] = move(f);
+}
+
+Integer Calculator::statement()  // handles declarations and expressions
+{
+    Statement_budget budget;        // memory and time, see budget.h
+    Token t = ts.get();
+    Integer d;
     switch (t.kind) {
         case let:
-            return declaration(false);
+            d = declaration(false);
+            break;
 
         case constant:
-            return declaration(true);
+            d = declaration(true);
+            break;
 
         default:
             ts.putback(t);
-            return expression();
+            d = expression();
     }
+    return modulus ? modulus->reduce(d) : d;     // shown mod p, kept as it is
 }
 
 void print_help()
@@ -661,44 +1194,349 @@ void print_help()
          << "nCr(8,4)*nCr(5,2) = 700, but 8C4*5C2 = 61075 (not what we want!)\n"
          << "You need to enforce binding: (8C4)*(5C2) = 700\n\n"
          << "Variable assignment is provided using the 'let' keyword:\n"
-         << "- ex: let x = 37; x * 2 = 74; x = 4; x * 2 = 8\n\n";
+         << "- ex: let x = 37; x * 2 = 74; x = 4; x * 2 = 8\n\n"
+         << "Digits of constants: pi(4) = 31415, and likewise e(n), ln2(n), ln10(n)\n"
+         << "- a variable may still be called pi, e, ln2 or ln10: e(5) is the constant, e is the variable\n"
+         << "(set CALC_CACHE to a directory to keep them between runs)\n\n"
+         << "Huge results: 'digits 1000' shows the first and last 1000 digits,\n"
+         << "'digits count' only how many there are, 'digits all' every one;\n"
+         << "'save out.txt' writes all the digits of the last result to a file\n\n"
+         << "A statement may use 1024 MB and as long as it likes; set CALC_MAX_MEMORY\n"
+         << "(MB, 0 for no limit) and CALC_MAX_TIME (seconds) to change that\n\n"
+         << "Functions: def f(n, k) = nCr(n, k) * 2; f(4, 2) = 12\n"
+         << "if(c, a, b) is a if c is not 0, else b, so a function may call itself;\n"
+         << "'def memo' keeps the results (only for functions of their arguments):\n"
+         << "- ex: def memo fib(n) = if(n-1, if(n, fib(n-1) + fib(n-2), 0), 1)\n\n"
+         << "Powers: 2^10 = 1024 (tighter than *, and 2^3^2 = 2^9)\n"
+         << "'mod 1000000007' works modulo that from then on, / included:\n"
+         << "- ex: nCr(10000000, 5000000); 1/2; 2^-1; 'mod off' to stop\n\n"
+         << "^C stops the statement being worked out.  One that ends with '&'\n"
+         << "runs in the background: let f = 1000000! &; 'jobs' lists what is\n"
+         << "running, 'wait' (or 'wait 1') waits and shows the results\n\n";
 }
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
 
-void clean_up_mess()  {
+void Calculator::clean_up_mess()  {
     ts.ignore(print);
 }
 
-void calculate()   //expression evaluation loop
+Integer Calculator::evaluate(string_view s)
+    // run the statements in s, as many as there are, like a batch without
+    // output: "digits", "save" and "def" work, help is ignored, errors are
+    // thrown.
+    // Returns the value of the last statement (last_result).
+{
+    ts.from_string(s);
+    try {
+        while (true) {
+            Token t = ts.get();
+            while (t.kind == print) t = ts.get();
+            if (t.kind == quit) break;
+            else if (t.kind == digitscmd) set_digits();
+            else if (t.kind == modcmd) set_mod();
+            else if (t.kind == savecmd) save_result();
+            else if (t.kind == defcmd) def_function();
+            else if (t.kind != help) {
+                ts.putback(t);
+                last_result = statement();
+            }
+        }
+    }
+    catch (...) {
+        ts.from_string(string_view{});      // s need not outlive us
+        throw;
+    }
+    ts.from_string(string_view{});
+    return last_result;
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  Batch mode:  count --batch in.txt [--out results.txt] [--exact | --decimal]
+
+    For scripts with millions of statements.  No prompts, no help, no banner;
+    one line of output per statement, collected in an Output_buffer (see
+    buffered_io.h) and written with write(), not cout.  A statement that
+    fails gives an "error: line N: ..." line in its place and the run goes
+    on with the next line.  "-" means standard input/output.
+    Results come out with every digit unless a "digits" statement says
+    otherwise; the interactive calculate() below shares put_result().
+*/
+
+void put_exact(Output_buffer& out, const Integer& i, const Digits_format& d)
+    // for put_result(), see buffered_io.h
+{
+    if (i.is_small()) {
+        char* s = out.room(24);
+        out.used(s, snprintf(s, 24, "%ld", i.small_value()));
+    }
+    else put_integer(out, i.to_mpz(), d);     // streamed, never one huge string
+}
+
+mpz_class integer_part(const Integer& i)
+{
+    return i.to_mpz();
+}
+
+void Calculator::set_digits()
+    // assume we have seen "digits"
+    // handle: all | count | N
+{
+    Token t = ts.get();
+    if (t.kind == name && t.name == "all") digits_format = Digits_format{Digits_mode::all, 0};
+    else if (t.kind == name && t.name == "count") digits_format = Digits_format{Digits_mode::count, 0};
+    else if (t.kind == number && t.value > 0 && t.value.is_small())
+        digits_format = Digits_format{Digits_mode::ends, size_t(t.value.small_value())};
+    else error("digits: all, count or a number of digits expected");
+}
+
+void Calculator::set_mod()
+    // assume we have seen "mod"
+    // handle: off | expression
+{
+    Token t = ts.get();
+    if (t.kind == name && t.name == "off") {
+        modulus.reset();
+        return;
+    }
+    ts.putback(t);
+    Integer p;
+    {
+        Unreduced exact(modulus);       // "mod 7" under "mod 5" means 7
+        p = expression();
+    }
+    modulus = make_unique<Modulus>(p);
+}
+
+void Calculator::save_result()
+    // assume we have seen "save"
+    // write every digit of the last result to the file named by the rest of the line
 {
-  while (cin)
+    string path = ts.rest_of_line();
+    if (!allow_save) error("save: not allowed here");
+    if (path.empty()) error("save: file name expected");
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) error("can't open output file ", path);
     try {
+        Output_buffer out(fd);
+        put_result(out, last_result, Format::exact, Digits_format{});
+        out.flush();
+    }
+    catch(...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+// background jobs for calculate(), see jobs.h
+
+shared_ptr<Calculator> copy_for_job(const Calculator& calc)
+    // a Calculator with calc's variables, functions and options
+{
+    auto c = make_shared<Calculator>();
+    c->st = calc.st;
+    c->functions = calc.functions;
+    c->digits_format = calc.digits_format;
+    if (calc.modulus) c->modulus = make_unique<Modulus>(calc.modulus->value());
+    return c;
+}
+
+struct Assignment {
+    char kind { 0 };            // let, constant, '=' or 0 for none
+    string name;
+};
+
+Assignment assignment_in(const string& s)
+    // is s "let x = ...", "constant x = ..." or "x = ..."?
+{
+    Assignment a;
+    Token_stream ts;
+    ts.from_string(s);
+    try {
+        Token t = ts.get();
+        if (t.kind == let || t.kind == constant) {
+            a.kind = t.kind;
+            t = ts.get();
+        }
+        if ((t.kind != name && t.kind != fnConst) || ts.get().kind != '=') return Assignment{};
+        if (!a.kind) a.kind = '=';
+        a.name = t.name;
+    }
+    catch (exception&) {
+        return Assignment{};
+    }
+    return a;
+}
+
+void finish_jobs(Calculator& calc, Job_table<Integer>& jobs, Output_buffer& screen)
+    // show what the finished jobs found, and do their assignments
+{
+    for (auto& j : jobs.done()) {
+        cout << '[' << j->id << "] done  " << j->text << '\n';
+        try {
+            if (!j->error.empty()) error(j->error);
+            Assignment a = assignment_in(j->text);
+            if (a.kind == '=') calc.st.set(calc.st.slot(a.name), j->value);
+            else if (a.kind) calc.st.declare(calc.st.slot(a.name), j->value, a.kind == constant);
+            cout << result << flush;
+            put_result(screen, j->value, Format::exact, calc.digits_format);
+            screen.flush();
+        }
+        catch (exception& e) {
+            cerr << e.what() << '\n';
+        }
+    }
+}
+
+int job_number(Token_stream& ts)
+    // after "wait": the number of a job, 0 for all of them
+{
+    Token t = ts.get();
+    if (t.kind == number && t.value > 0 && t.value.is_small()) return t.value.small_value();
+    ts.putback(t);
+    return 0;
+}
+
+void calculate(Calculator& calc)   //expression evaluation loop
+{
+  Token_stream& ts = calc.ts;
+  Output_buffer screen(1);      // results go the way batch results do
+  Job_table<Integer> jobs;
+  catch_interrupts();
+  while (true)    // until quit, or the end of the input
+    try {
+      finish_jobs(calc, jobs, screen);
       cout << prompt;
+      string text;
+      if (ts.background(text)) {
+          shared_ptr<Calculator> c = copy_for_job(calc);
+          const auto& j = jobs.start(text, [c, text] { return c->evaluate(text); });
+          cout << '[' << j.id << "] " << text << '\n';
+          continue;
+      }
       Token t = ts.get();
       while (t.kind == print) t = ts.get();  // eats ';' to discard extra 'prints'
+      interrupt_requested = false;           // a ^C at the prompt stops nothing
       if (t.kind == help) print_help();
       else if (t.kind == quit)  return;  // for a clean exit!
+      else if (t.kind == digitscmd) calc.set_digits();
+      else if (t.kind == modcmd) calc.set_mod();
+      else if (t.kind == savecmd) calc.save_result();
+      else if (t.kind == defcmd) calc.def_function();
+      else if (t.kind == jobscmd) jobs.list(cout);
+      else if (t.kind == waitcmd) {
+        jobs.wait(job_number(ts));
+        finish_jobs(calc, jobs, screen);
+      }
       else {
         ts.putback(t);
-        cout << result << statement() << '\n';
+        calc.last_result = calc.statement();
+        cout << result << flush;
+        put_result(screen, calc.last_result, Format::exact, calc.digits_format);
+        screen.flush();
       }
 
     }
     catch(exception& e) {
+        screen.flush();
         cerr << e.what() << '\n';
-        clean_up_mess();
+        calc.clean_up_mess();
       }
 }
 
 
-int main()
+int batch(Calculator& calc, const string& in, const string& out_name, Format f)
+    // returns the number of statements that failed
+{
+    Token_stream& ts = calc.ts;
+    return batch_files(ts, in, out_name, [&](Output_buffer& out) {
+        return batch_statements(ts, out, [&](int& line) {
+            Token t = ts.get();
+            while (t.kind == print) t = ts.get();
+            line = ts.line();
+            if (t.kind == quit) return false;
+            else if (t.kind == digitscmd) calc.set_digits();
+            else if (t.kind == modcmd) calc.set_mod();
+            else if (t.kind == savecmd) calc.save_result();
+            else if (t.kind == defcmd) calc.def_function();
+            else if (t.kind != help) {          // no help in batch mode
+                ts.putback(t);
+                calc.last_result = calc.statement();
+                put_result(out, calc.last_result, f, calc.digits_format);
+            }
+            return true;
+        }, [&] { calc.clean_up_mess(); });
+    });
+}
+
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  Server mode:  count --serve /tmp/count.sock [--workers N] [--exact | --decimal]
+
+    See server.h.  Each connection gets a Calculator of its own, set up the
+    way calculate() is (digits 1000), and each line it sends is answered the
+    way calculate() would print it.  Clients may not save to files.
+*/
+
+string answer(Calculator& calc, const string& line, Format f)
+{
+    Output_buffer out;          // in memory
+    try {
+        Integer r = calc.evaluate(line);
+        out.put(result);
+        put_result(out, r, f, calc.digits_format);
+    }
+    catch(exception& e) {
+        out.put(string("error: ") + e.what() + '\n');
+    }
+    return out.take();
+}
+
+void serve(const string& path, int workers, Format f)
+{
+    serve_calculators<Calculator>(path, workers,
+        [f](Calculator& calc, const string& line) { return answer(calc, line, f); },
+        [](Calculator& calc) {
+            calc.digits_format = Digits_format{Digits_mode::ends, 1000};
+            calc.allow_save = false;
+        });
+}
+
+
+int main(int argc, char* argv[])
 try {
    //st.declare("pi", 4*atan(1), true);       // hardcoded constants
    //st.declare("e", 2.7182818284, true);
 
+   string in;
+   string out = "-";
+   string socket_path;
+   int workers = worker_count();
+   Format format = Format::exact;
+   for (int i = 1; i < argc; ++i) {
+       string arg = argv[i];
+       if (arg == "--batch" && i+1 < argc) in = argv[++i];
+       else if (arg == "--out" && i+1 < argc) out = argv[++i];
+       else if (arg == "--serve" && i+1 < argc) socket_path = argv[++i];
+       else if (arg == "--workers" && i+1 < argc) workers = stoi(argv[++i]);
+       else if (arg == "--exact") format = Format::exact;
+       else if (arg == "--decimal") format = Format::decimal;
+       else error("usage: count [--batch in.txt [--out results.txt] | --serve socket [--workers n]]"
+                  " [--exact | --decimal]");
+   }
+   if (!socket_path.empty()) {
+       serve(socket_path, workers, format);
+       return 0;
+   }
+   Calculator calc;
+   if (!in.empty()) return batch(calc, in, out, format) ? 1 : 0;
+
+   calc.digits_format = Digits_format{Digits_mode::ends, 1000};    // a screenful, not a million digits
+   calc.ts.from_fd(0);          // standard input
    cout << "Big Integer Calculator (type ? for help)\n";
-   calculate();
+   calculate(calc);
    // keep_window_open();  // cope with Windows console mode
    return 0;
 }
@@ -116,10 +116,16 @@ Original:  2 December 2018
 
 
 #include "std_lib_facilities.h"
+#include <string_view>
 #include <cstdio>
 //#include <iomanip>
 //#include <cmath>  // for lgamma()
 #include <gmpxx.h>   // g++ -lgmpxx -lgmp -g nPk_gmp.cpp -std=c++17 -o nPk
+#include "digits.h"      // digit counts, first/last digits
+#include "symbol_table.h"  // variables: names interned to slots
+#include "lazy_power.h"  // b^e kept as b and e until every digit is needed
+#include "budget.h"      // memory and time a statement may use
+#include "jobs.h"        // ^C stops a statement, not the calculator
 
 // SYMBOLIC CONSTANTS
 const char number = '8';
@@ -147,14 +153,18 @@ const char nCr = 'C';
 const char fnCr = 'c';    // don't need 'c' for cos when dealing with integers only
 const char nPr = 'P';
 const char fnPr = 'p';
+const char fnPowmod = 'm';
+const char digitscmd = 'D';
 //const string sqrtkey = "sqrt";
 const string expkey = "pow";
 const string ncrkey = "nCr";
 const string nprkey = "nPr";
+const string powmodkey = "powmod";
 //const string sinkey = "sin";
 //const string coskey = "cos";
 const string quitkey = "quit";
 const string helpkey = "help";
+const string digitskey = "digits";
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
 
@@ -171,6 +181,10 @@ public:
 
 class Token_stream {
 public:
+    Token_stream() { }                          // no input until told
+    explicit Token_stream(istream& s) : is{&s} { }
+    void from_stream(istream& s) { is = &s; full = false; }
+
     Token get();                // get a Token
     void putback(Token t);      // put a token back
     void ignore(char c);   // discard characters up to and including a c
@@ -179,6 +193,7 @@ private:
     bool full { false };   // is there a Token in the buffer?
     Token buffer {' '};    // here is where putback() stores a Token
                      // put back using putback()
+    istream* is { nullptr };   // where the characters come from (it used to be cin)
 };
 
 
@@ -194,7 +209,7 @@ void Token_stream::ignore(char c)
 
   // now search input
   char ch = 0;
-  while (cin >> ch)
+  while (is && *is >> ch)
       if (ch == c) return;
  }
 
@@ -215,10 +230,10 @@ Token Token_stream::get()
 
     char ch;
     //cin >> ch;              // note that >> skips whitespace
-    cin.get(ch);    // note that cin.get() does NOT skip whitespace
+    if (!is || !is->get(ch)) return Token(quit);    // get() does NOT skip whitespace
     while (isspace(ch)) {
        if (ch == '\n') return Token(print); // if newline detected,
-       cin.get(ch);                         // return print Token
+       if (!is->get(ch)) return Token(quit);  // return print Token
     }
 
     switch (ch) {
@@ -247,30 +262,33 @@ Token Token_stream::get()
         case '0': case '1': case '2': case '3': case '4':
         case '5': case '6': case '7': case '8': case '9':
             {
-                cin.putback(ch);    // put digit back into input stream
+                is->putback(ch);    // put digit back into input stream
                 double val;
-                cin >> val;
+                *is >> val;
+                if (!*is || !isfinite(val)) error("number too large");
                 return Token { number, val };  // let '8' represent a number
             }
         default:
             if (isalpha(ch)) {  // if it is a letter
                 string s;
                 s += ch;  // Put the letter in 's' because it has been already read
-                while (cin.get(ch) &&
+                while (is->get(ch) &&
                         ((isalpha(ch) || isdigit(ch) || ch == '_'))
                       )
                       s += ch;     // Continue to read in 's'
-               cin.putback(ch);    // Return the character into the stream
+               if (*is) is->putback(ch);    // Return the character into the stream
                if (s == declkey) return Token{let};    // declaration keyword
                else if (s == constkey) return Token{constant};
                else if (s == expkey) return Token{powexp};
                else if (s == ncrkey) return Token{fnCr};
                else if (s == nprkey) return Token{fnPr};
+               else if (s == powmodkey) return Token{fnPowmod};
                //else if (s == sqrtkey) return Token{square_root};
               // else if (s == sinkey) return Token{c_sin};
               // else if (s == coskey) return Token{c_cos};
                else if (s == quitkey) return Token{quit};
                else if (s == helpkey) return Token{help};
+               else if (s == digitskey) return Token{digitscmd};
                else return Token{name, s};
             }
             error("Bad token");
@@ -287,69 +305,48 @@ Token Token_stream::get()
 */
 // * * * *
 
-class Variable {
-public:
-    string name;
-    mpz_class value;
-    bool constant;
-    Variable(string n, mpz_class v, bool c = false)
-        : name{n}, value{v}, constant{c} { }
-};
-
-class Symbol_table {
-    vector<Variable> var_table;
-public:
-    bool is_declared(string);
-    mpz_class get(string);
-    mpz_class set(string, mpz_class);
-    mpz_class declare(string, mpz_class, bool con = false);
-};
+using Symbol_table = Basic_symbol_table<Lazy_integer>;    // see symbol_table.h
+using Variable = Symbol_table::Variable;
 
-bool Symbol_table::is_declared(string var)
-    // is var already in var_table?
-{
-    for (const Variable& v : var_table)
-        if (v.name == var) return true;
-    return false;
-}
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  ^ gives a Lazy_integer (lazy_power.h): a big power stays base and exponent
+    until something needs its digits.  % takes it through powmod(), another ^
+    multiplies the exponents, and printing with "digits count" or "digits N"
+    works out the count and the first digits with logarithms and the last
+    ones mod 10^N.  * / + - ! C and P build it first.
+*/
 
-mpz_class Symbol_table::get(string s)
-    // return the value of the Variable named s
-{
-    for (const Variable& v : var_table)
-        if (v.name == s) return v.value;
-    error("get: undefined variable ", s);
-}
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+// st and ts belong to the Calculator, not to the program (see README.md)
 
-mpz_class Symbol_table::set(string s, mpz_class d)
-    // set the Variable named s to d
-{
-    for (Variable& v : var_table)
-        if (v.name == s) {
-            if (v.constant) error("Can't overwrite constant variable");
-            v.value = d;
-            return d;
-        }
-    error("set: undefined variable ", s);
-}
+class Calculator {
+public:
+    Calculator() { }
+    mpz_class evaluate(string_view s);   // run the statements in s, the value of the last
 
-mpz_class Symbol_table::declare(string var, mpz_class val, bool con)
-    // add {var,val,con} to var_table
-{
-    if (is_declared(var)) error(var, " declared twice");
-    var_table.push_back(Variable{var,val,con});
-    return val;
-}
+    Symbol_table st;            // allows Variable storage and retrieval
+    Token_stream ts;            // provides get() and putback()
+    Digits_format digits_format;  // how results are shown: see digits.h
 
-// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
-// globals(?)
+    Lazy_integer statement();
+    void set_digits();
+    void clean_up_mess();
 
-Symbol_table st;            // allows Variable storage and retrieval
-Token_stream ts;            // provides get() and putback()
+private:
+    Lazy_integer declaration(bool b);
+    Lazy_integer expression();
+    Lazy_integer term();
+    Lazy_integer secondary();
+    Lazy_integer primary();
+    Lazy_integer handle_variable(Token& t);
+    mpz_class calc_nCk();
+    mpz_class calc_nPk();
+    Lazy_integer calc_pow();
+    mpz_class calc_powmod();
+};
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
-// forward declaration for primary() to call
-mpz_class expression();
+// (expression() is declared in Calculator, for primary() to call)
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
 // additional calculator functions
@@ -393,6 +390,7 @@ double calc_cos()
 
 mpz_class factorial(mpz_class n)
 {
+    check_result_bits(factorial_bits(n), "factorial");
     mpz_class result(n); // initialize an arbitrary-sized integer with 'n'
     if (n == 0) return 1;
     while(n-- > 1) result *= n; // compute the product with every integers < n
@@ -403,14 +401,14 @@ mpz_class nCk(mpz_class n, mpz_class k)  {
     return factorial(n)/(factorial(n-k) * factorial(k) );
 }
 
-mpz_class calc_nCk()
+mpz_class Calculator::calc_nCk()
 {
     Token t = ts.get();
     if (t.kind != '(') error("'(' expected");
-    mpz_class n = expression();
+    mpz_class n = expression().value();
     t = ts.get();
     if (t.kind != ',') error("',' expected");
-    mpz_class k = expression();
+    mpz_class k = expression().value();
     t = ts.get();
     if (t.kind != ')') error("')' expected");
     return nCk(n, k);
@@ -420,65 +418,104 @@ mpz_class nPk(mpz_class n, mpz_class k)  {
     return factorial(n)/factorial(n-k);
 }
 
-mpz_class calc_nPk()
+mpz_class Calculator::calc_nPk()
 {
     Token t = ts.get();
     if (t.kind != '(') error("'(' expected");
-    mpz_class n = expression();
+    mpz_class n = expression().value();
     t = ts.get();
     if (t.kind != ',') error("',' expected");
-    mpz_class k = expression();
+    mpz_class k = expression().value();
     t = ts.get();
     if (t.kind != ')') error("')' expected");
     return nPk(n, k);
 }
-mpz_class calc_pow()
+Lazy_integer Calculator::calc_pow()
 {
     Token t = ts.get();
     if (t.kind != '(') error("'(' expected");
-    mpz_class base = expression();
+    Lazy_integer base = expression();
     t = ts.get();
     if (t.kind != ',') error("',' expected");
-    mpz_class power = expression();
+    mpz_class power = expression().value();
     t = ts.get();
     if (t.kind != ')') error("')' expected");
+    return Lazy_integer::power(base, power);
+}
+
+mpz_class powmod(const mpz_class& base, const mpz_class& power, const mpz_class& m)
+    // base^power % m by mpz_powm: base^power itself is never built, and the
+    // power can be as big as we like.  Like % the result has the sign of
+    // base^power; a negative power needs the inverse of base modulo m.
+{
+    if (m == 0) error("%:divide by zero");
+    mpz_class mod = abs(m);
+    mpz_class b = base;
+    mpz_class e = power;
+    if (e < 0) {
+        if (mpz_invert(b.get_mpz_t(), b.get_mpz_t(), mod.get_mpz_t()) == 0)
+            error("powmod: no inverse for a negative power");
+        e = -e;
+    }
     mpz_class result;
-    mpz_pow_ui(result.get_mpz_t(), base.get_mpz_t(), power.get_ui());
+    mpz_powm(result.get_mpz_t(), b.get_mpz_t(), e.get_mpz_t(), mod.get_mpz_t());
+    if (base < 0 && mpz_odd_p(power.get_mpz_t()) && result != 0) result -= mod;
     return result;
 }
 
-mpz_class handle_variable(Token& t)
+mpz_class Calculator::calc_powmod()
+    // powmod(base, power, modulus)
+{
+    Token t = ts.get();
+    if (t.kind != '(') error("'(' expected");
+    mpz_class base = expression().value();
+    t = ts.get();
+    if (t.kind != ',') error("',' expected");
+    mpz_class power = expression().value();
+    t = ts.get();
+    if (t.kind != ',') error("',' expected");
+    mpz_class m = expression().value();
+    t = ts.get();
+    if (t.kind != ')') error("')' expected");
+    return powmod(base, power, m);
+}
+
+Lazy_integer Calculator::handle_variable(Token& t)
 {
+    int var = st.find(t.name);      // resolve the name once, use the slot
     Token t2 = ts.get();
-    if (t2.kind == '=')
-        return st.set(t.name, expression());
+    if (t2.kind == '=') {
+        if (var < 0) error("set: undefined variable ", t.name);
+        return st.set(var, expression());
+    }
     else {
         ts.putback(t2);
-        return st.get(t.name);       // missing in text!
+        if (var < 0) error("get: undefined variable ", t.name);
+        return st.get(var);       // missing in text!
     }
 }
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
 // input grammar functions
-mpz_class secondary();  // declare here so as to allow square_root unary operator
+// secondary() is declared in Calculator so as to allow square_root unary operator
                      // to bind factorial ! tighter than @ (sqrt)
                      // This makes @6! ---> @(6!), otherwise if r = primary(),
                      // then @6! ---> (@6)! which is factorial of double. not int
 
-mpz_class primary()            // deal with numbers and parenthesis/braces
+Lazy_integer Calculator::primary()            // deal with numbers and parenthesis/braces
 {
     Token t = ts.get();
     switch (t.kind) {
         case '(':                   // handle '(' expression ')'
             {
-                mpz_class d = expression();
+                Lazy_integer d = expression();
                 t = ts.get();
                 if (t.kind != ')') error("')' expected");
                 return d;
             }
         case '{':
             {
-                mpz_class d = expression();
+                Lazy_integer d = expression();
                 t = ts.get();
                 if (t.kind != '}') error("'}' expected");
                 return d;
@@ -505,6 +542,8 @@ mpz_class primary()            // deal with numbers and parenthesis/braces
     */
         case powexp:
               return calc_pow();
+        case fnPowmod:
+              return calc_powmod();
 
         case fnCr:
              return calc_nCk();
@@ -515,10 +554,10 @@ mpz_class primary()            // deal with numbers and parenthesis/braces
     }
 }
 
-mpz_class secondary()
+Lazy_integer Calculator::secondary()
     // ex 3 - Add a factorial operator '!'
 {
-    mpz_class left = primary();
+    Lazy_integer left = primary();
     Token t = ts.get();
 
   while (true) {
@@ -530,7 +569,7 @@ mpz_class secondary()
                 left *= i;
 */
 // replace with Big Integer mpz_class version
-        mpz_class fac  = factorial(left);
+        mpz_class fac  = factorial(left.value());
         left = fac;
          t = ts.get();
         }
@@ -541,57 +580,56 @@ mpz_class secondary()
     }
 }
 
-mpz_class term()               // deal with * and /
+Lazy_integer Calculator::term()               // deal with * and /
 {
-    mpz_class left = secondary();
+    Lazy_integer left = secondary();
     Token t = ts.get();             // get next token from Token_stream
 
     while (true) {
+        check_budget();
         switch (t.kind) {
             case '*':
-                left *= secondary();
+                left = mpz_class(left.value() * secondary().value());
                 t = ts.get();
                 break;
             case '/':
                 {
-                    mpz_class d = secondary();
+                    mpz_class d = secondary().value();
                     if (d == 0) error("divide by zero");
-                    left /= d;
+                    left = mpz_class(left.value() / d);
                     t = ts.get();
                     break;
                 }
 
             case '%':
             {
-                mpz_class d = primary();
+                mpz_class d = primary().value();
                 if (d == 0) error("%:divide by zero");
                 // for C:
                 // mpz_t temp;
                 // mpz_mod (temp, left.get_mpz_t(), d.get_mpz_t());
                 // left = mpz_class(temp);
                 // for C++:
-                left = left % d;
+                if (left.lazy())        // a ^ b % m: reduce as we go instead of building a^b
+                    left = powmod(left.base(), left.exponent(), d);
+                else
+                    left = mpz_class(left.value() % d);
                 t = ts.get();
                 break;
             }
 
          case exponent:
-          {
-            mpz_class result;
-            mpz_class power = secondary();
-            mpz_pow_ui(result.get_mpz_t(), left.get_mpz_t(), power.get_ui());
-            left = result;
+            left = Lazy_integer::power(left, secondary().value());
             t = ts.get();
             break;
-        }
 
         case nCr:
-               left = nCk(left, secondary());
+               left = nCk(left.value(), secondary().value());
                t = ts.get();
                break;
 
         case nPr:
-              left = nPk(left, secondary());
+              left = nPk(left.value(), secondary().value());
               t = ts.get();
               break;
         default:
@@ -601,19 +639,20 @@ mpz_class term()               // deal with * and /
     }
 }
 
-mpz_class expression()         // deal with + and -
+Lazy_integer Calculator::expression()         // deal with + and -
 {
-    mpz_class left = term();           // read and evaluate a term
+    Lazy_integer left = term();           // read and evaluate a term
     Token t = ts.get();             // get next token from Token_stream
 
     while (true) {
+        check_budget();
         switch (t.kind) {
             case '+':
-                left += term();     // evaluate term and add
+                left = mpz_class(left.value() + term().value());     // evaluate term and add
                 t = ts.get();
                 break;
             case '-':
-                left -= term();     // evaluate term and subtract
+                left = mpz_class(left.value() - term().value());     // evaluate term and subtract
                 t = ts.get();
                 break;
             default:
@@ -624,7 +663,7 @@ mpz_class expression()         // deal with + and -
 }
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
-mpz_class declaration(bool b)
+Lazy_integer Calculator::declaration(bool b)
     // assume we have seen "let" or "constant"
     // handle: name = expression
     // declare a variable called "name" with the initial value "expression"
@@ -632,17 +671,19 @@ mpz_class declaration(bool b)
     Token t = ts.get();
     if (t.kind != name) error("name expected in declaration");
     string var_name = t.name;
+    int var = st.slot(var_name);
 
     Token t2 = ts.get();
     if (t2.kind != '=') error("= missing in declaration of ", var_name);
 
-    mpz_class d = expression();
-    st.declare(var_name, d, b);
+    Lazy_integer d = expression();
+    st.declare(var, d, b);
     return d;
 }
 
-mpz_class statement()  // handles declarations and expressions
+Lazy_integer Calculator::statement()  // handles declarations and expressions
 {
+    Statement_budget budget;        // memory and time, see budget.h
     Token t = ts.get();
     switch (t.kind) {
         case let:
@@ -678,34 +719,98 @@ void print_help()
          << "Note about integer division and powers:\n"
          << "8^(1/3) = 1 (if you need = 2, then use 'hc' which handles doubles)\n"
          << "pow(45, 2) = 2025, 45^2 = 2025, 5C3^2 = 100\n\n"
+         << "Huge powers are only worked out when needed: 2^(10^9) % 1000 = 376,\n"
+         << "'digits count' shows 2^(10^9) has 301029996 digits, 'digits 10'\n"
+         << "its first and last 10, 'digits all' (the default) every one\n\n"
+         << "A statement may use 1024 MB and as long as it likes; set CALC_MAX_MEMORY\n"
+         << "(MB, 0 for no limit) and CALC_MAX_TIME (seconds) to change that;\n"
+         << "^C stops the statement being worked out\n\n"
          << "Variable assignment is provided using the 'let' keyword:\n"
          << "- ex: let x = 37; x * 2 = 74; x = 4; x * 2 = 8\n\n";
 }
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
 
-void clean_up_mess()  {
+void Calculator::clean_up_mess()  {
     ts.ignore(print);
 }
 
-void calculate()   //expression evaluation loop
+mpz_class Calculator::evaluate(string_view s)
+    // run the statements in s; help is ignored and errors are thrown;
+    // "digits" works, though only the value of the last one comes back
+{
+    istringstream in{string(s)};
+    ts.from_stream(in);
+    Lazy_integer last = 0;
+    try {
+        while (true) {
+            Token t = ts.get();
+            while (t.kind == print) t = ts.get();
+            if (t.kind == quit) break;
+            if (t.kind == help) continue;
+            if (t.kind == digitscmd) {
+                set_digits();
+                continue;
+            }
+            ts.putback(t);
+            last = statement();
+        }
+    }
+    catch (...) {
+        ts = Token_stream{};        // in is gone after this
+        throw;
+    }
+    ts = Token_stream{};
+    return last.value();
+}
+
+void Calculator::set_digits()
+    // assume we have seen "digits"
+    // handle: all | count | N
 {
+    Token t = ts.get();
+    if (t.kind == name && t.name == "all") digits_format = Digits_format{Digits_mode::all, 0};
+    else if (t.kind == name && t.name == "count") digits_format = Digits_format{Digits_mode::count, 0};
+    else if (t.kind == number && t.value > 0 && t.value.fits_ulong_p())
+        digits_format = Digits_format{Digits_mode::ends, t.value.get_ui()};
+    else error("digits: all, count or a number of digits expected");
+}
+
+struct Stream_out {
+    // put_lazy() writes through put(), like the Output_buffer of count
+    ostream& os;
+    void put(const char* s, size_t n) { os.write(s, n); }
+};
+
+void calculate(Calculator& calc)   //expression evaluation loop
+{
+  Token_stream& ts = calc.ts;
+  catch_interrupts();
   while (cin)
     try {
       cout << prompt;
       Token t = ts.get();
       while (t.kind == print) t = ts.get();  // eats ';' to discard extra 'prints'
+      interrupt_requested = false;           // a ^C at the prompt stops nothing
       if (t.kind == help) print_help();
       else if (t.kind == quit)  return;  // for a clean exit!
+      else if (t.kind == digitscmd) calc.set_digits();
       else {
         ts.putback(t);
-        cout << result << statement() << '\n';
+        Lazy_integer r = calc.statement();
+        ostringstream os;               // all of it, or an error and none of it
+        Stream_out out{os};
+        {
+            Statement_budget budget;    // printing may build the power
+            put_lazy(out, r, calc.digits_format);
+        }
+        cout << result << os.str() << '\n';
       }
 
     }
     catch(exception& e) {
         cerr << e.what() << '\n';
-        clean_up_mess();
+        calc.clean_up_mess();
       }
 }
 
@@ -718,7 +823,9 @@ try {
    cout << "Big Integer Calculator with Exponentiation and Modulus\n"
         << "(type ? for help)\n\n";
         
-   calculate();
+   Calculator calc;
+   calc.ts.from_stream(cin);
+   calculate(calc);
    // keep_window_open();  // cope with Windows console mode
    return 0;
 }
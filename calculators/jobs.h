@@ -0,0 +1,162 @@
+/*
+   jobs.h
+
+   ^C and background statements for the REPLs of count and qc.
+
+   ^C used to kill the calculator, variables, functions and all.  Now it
+   stops the statement being worked out and goes back to the prompt with
+   everything as it was before that statement: catch_interrupts() points
+   the budget of the REPL's thread at interrupt_requested (see budget.h),
+   so the statement fails with "interrupted" at its next check_budget(), in
+   a loop of the parser or of a kernel, worker threads included.  It is
+   cooperative: one huge GMP multiplication finishes first.
+
+   A statement that ends with '&' runs on a thread of its own, and the
+   prompt comes right back:
+       > let f = 1000000! &
+       [1] let f = 1000000!
+       > jobs
+       [1] running  let f = 1000000!
+       > wait
+       [1] done  let f = 1000000!
+       = 8263931688...
+   A job works on a copy of the variables and functions as they were when
+   it started, so the REPL may go on changing them.  When it is done (and
+   the REPL notices, before its next prompt or in "wait") its result is
+   printed, and if it was "let x = ...", "constant x = ..." or "x = ..."
+   that is done to the REPL's own variables then.  "wait" waits for every
+   job, "wait 2" for job 2; ^C stops the waiting, not the jobs.  Quitting
+   stops the jobs that are still running.
+
+   Job_table knows nothing about Integers or Rationals: start() takes the
+   function the job runs, and done() hands back the finished jobs for the
+   REPL to print and apply.
+*/
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include "std_lib_facilities.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "budget.h"
+
+inline atomic<bool> interrupt_requested { false };     // set by ^C
+
+inline void catch_interrupts()
+    // from now on ^C stops the statement this thread is working out
+{
+    budget_state().stop = &interrupt_requested;
+    signal(SIGINT, [](int) { interrupt_requested = true; });
+}
+
+template<class Value>
+class Job_table {
+public:
+    struct Job {
+        int id;
+        string text;                // the statement, without its '&'
+        atomic<bool> stop { false };
+        bool done { false };        // under guard
+        Value value;                // once done, unless there is an error
+        string error;
+        thread worker;
+    };
+
+    Job_table() = default;
+    ~Job_table();               // stops what is still running
+    Job_table(const Job_table&) = delete;
+    Job_table& operator=(const Job_table&) = delete;
+
+    template<class Run>
+    const Job& start(const string& text, Run run);     // run() -> Value, on a thread
+    vector<unique_ptr<Job>> done();     // the finished ones, taken out of the table
+    void list(ostream& os);             // "[1] running  ..." for each one
+    void wait(int id);                  // until job id (0: every job) is done, or ^C
+
+private:
+    vector<unique_ptr<Job>> jobs;       // in the order they were started
+    int last_id { 0 };
+    mutex guard;                        // for the done flags
+    condition_variable finished;
+};
+
+template<class Value>
+template<class Run>
+const typename Job_table<Value>::Job& Job_table<Value>::start(const string& text, Run run)
+{
+    auto job = make_unique<Job>();
+    Job* j = job.get();
+    j->id = ++last_id;
+    j->text = text;
+    j->worker = thread([this, j, run] () mutable {
+        budget_state().stop = &j->stop;
+        try {
+            j->value = run();
+        }
+        catch (exception& e) {
+            j->error = e.what();
+        }
+        {
+            lock_guard<mutex> held(guard);
+            j->done = true;
+        }
+        finished.notify_all();
+    });
+    jobs.push_back(move(job));
+    return *j;
+}
+
+template<class Value>
+vector<unique_ptr<typename Job_table<Value>::Job>> Job_table<Value>::done()
+{
+    vector<unique_ptr<Job>> r;
+    lock_guard<mutex> held(guard);
+    for (auto& j : jobs)
+        if (j->done) {
+            j->worker.join();
+            r.push_back(move(j));
+        }
+    jobs.erase(remove(jobs.begin(), jobs.end(), nullptr), jobs.end());
+    return r;
+}
+
+template<class Value>
+void Job_table<Value>::list(ostream& os)
+{
+    lock_guard<mutex> held(guard);
+    for (auto& j : jobs)
+        os << '[' << j->id << "] " << (j->done ? "done     " : "running  ") << j->text << '\n';
+}
+
+template<class Value>
+void Job_table<Value>::wait(int id)
+{
+    unique_lock<mutex> held(guard);
+    if (id && none_of(jobs.begin(), jobs.end(), [id](auto& j) { return j->id == id; }))
+        error("wait: no job ", to_string(id));
+    auto waiting = [this, id] {
+        for (auto& j : jobs)
+            if ((id == 0 || j->id == id) && !j->done) return true;
+        return false;
+    };
+    interrupt_requested = false;
+    while (waiting()) {
+        if (interrupt_requested) error("wait: interrupted");
+        finished.wait_for(held, chrono::milliseconds(100));
+    }
+}
+
+template<class Value>
+Job_table<Value>::~Job_table()
+{
+    for (auto& j : jobs) j->stop = true;
+    for (auto& j : jobs) j->worker.join();
+}
+
+#endif // JOBS_H
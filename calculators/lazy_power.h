@@ -0,0 +1,197 @@
+/*
+   lazy_power.h
+
+   Powers too big to work out, for integer_calculator2.cpp (count2).
+   2^(10^9) has 301029996 digits and takes a billion bits to hold, but
+       2^(10^9) % 1000                 only needs mpz_powm
+       how many digits it has          1 + floor(10^9 * log10 2)
+       its first digits                10^frac(10^9 * log10 2)
+       its last digits                 2^(10^9) mod 10^n
+   so a Lazy_integer keeps b^e as the pair (b, e) when the power would be
+   bigger than lazy_bits, and value() builds it only when something has to
+   have every digit: *, +, !, or printing with "digits all".
+
+   The logarithms are fixed point, in units of 10^-d:
+       ln x    = k ln 2 + 2 atanh(z), x = 2^k m, m in [1, 2), z = (m-1)/(m+1)
+       10^f    = exp(f ln 10), by its series
+   with ln 2 and ln 10 from constants.h.  d is chosen so that the error in
+   e log10 b stays below 10^-(n+guard) for n leading digits; if the answer
+   is still too close to a boundary to be sure (a fraction just above 0, a
+   run of 9s), d is doubled and we try again.
+*/
+
+#ifndef LAZY_POWER_H
+#define LAZY_POWER_H
+
+#include "std_lib_facilities.h"
+#include <gmpxx.h>
+#include "constants.h"
+#include "digits.h"
+#include "budget.h"
+
+const unsigned long lazy_bits = 1 << 16;       // smaller powers are just worked out
+const unsigned long max_power_bits = 1ul << 36;    // what value() will try to build
+const unsigned long log_guard = 12;            // extra decimals in the logarithms
+const unsigned long max_log_digits = 1 << 22;
+
+class Lazy_integer {
+public:
+    Lazy_integer(long i = 0) : v{i} { }
+    Lazy_integer(const mpz_class& x) : v{x} { }
+    static Lazy_integer power(const Lazy_integer& b, const mpz_class& e);
+
+    bool lazy() const { return !built; }
+    const mpz_class& base() const { return b; }         // if lazy()
+    const mpz_class& exponent() const { return e; }     // if lazy(), > 0
+    const mpz_class& value() const;                     // every digit, built once
+    Lazy_integer operator-() const;
+
+private:
+    mutable mpz_class v;
+    mutable bool built { true };
+    mpz_class b;
+    mpz_class e;
+};
+
+inline Lazy_integer Lazy_integer::power(const Lazy_integer& x, const mpz_class& p)
+    // x^p; like /, a negative p gives the integer part of 1/x^|p|
+{
+    mpz_class base = x.lazy() ? x.b : x.v;
+    mpz_class exp = x.lazy() ? x.e * p : p;
+    if (base == 0 && exp < 0) error("divide by zero");
+    if (base == 0 || base == 1 || exp == 0) return exp == 0 ? 1 : base;
+    if (base == -1) return mpz_odd_p(exp.get_mpz_t()) ? -1 : 1;
+    if (exp < 0) return 0;
+
+    Lazy_integer r;
+    r.b = base;
+    r.e = exp;
+    r.built = false;
+    if (exp * mpz_sizeinbase(base.get_mpz_t(), 2) <= lazy_bits) r.value();
+    return r;
+}
+
+inline const mpz_class& Lazy_integer::value() const
+{
+    if (built) return v;
+    if (e * mpz_sizeinbase(b.get_mpz_t(), 2) > max_power_bits)
+        error("^: too big to work out in full (ask for its digits, or % it)");
+    check_result_bits(power_bits(b, e), "^");
+    mpz_pow_ui(v.get_mpz_t(), b.get_mpz_t(), e.get_ui());
+    built = true;
+    return v;
+}
+
+inline Lazy_integer Lazy_integer::operator-() const
+{
+    if (lazy() && mpz_odd_p(e.get_mpz_t())) {        // -(b^e) = (-b)^e
+        Lazy_integer r = *this;
+        r.b = -b;
+        return r;
+    }
+    return Lazy_integer(mpz_class(-value()));
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+// logarithms in fixed point
+
+inline mpz_class fixed_ln(const mpz_class& x, unsigned long d)
+    // ln(x) * 10^d for x >= 1, a few units off in the last place for each bit of x
+{
+    mpz_class s = ten_to(d);
+    unsigned long k = mpz_sizeinbase(x.get_mpz_t(), 2) - 1;    // 2^k <= x < 2^(k+1)
+    mpz_class m = (x * s) >> k;
+    mpz_class z = (m - s) * s / (m + s);
+    mpz_class z2 = z * z / s;
+    mpz_class t = z;
+    mpz_class sum = z;
+    for (unsigned long i = 3; t != 0; i += 2) {
+        t = t * z2 / s;
+        sum += t / i;
+    }
+    return 2*sum + k * constant_digits(Constant::ln2, d);
+}
+
+inline mpz_class fixed_exp(const mpz_class& y, unsigned long d)
+    // e^y * 10^d for y = 0 to 3 * 10^d (y in units of 10^-d)
+{
+    mpz_class s = ten_to(d);
+    mpz_class t = s;
+    mpz_class sum = s;
+    for (unsigned long i = 1; t != 0; ++i) {
+        t = t * y / (s * i);
+        sum += t;
+    }
+    return sum;
+}
+
+inline bool near_boundary(const mpz_class& x, const mpz_class& s, const mpz_class& tol)
+    // is x mod s within tol of a multiple of s?
+{
+    mpz_class r = x % s;
+    return r < tol || r > s - tol;
+}
+
+inline void power_digits(const mpz_class& b, const mpz_class& e, size_t n,
+                         mpz_class& count, string& first)
+    // |b|^e has count digits, and its first n are first (|b| >= 2, e >= 1)
+{
+    mpz_class a = abs(b);
+    size_t j = digit_count(a) - 1;
+    if (a == ten_to(j)) {                           // 10^(j e): no logarithms
+        count = e * j + 1;
+        first = "1" + string(n - 1, '0');
+        return;
+    }
+    unsigned long bits = mpz_sizeinbase(a.get_mpz_t(), 2);
+    unsigned long d = digit_count(e) + digit_count(mpz_class(bits)) + 2 + n + log_guard;
+    for (; d <= max_log_digits; d *= 2) {
+        mpz_class s = ten_to(d);
+        mpz_class ln10 = constant_digits(Constant::ln10, d);
+        mpz_class x = e * (fixed_ln(a, d) * s / ln10);     // e log10 a
+        mpz_class frac = x % s;
+        if (near_boundary(x, s, ten_to(d - n - log_guard))) continue;
+        mpz_class lead = fixed_exp(frac * ln10 / s, d) * ten_to(n - 1);
+        if (near_boundary(lead, s, ten_to(d - log_guard + 1))) continue;
+        count = x / s + 1;
+        first = mpz_class(lead / s).get_str();
+        return;
+    }
+    error("digits: too close to call");
+}
+
+inline string power_last_digits(const mpz_class& b, const mpz_class& e, size_t n)
+    // the last n digits of |b|^e, zeros included
+{
+    mpz_class a = abs(b);
+    mpz_class m = ten_to(n);
+    mpz_class r;
+    mpz_powm(r.get_mpz_t(), a.get_mpz_t(), e.get_mpz_t(), m.get_mpz_t());
+    string s = r.get_str();
+    if (s.size() < n) s.insert(0, n - s.size(), '0');
+    return s;
+}
+
+template<class Out>
+void put_lazy(Out& out, const Lazy_integer& x, const Digits_format& f)
+    // x as f says, like put_integer(); only "all" builds a lazy power
+{
+    if (!x.lazy() || f.mode == Digits_mode::all) {
+        put_integer(out, x.value(), f);
+        return;
+    }
+    mpz_class k;
+    string first;
+    power_digits(x.base(), x.exponent(), max<size_t>(f.n, 1), k, first);
+    if (f.mode == Digits_mode::ends && k <= 2*f.n) {
+        put_integer(out, x.value(), f);
+        return;
+    }
+    string s = x.base() < 0 && mpz_odd_p(x.exponent().get_mpz_t()) ? "-" : "";
+    if (f.mode == Digits_mode::ends)
+        s += first + "..." + power_last_digits(x.base(), x.exponent(), f.n) + ' ';
+    s += '(' + k.get_str() + " digits)";
+    out.put(s.data(), s.size());
+}
+
+#endif // LAZY_POWER_H
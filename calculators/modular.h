@@ -0,0 +1,319 @@
+/*
+   modular.h
+
+   Arithmetic modulo p for count's "mod p" mode:
+
+       Modulus m(p);
+       m.reduce(a)           a mod p, in [0, p)
+       m.add(a, b), m.sub(a, b), m.mul(a, b)
+       m.div(a, b)           a times the inverse of b (an error if there is none)
+       m.pow(a, e)           a^e, e any integer (e < 0 inverts a)
+       m.factorial(n), m.binomial(n, k), m.falling(n, k)
+
+   For p < 2^63 the residues are machine words.  Products go through
+   Montgomery's reduction when p is odd: with R = 2^64, a number x is kept as
+   xR mod p, and REDC(t) = t/R mod p needs two multiplications and a shift
+   instead of a 128 by 64 bit division.  An even p uses the division.  Bigger
+   p are done in GMP.
+
+   For a prime p < 2^63 (checked with mpz_probab_prime_p) the factorials
+   0!, 1!, ..., N! and their inverses are kept in tables, grown to what we are
+   asked for (at most table_limit entries), so after the first call
+       n!      is one lookup
+       C(n,k)  is n! / (k! (n-k)!), two multiplications
+       P(n,k)  is n! / (n-k)!, one
+   The inverse of N! costs one extended Euclid; the others come from
+   1/(i-1)! = i * 1/i!, going down.
+*/
+
+#ifndef MODULAR_H
+#define MODULAR_H
+
+#include "std_lib_facilities.h"
+#include <cstdint>
+#include <gmpxx.h>
+#include "combinatorics.h"
+#include "hybrid_number.h"
+
+typedef unsigned __int128 uint128;
+
+const size_t table_limit = 1 << 24;         // factorials kept, 256 MB for both tables
+const uint64_t max_mod_steps = 1ull << 30;  // multiplications without a table
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+
+struct Montgomery {
+    uint64_t n { 1 };       // odd, < 2^63
+    uint64_t neg_inv { 0 }; // -1/n mod 2^64
+    uint64_t r2 { 0 };      // R^2 mod n
+
+    Montgomery() { }
+    explicit Montgomery(uint64_t m) : n{m}
+    {
+        uint64_t inv = n;                       // right in the last 3 bits
+        for (int i = 0; i < 5; ++i) inv *= 2 - n*inv;   // 6, 12, 24, 48, 96 bits
+        neg_inv = -inv;
+        uint64_t r = uint64_t((uint128(1) << 64) % n);
+        r2 = uint64_t(uint128(r) * r % n);
+    }
+
+    uint64_t redc(uint128 t) const
+        // t/R mod n, for t < nR; t + m n < 2nR < 2^128 since n < 2^63
+    {
+        uint64_t m = uint64_t(t) * neg_inv;
+        uint64_t u = uint64_t((t + uint128(m) * n) >> 64);
+        return u >= n ? u - n : u;
+    }
+    uint64_t mul(uint64_t a, uint64_t b) const { return redc(uint128(a) * b); }
+    uint64_t to(uint64_t a) const { return mul(a, r2); }
+    uint64_t from(uint64_t a) const { return redc(a); }
+};
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+
+class Modulus {
+public:
+    explicit Modulus(const Integer& p);
+
+    Integer value() const { return Integer(big); }
+    Integer reduce(const Integer& a) const;
+    Integer add(const Integer& a, const Integer& b) const;
+    Integer sub(const Integer& a, const Integer& b) const;
+    Integer mul(const Integer& a, const Integer& b) const;
+    Integer div(const Integer& a, const Integer& b) const;
+    Integer pow(const Integer& a, const Integer& e) const;
+    Integer factorial(const Integer& n);
+    Integer binomial(const Integer& n, const Integer& k);
+    Integer falling(const Integer& n, const Integer& k);
+
+private:
+    mpz_class big;              // p
+    bool word;                  // p < 2^63
+    bool prime;
+    uint64_t w { 0 };           // p, when word
+    bool odd { false };
+    Montgomery mont;
+    vector<uint64_t> fact;      // i! in the form of to()
+    vector<uint64_t> inv_fact;  // 1/i!, the same; only for a prime
+
+    // the words, in Montgomery form when p is odd
+    uint64_t to(uint64_t a) const { return odd ? mont.to(a) : a; }
+    uint64_t from(uint64_t a) const { return odd ? mont.from(a) : a; }
+    uint64_t wmul(uint64_t a, uint64_t b) const
+        { return odd ? mont.mul(a, b) : uint64_t(uint128(a) * b % w); }
+    uint64_t wadd(uint64_t a, uint64_t b) const { return a >= w - b ? a - (w - b) : a + b; }
+
+    uint64_t wreduce(const Integer& a) const;
+    uint64_t winverse(uint64_t a) const;         // both not in the form of to()
+    uint64_t wpow(uint64_t a, unsigned long e) const;
+    uint64_t wproduct(uint64_t first, uint64_t count, bool down) const;
+    bool tabled(const Integer& n) const;      // n < p, and the tables may reach it
+    void grow_tables(uint64_t n);
+    Integer big_inverse(const Integer& a) const;
+    void check_argument(const Integer& n, const string& what) const;
+};
+
+inline Modulus::Modulus(const Integer& p)
+    : big{p.to_mpz()}
+{
+    if (big < 2) error("mod: the modulus must be at least 2");
+    word = big < (mpz_class(1) << 63);
+    prime = mpz_probab_prime_p(big.get_mpz_t(), 30) != 0;
+    if (word) {
+        w = p.small_value();
+        odd = w % 2;
+        if (odd) mont = Montgomery(w);
+    }
+}
+
+inline uint64_t Modulus::wreduce(const Integer& a) const
+{
+    if (a.is_small()) {
+        long r = a.small_value() % long(w);
+        return r < 0 ? r + w : r;
+    }
+    return mpz_fdiv_ui(a.to_mpz().get_mpz_t(), w);
+}
+
+inline Integer Modulus::reduce(const Integer& a) const
+{
+    if (word) return long(wreduce(a));
+    mpz_class r;
+    mpz_fdiv_r(r.get_mpz_t(), a.to_mpz().get_mpz_t(), big.get_mpz_t());
+    return r;
+}
+
+inline Integer Modulus::add(const Integer& a, const Integer& b) const
+{
+    if (word) return long(wadd(wreduce(a), wreduce(b)));
+    return reduce(a + b);
+}
+
+inline Integer Modulus::sub(const Integer& a, const Integer& b) const
+{
+    if (word) return long(wadd(wreduce(a), w - wreduce(b)));   // w - 0 == w is fine
+    return reduce(a - b);
+}
+
+inline Integer Modulus::mul(const Integer& a, const Integer& b) const
+{
+    if (word) return long(wmul(to(wreduce(a)), wreduce(b)));   // aR * b / R = ab
+    return reduce(a * b);
+}
+
+inline uint64_t Modulus::winverse(uint64_t a) const
+    // extended Euclid: s with a s = 1 mod w
+{
+    __int128 r0 = w, r1 = a, s0 = 0, s1 = 1;
+    while (r1 != 0) {
+        __int128 q = r0 / r1;
+        __int128 t = r0 - q*r1; r0 = r1; r1 = t;
+        t = s0 - q*s1; s0 = s1; s1 = t;
+    }
+    if (r0 != 1) error("mod: ", to_string(a) + " has no inverse modulo " + to_string(w));
+    return uint64_t(s0 < 0 ? s0 + w : s0);
+}
+
+inline Integer Modulus::big_inverse(const Integer& a) const
+{
+    mpz_class r;
+    if (mpz_invert(r.get_mpz_t(), a.to_mpz().get_mpz_t(), big.get_mpz_t()) == 0)
+        error("mod: no inverse modulo ", big.get_str());
+    return r;
+}
+
+inline Integer Modulus::div(const Integer& a, const Integer& b) const
+{
+    if (word) return long(wmul(to(wreduce(a)), winverse(wreduce(b))));
+    return reduce(a * big_inverse(reduce(b)));
+}
+
+inline uint64_t Modulus::wpow(uint64_t a, unsigned long e) const
+    // a^e, a and the result in the form of to()
+{
+    uint64_t r = to(1);
+    while (e) {
+        if (e & 1) r = wmul(r, a);
+        a = wmul(a, a);
+        e >>= 1;
+    }
+    return r;
+}
+
+inline Integer Modulus::pow(const Integer& a, const Integer& e) const
+{
+    if (word && e.is_small()) {
+        uint64_t x = wreduce(a);
+        long n = e.small_value();
+        if (n < 0) {
+            x = winverse(x);
+            n = -n;
+        }
+        return long(from(wpow(to(x), n)));
+    }
+    mpz_class r;
+    mpz_class x = reduce(a).to_mpz();
+    mpz_class n = e.to_mpz();
+    if (n < 0) {
+        x = big_inverse(x).to_mpz();
+        n = -n;
+    }
+    mpz_powm(r.get_mpz_t(), x.get_mpz_t(), n.get_mpz_t(), big.get_mpz_t());
+    return r;
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+// factorials
+
+inline void Modulus::check_argument(const Integer& n, const string& what) const
+{
+    if (n < 0) error(what, ": negative value");
+}
+
+inline bool Modulus::tabled(const Integer& n) const
+{
+    return word && n < value() && n.small_value() < long(table_limit);
+}
+
+inline void Modulus::grow_tables(uint64_t n)
+    // make fact (and for a prime, inv_fact) reach n < p, doubling as we go
+{
+    if (n < fact.size()) return;
+    uint64_t size = max<uint64_t>(n + 1, 2*fact.size());
+    size = min<uint64_t>(size, min<uint64_t>(table_limit, w));
+    if (fact.empty()) fact.push_back(to(1));
+    uint64_t i = fact.size();
+    fact.resize(size);
+    for (uint64_t x = to(i); i < size; ++i, x = wadd(x, to(1)))
+        fact[i] = wmul(fact[i-1], x);
+    if (!prime) return;
+    inv_fact.resize(size);
+    inv_fact[size-1] = to(winverse(from(fact[size-1])));    // no multiple of p in it
+    for (uint64_t j = size-1; j > 0; --j)
+        inv_fact[j-1] = wmul(inv_fact[j], to(j));
+}
+
+inline uint64_t Modulus::wproduct(uint64_t first, uint64_t count, bool down) const
+    // first (first-1) ... or first (first+1) ..., count factors, as plain words
+{
+    if (count > max_mod_steps) error("mod: too many factors to multiply");
+    uint64_t r = to(1);
+    uint64_t x = to(first % w);
+    uint64_t step = down ? to(w - 1) : to(1);       // -1 or +1
+    for (uint64_t i = 0; i < count; ++i) {
+        r = wmul(r, x);
+        x = wadd(x, step);
+    }
+    return from(r);
+}
+
+inline Integer Modulus::factorial(const Integer& n)
+{
+    check_argument(n, "factorial");
+    if (n >= value()) return 0;         // p itself is one of the factors
+    if (tabled(n)) {
+        grow_tables(n.small_value());
+        return long(from(fact[n.small_value()]));
+    }
+    if (word) return long(wproduct(n.small_value(), n.small_value(), true));
+    if (!n.to_mpz().fits_ulong_p() || n.to_mpz().get_ui() > max_mod_steps)
+        error("mod: too many factors to multiply");
+    mpz_class r = 1;
+    for (unsigned long i = 2; i <= n.to_mpz().get_ui(); ++i) r = r * i % big;
+    return r;
+}
+
+inline Integer Modulus::binomial(const Integer& n, const Integer& k)
+{
+    check_argument(n, "nCr");
+    if (k < 0 || k > n) return 0;
+    if (!word || !prime) return reduce(::binomial(n.to_mpz(), k.to_mpz()));
+    if (n >= value()) {                 // Lucas: C(n,k) = C(n/p,k/p) C(n%p,k%p)
+        Integer p = value();
+        return mul(binomial(n / p, k / p), binomial(n % p, k % p));
+    }
+    uint64_t a = n.small_value();
+    uint64_t b = k.small_value();
+    if (tabled(n)) {
+        grow_tables(a);
+        return long(from(wmul(wmul(fact[a], inv_fact[b]), inv_fact[a-b])));
+    }
+    b = min(b, a - b);                  // a < p, so b! has an inverse
+    return long(wmul(to(wproduct(a, b, true)), winverse(wproduct(1, b, false))));
+}
+
+inline Integer Modulus::falling(const Integer& n, const Integer& k)
+{
+    check_argument(n, "nPr");
+    if (k < 0 || k > n) return 0;
+    if (k >= value()) return 0;         // k consecutive numbers, one of them 0 mod p
+    if (prime && tabled(n)) {
+        uint64_t a = n.small_value();
+        grow_tables(a);
+        return long(from(wmul(fact[a], inv_fact[a - k.small_value()])));
+    }
+    if (word) return long(wproduct(wreduce(n), k.small_value(), true));
+    return reduce(::falling(n.to_mpz(), k.to_mpz()));
+}
+
+#endif // MODULAR_H
@@ -2,7 +2,7 @@
 where numerator and denominator of mpq_class are mpz_class.
 
 rational_calculator.cpp will correspond to 'qc'
-   g++ -lgmpxx -lgmp -g rational_calculator.cpp -std=c++11 -o qc
+   g++ -pthread -lgmpxx -lgmp -g rational_calculator.cpp -std=c++17 -o qc
 
     The classes can be freely intermixed in expressions, as can the classes and the
     standard types long, unsigned long and double
@@ -100,6 +100,9 @@ Original:  2 December 2018
        ( Expression )
        - Primary
        + Primary
+       pi ( Expression )      and e, ln2, ln10: to that many decimals
+       sum ( Name , Expression , Expression , Expression )
+       prod ( Name , Expression , Expression , Expression )
 
    Number:
        //floating-point-literal   in calculator.cpp ----> hc
@@ -107,6 +110,7 @@ Original:  2 December 2018
                                   and integer_calculator2.cpp ----> count2
       // rational_calculator.cpp ----> count3
        mpq_class literal with numerator and denominator mpz_class
+           read exactly: 0.1 = 1/10, 2.5e3, 1e-3, 0x1F, 0b101, any number of digits
 
 
 */
@@ -130,8 +134,27 @@ Original:  2 December 2018
 
 #include "std_lib_facilities.h"
 #include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <string_view>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <fcntl.h>
+#include <unistd.h>
 //#include <iomanip>
 #include <gmpxx.h>   // g++ -lgmpxx -lgmp -g nPk_gmp.cpp -std=c++17 -o nPk
+#include "combinatorics.h"
+#include "hybrid_number.h"   // Rational: a long over a long until it outgrows them
+#include "constants.h"
+#include "digits.h"      // digit counts, first/last digits, streamed output
+#include "symbol_table.h"  // variables: names interned to slots
+#include "server.h"      // --serve: sessions on a Unix-domain socket
+#include "jobs.h"        // ^C, and statements that end with '&'
+#include "buffered_io.h" // where the statements are read from
 
 // SYMBOLIC CONSTANTS
 const char number = '8';
@@ -159,41 +182,65 @@ const char nCr = 'C';
 const char fnCr = 'c';    // don't need 'c' for cos when dealing with integers only
 const char nPr = 'P';
 const char fnPr = 'p';
+const char fnPowmod = 'm';
+const char fnSum = 's';
+const char fnProd = 'r';
+const char fnConst = 'k';     // pi(n), e(n), ln2(n), ln10(n): the name is in the Token
+const char digitscmd = 'D';
+const char savecmd = 'S';
+const char sheetcmd = 'W';
+const char defcmd = 'F';
+const char fnIf = 'i';
+const char precisioncmd = 'R';
+const char jobscmd = 'J';
+const char waitcmd = 'T';
 //const string sqrtkey = "sqrt";
 const string expkey = "pow";
 const string ncrkey = "nCr";
 const string nprkey = "nPr";
+const string powmodkey = "powmod";
+const string sumkey = "sum";
+const string prodkey = "prod";
 //const string sinkey = "sin";
 //const string coskey = "cos";
 const string quitkey = "quit";
 const string helpkey = "help";
+const string digitskey = "digits";
+const string savekey = "save";
+const string sheetkey = "spreadsheet";
+const string defkey = "def";
+const string ifkey = "if";
+const string precisionkey = "precision";
+const string jobskey = "jobs";
+const string waitkey = "wait";
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
 
 class Token {  // altered for rational calculator ***************************
 public:
     char kind;
-    mpq_class value;  // for Big Rationals with mpz_class numerator and denominator
+    Rational value;  // long/long, or a Big Rational with mpz_class numerator and denominator
     string name;
 
     Token(char k) : kind{k}, value{0} { }
-    Token(char k, mpz_class v) : kind{k}, value{v} { }
+    Token(char k, const Rational& v) : kind{k}, value{v} { }
     Token(char k, string n) : kind{k}, value{0}, name{n} { }
 };
 
-class Token_stream {
+class Token_stream : public Input_buffer {     // see buffered_io.h
 public:
     Token get();                // get a Token
     void putback(Token t);      // put a token back
     void ignore(char c);   // discard characters up to and including a c
+    bool background(string& s); // is the next statement "... &"? see jobs.h
 
 private:
     bool full { false };   // is there a Token in the buffer?
     Token buffer {' '};    // here is where putback() stores a Token
                      // put back using putback()
+    void new_source() override { full = false; }
 };
 
-
 void Token_stream::ignore(char c)
  // c represents the kind of Token
  {
@@ -204,12 +251,17 @@ void Token_stream::ignore(char c)
   }
   full = false;
 
-  // now search input
-  char ch = 0;
-  while (cin >> ch)
-      if (ch == c) return;
+  // now search input (a newline is a print too)
+  skip_past(c);
  }
 
+bool Token_stream::background(string& s)
+{
+    if (full && buffer.kind != print) return false;
+    full = false;               // the end of the statement before
+    return take_background(s);
+}
+
 void Token_stream::putback(Token t)
 {
     buffer = t;                 // copy t to buffer
@@ -217,6 +269,116 @@ void Token_stream::putback(Token t)
 };
 
 
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  Literals are read exactly.  They used to go through cin >> double (later
+    strtod), so 0.1 was 3602879701896397/36028797018963968 before it was cut
+    down to 0, and anything past 17 digits was quietly rounded.  Now the digits
+    themselves make an integer, and the decimal point and the exponent a power
+    of 10:
+        0.1 = 1/10      2.5e3 = 2500      1e-3 = 1/1000
+        0x1F = 31       0b101 = 5
+    A long digit string is cut into 18 digit chunks (each one fits in a 64 bit
+    word), and the chunks are joined pairwise, hi * 10^(18*k) + lo, so that the
+    multiplications stay balanced, as in product() in combinatorics.h.
+*/
+
+const int chunk_digits = 18;
+const unsigned long chunk_base = 1000000000000000000ul;    // 10^18
+const long max_exponent = 1000000;     // 1e1000000 is a million digits already
+
+bool is_digit_in(char c, int base)
+{
+    if (base == 16) return isxdigit(c);
+    return c == '0' || c == '1';
+}
+
+mpz_class join_chunks(const vector<unsigned long>& w, size_t a, size_t b,
+                      vector<mpz_class>& pow)
+    // the number with the base 10^18 digits w[a..b), most significant first;
+    // pow[i] = 10^(18 * 2^i), computed when first needed
+{
+    if (b - a == 1) return w[a];
+    size_t i = 0;
+    while ((size_t(2) << i) < b - a) ++i;       // 2^i < b-a <= 2^(i+1)
+    if (pow.empty()) pow.push_back(chunk_base);
+    while (pow.size() <= i) pow.push_back(pow.back() * pow.back());
+    size_t m = b - (size_t(1) << i);            // the low 2^i chunks
+    return join_chunks(w, a, m, pow) * pow[i] + join_chunks(w, m, b, pow);
+}
+
+mpz_class digits_value(string_view d)
+    // d is decimal digits only
+{
+    if (d.empty()) return 0;
+    vector<unsigned long> w;
+    w.reserve(d.size()/chunk_digits + 1);
+    size_t n = d.size() % chunk_digits;         // the top chunk may be short
+    if (n == 0) n = chunk_digits;
+    for (size_t i = 0; i < d.size(); i += n, n = chunk_digits) {
+        unsigned long c = 0;
+        for (size_t j = i; j < i + n; ++j) c = c*10 + (d[j] - '0');
+        w.push_back(c);
+    }
+    vector<mpz_class> pow;
+    return join_chunks(w, 0, w.size(), pow);
+}
+
+Rational decimal_literal(const char* s, const char* e)
+    // [s, e) is digits with at most one '.', then maybe an exponent
+{
+    string digits;
+    digits.reserve(e - s);
+    long scale = 0;                 // the value is digits * 10^scale
+    bool point = false;
+    for (; s < e && *s != 'e' && *s != 'E'; ++s) {
+        if (*s == '.') point = true;
+        else {
+            digits += *s;
+            if (point) --scale;
+        }
+    }
+    if (s < e) {                    // the exponent
+        ++s;
+        bool neg = *s == '-';
+        if (*s == '+' || *s == '-') ++s;
+        long x = 0;
+        for (; s < e; ++s) {
+            x = x*10 + (*s - '0');
+            if (x > max_exponent) error("number: exponent too large");
+        }
+        scale += neg ? -x : x;
+    }
+
+    size_t z = digits.find_first_not_of('0');
+    if (z == string::npos) return 0;
+    string_view d = string_view(digits).substr(z);
+    long k = scale < 0 ? -scale : scale;
+    if (d.size() <= chunk_digits && k <= chunk_digits) {     // all in longs
+        long v = 0;
+        for (char c : d) v = v*10 + (c - '0');
+        long p10 = 1;
+        for (long i = 0; i < k; ++i) p10 *= 10;
+        return scale < 0 ? Rational(v) / Rational(p10) : Rational(v) * Rational(p10);
+    }
+
+    mpz_class v = digits_value(d);
+    mpz_class p10;
+    mpz_ui_pow_ui(p10.get_mpz_t(), 10, k);
+    if (scale >= 0) return mpz_class(v * p10);
+    mpq_class q(v, p10);
+    q.canonicalize();
+    return q;
+}
+
+Rational radix_literal(const char* s, const char* e, int base)
+    // [s, e) is hex or binary digits; for a power of 2 base
+    // mpz_set_str is linear already
+{
+    mpz_class v;
+    mpz_set_str(v.get_mpz_t(), string(s, e).c_str(), base);
+    return v;
+}
+
 Token Token_stream::get()
     // added '%'
 {
@@ -226,12 +388,14 @@ Token Token_stream::get()
     }
 
     char ch;
-    //cin >> ch;              // note that >> skips whitespace
-    cin.get(ch);    // note that cin.get() does NOT skip whitespace
-    while (isspace(ch)) {
-       if (ch == '\n') return Token(print); // if newline detected,
-       cin.get(ch);                         // return print Token
-    }
+    do {                    // note that we do NOT skip newlines
+        if (p == end && !refill(p)) return Token(quit);   // end of input
+        ch = *p++;
+        if (ch == '\n') {      // if newline detected, return print Token
+            ++lines;
+            return Token(print);
+        }
+    } while (isspace(ch));
 
     switch (ch) {
         case print:           // for "print"
@@ -251,7 +415,6 @@ Token Token_stream::get()
         case ',':
         case '^':
         //case '@':
-        case 'e':
         case 'C':
         case 'P':
             return Token { ch };  // let each character represent itself
@@ -259,30 +422,65 @@ Token Token_stream::get()
         case '0': case '1': case '2': case '3': case '4':
         case '5': case '6': case '7': case '8': case '9':
             {
-                cin.putback(ch);    // put digit back into input stream
-                double val;
-                cin >> val;
-                return Token { number, val };  // let '8' represent a number
+                const char* s = p - 1;
+                if (ch == '0' && available(s, 1) && (*p == 'x' || *p == 'X' || *p == 'b' || *p == 'B')
+                        && available(s, 2)) {
+                    int base = (*p == 'x' || *p == 'X') ? 16 : 2;
+                    if (is_digit_in(p[1], base)) {      // else it is 0 and a name
+                        ++p;
+                        while (available(s, 1) && is_digit_in(*p, base)) ++p;
+                        return Token { number, radix_literal(s+2, p, base) };
+                    }
+                }
+                // scan what cin >> double used to read: digits, one '.'
+                // and an exponent if a digit follows the 'e'
+                bool point = ch == '.';
+                while (available(s, 1) && (isdigit(*p) || (*p == '.' && !point))) {
+                    if (*p == '.') point = true;
+                    ++p;
+                }
+                // one character at a time: at the end of a line only the
+                // '\n' is there, and asking for more waits for the next line
+                if (available(s, 1) && (*p == 'e' || *p == 'E') && available(s, 2)) {
+                    size_t sign = (p[1] == '+' || p[1] == '-');
+                    if ((!sign || available(s, 3)) && isdigit(p[1+sign])) {
+                        p += 1 + sign;
+                        while (available(s, 1) && isdigit(*p)) ++p;
+                    }
+                }
+                return Token { number, decimal_literal(s, p) };  // let '8' represent a number
             }
         default:
             if (isalpha(ch)) {  // if it is a letter
-                string s;
-                s += ch;  // Put the letter in 's' because it has been already read
-                while (cin.get(ch) &&
-                        ((isalpha(ch) || isdigit(ch) || ch == '_'))
+                const char* b = p - 1;  // the letter has been already read
+                while (available(b, 1) &&
+                        ((isalpha(*p) || isdigit(*p) || *p == '_'))
                       )
-                      s += ch;     // Continue to read in 's'
-               cin.putback(ch);    // Return the character into the stream
+                      ++p;     // Continue to scan the name
+               string s(b, p);
+               Constant c = Constant::pi;
                if (s == declkey) return Token{let};    // declaration keyword
                else if (s == constkey) return Token{constant};
                else if (s == expkey) return Token{powexp};
                else if (s == ncrkey) return Token{fnCr};
                else if (s == nprkey) return Token{fnPr};
+               else if (s == powmodkey) return Token{fnPowmod};
+               else if (s == sumkey) return Token{fnSum};
+               else if (s == prodkey) return Token{fnProd};
+               else if (s == ifkey) return Token{fnIf};
+               else if (constant_named(s, c)) return Token{fnConst, s};
                //else if (s == sqrtkey) return Token{square_root};
               // else if (s == sinkey) return Token{c_sin};
               // else if (s == coskey) return Token{c_cos};
                else if (s == quitkey) return Token{quit};
                else if (s == helpkey) return Token{help};
+               else if (s == digitskey) return Token{digitscmd};
+               else if (s == savekey) return Token{savecmd};
+               else if (s == sheetkey) return Token{sheetcmd};
+               else if (s == precisionkey) return Token{precisioncmd};
+               else if (s == jobskey) return Token{jobscmd};
+               else if (s == waitkey) return Token{waitcmd};
+               else if (s == defkey) return Token{defcmd};
                else return Token{name, s};
             }
             error("Bad token");
@@ -299,69 +497,301 @@ Token Token_stream::get()
 */
 // * * * *
 
-class Variable {     // changed for Rational Numbers
-public:
-    string name;
-    mpq_class value;
-    bool constant;
-    Variable(string n, mpq_class v, bool c = false)
-        : name{n}, value{v}, constant{c} { }
+using Symbol_table = Basic_symbol_table<Rational>;    // see symbol_table.h
+using Variable = Symbol_table::Variable;
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  Version 3.1: statements are compiled before they are evaluated.
+
+    statement(), expression(), term(), secondary() and primary() used to do the
+    arithmetic while they were reading tokens.  Now they only read tokens and
+    "lower" the statement into a Code object: a flat list of instructions for a
+    small stack machine.  execute() then runs the instructions without ever
+    touching the Token_stream, so a Code can be kept and run again.
+
+        let x = 3 + 4!     ---->   push 3, push 4, fact, add, declare x
+*/
+
+enum class Op : char {
+    push,             // push literals[arg]
+    load,             // push the value of the variable in slot arg
+    unknown,          // fail like load of a name with no slot: names[arg] (see handle_variable())
+    unknown_store,    // and like store
+    store,            // slot arg = top of stack (the value stays on the stack)
+    declare,          // let slot arg = top of stack
+    declare_const,    // constant slot arg = top of stack
+    define,           // spreadsheet mode: let bodies[arg].index = bodies[arg], kept as a formula
+    update,           // spreadsheet mode: store, then recompute what depends on slot arg
+    neg,
+    add, sub, mul, div, mod,
+    pow,              // arg: decimals of a root that is not exact, see power()
+    fact,
+    ncr, npr,
+    powmod,           // base power modulus: arg -1 for powmod(), else base ^ power % modulus
+                      // with the arg of the pow
+    sum,              // add up the top arg values (see sum_terms())
+    series_sum,       // from to: sum() of bodies[arg] (see series())
+    series_prod,      // from to: prod() of bodies[arg]
+    constant,         // digits: the Constant arg to that many decimals
+    choose,           // if(): bodies[arg] if the top is not 0, else bodies[arg+1]
+    call              // the arguments are on top: calls[arg] of them
+};
+
+struct Instr {
+    Op op;
+    int arg;          // literal index, Symbol_table slot or count (unused by arithmetic)
 };
 
-class Symbol_table {
-    vector<Variable> var_table;
+struct Function;
+
+class Code {
 public:
-    bool is_declared(string);
-    mpq_class get(string);
-    mpq_class set(string, mpq_class);
-    mpq_class declare(string, mpq_class, bool con = false);
+    vector<Instr> instrs;
+    vector<Rational> literals;
+    vector<string> names;   // for Op::unknown and Op::unknown_store
+    vector<Code> bodies;    // the terms of sum() and prod(), compiled on their own
+    int index { -1 };       // in a body: the slot of the index variable
+    vector<Function*> calls;    // the functions it calls
+
+    void emit(Op op, int arg = 0) { instrs.push_back(Instr{op, arg}); }
+    void emit_literal(const Rational& v);
 };
 
-bool Symbol_table::is_declared(string var)
-    // is var already in var_table?
+void Code::emit_literal(const Rational& v)
 {
-    for (const Variable& v : var_table)
-        if (v.name == var) return true;
-    return false;
+    literals.push_back(v);
+    emit(Op::push, literals.size()-1);
 }
 
-mpq_class Symbol_table::get(string s)
-    // return the value of the Variable named s
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  Version 3.4: user functions.
+
+        def f(n, k) = n! / (k! * (n-k)!)
+        def memo cat(n) = if(n, sum(i, 0, n-1, cat(i) * cat(n-1-i)), 1)
+
+    def compiles the body once, into a Code of the Function, and from then on
+    a call is one instruction.  The parameters work like the index of a sum:
+    their slots are bound for the call and put back afterwards, so a body
+    sees its own arguments, and recursion works because every call keeps the
+    values of the one it interrupts.  if(c, a, b) runs only a or only b, so a
+    recursion can stop.
+
+    A "memo" function keeps every result, keyed by its arguments: cat(200)
+    above makes 200 calls that are not in the table instead of exponentially
+    many.  That is only right if nothing but the arguments goes in, so such a
+    function may not read or assign any variable (Code_use says which it
+    does).  Functions are never deleted; a new def of the same name makes a
+    new Function, and what was compiled before keeps calling the old one.
+*/
+
+struct Code_use {
+    vector<int> reads;          // slots it loads, not counting the ones it binds
+    vector<int> writes;         // slots it assigns, declares or binds
+    bool assigns { false };     // =, let or constant
+    bool sheet { false };       // Op::define or Op::update
+};
+
+struct Function {
+    string name;
+    vector<int> params;         // slots, bound for each call
+    Code body;
+    Code_use use;               // of the body, the calls in it included
+    bool memo { false };
+    map<vector<Rational>, Rational> memo_table;
+    mutex guard;                // for memo_table: a parallel batch shares it
+};
+
+void sort_unique(vector<int>& v)
 {
-    for (const Variable& v : var_table)
-        if (v.name == s) return v.value;
-    error("get: undefined variable ", s);
+    sort(v.begin(), v.end());
+    v.erase(unique(v.begin(), v.end()), v.end());
 }
 
-mpq_class Symbol_table::set(string s, mpq_class d)
-    // set the Variable named s to d
+void code_use(const Code& code, Code_use& u, vector<int>& bound)
+    // what code does with variables; bound holds the indexes (and
+    // parameters) in scope, whose loads are not reads
 {
-    for (Variable& v : var_table)
-        if (v.name == s) {
-            if (v.constant) error("Can't overwrite constant variable");
-            v.value = d;
-            return d;
+    for (const Instr& in : code.instrs)
+        switch (in.op) {
+            case Op::load:
+                if (find(bound.begin(), bound.end(), in.arg) == bound.end())
+                    u.reads.push_back(in.arg);
+                break;
+            case Op::update:
+                u.sheet = true;
+                u.writes.push_back(in.arg);
+                u.assigns = true;
+                break;
+            case Op::store:
+            case Op::declare:
+            case Op::declare_const:
+                u.writes.push_back(in.arg);
+                u.assigns = true;
+                break;
+            case Op::define:            // the slot is the index of the body
+                u.sheet = true;
+                u.assigns = true;
+                break;
+            default:
+                break;
         }
-    error("set: undefined variable ", s);
+    for (const Code& body : code.bodies) {
+        if (body.index < 0) {           // a branch of if()
+            code_use(body, u, bound);
+            continue;
+        }
+        u.writes.push_back(body.index);     // bound for each term, then put back
+        bound.push_back(body.index);
+        code_use(body, u, bound);
+        bound.pop_back();
+    }
+    for (const Function* f : code.calls) {  // a recursive call adds nothing
+        u.reads.insert(u.reads.end(), f->use.reads.begin(), f->use.reads.end());
+        u.writes.insert(u.writes.end(), f->use.writes.begin(), f->use.writes.end());
+        u.assigns = u.assigns || f->use.assigns;
+        u.sheet = u.sheet || f->use.sheet;
+    }
 }
 
-mpq_class Symbol_table::declare(string var, mpq_class val, bool con)
-    // add {var,val,con} to var_table
+Code_use code_use(const Code& code)
 {
-    if (is_declared(var)) error(var, " declared twice");
-    var_table.push_back(Variable{var,val,con});
-    return val;
+    Code_use u;
+    vector<int> bound;
+    code_use(code, u, bound);
+    sort_unique(u.reads);
+    sort_unique(u.writes);
+    return u;
 }
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
-// globals(?)
+/*  Spreadsheet mode ("spreadsheet on"): a variable declared with let keeps
+    its formula, and assigning to a variable recomputes everything computed
+    from it, the way a spreadsheet would.
+
+        spreadsheet on
+        let n = 10;  let p = 1/6
+        let b = nCr(n, 2) * (p^2) * ((1-p)^(n-2))
+        n = 20       ---->  b is recomputed
+
+    While the mode is on, declaration() compiles the expression into a body of
+    its own and emits Op::define, and handle_variable() emits Op::update
+    instead of Op::store.  The Sheet keeps the formulas and, for each slot, the
+    formulas that read it.  Formulas only read variables declared before them
+    and an assignment replaces a variable's formula by a plain value, so there
+    are no cycles.  update() goes over what depends on the variable in
+    topological order and recomputes a formula only if one of its inputs
+    really changed: an unchanged result stops there.
+*/
+
+class Sheet {
+public:
+    struct Formula {
+        Code code;
+        vector<int> inputs;     // the slots it reads
+    };
+
+    void define(int slot, const Code& f);       // slot = f from now on
+    void forget(int slot);                      // slot has a plain value now
+    const Formula& formula(int slot) const { return formulas.at(slot); }
+    vector<int> downstream(int slot) const;     // what depends on slot, in order
+
+private:
+    map<int, Formula> formulas;     // by slot
+    map<int, vector<int>> users;    // by slot: the formulas that read it
+};
 
-Symbol_table st;            // allows Variable storage and retrieval
-Token_stream ts;            // provides get() and putback()
+void Sheet::define(int slot, const Code& f)
+{
+    forget(slot);
+    Formula& x = formulas[slot];
+    x.code = f;
+    x.inputs = code_use(f).reads;
+    for (int s : x.inputs) users[s].push_back(slot);
+}
+
+void Sheet::forget(int slot)
+{
+    auto p = formulas.find(slot);
+    if (p == formulas.end()) return;
+    for (int s : p->second.inputs) {
+        vector<int>& u = users[s];
+        u.erase(find(u.begin(), u.end(), slot));
+    }
+    formulas.erase(p);
+}
+
+vector<int> Sheet::downstream(int slot) const
+    // depth first over the users, without recursion (a chain of formulas
+    // may be long); the reverse postorder is a topological order
+{
+    vector<int> order;
+    set<int> seen { slot };
+    vector<pair<int, size_t>> stack { {slot, 0} };      // slot, next user
+    while (!stack.empty()) {
+        auto& [s, next] = stack.back();
+        auto u = users.find(s);
+        if (u != users.end() && next < u->second.size()) {
+            int v = u->second[next++];
+            if (seen.insert(v).second) stack.push_back({v, 0});
+            continue;
+        }
+        order.push_back(s);
+        stack.pop_back();
+    }
+    order.pop_back();                   // slot itself
+    reverse(order.begin(), order.end());
+    return order;
+}
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
-// forward declaration for primary() to call
-mpq_class expression();
+// Version 3.2: a Calculator holds all a calculation needs (see README.md)
+
+class Calculator {
+public:
+    Rational evaluate(string_view s);   // run the statements in s, the value of the last
+
+    Symbol_table st;            // allows Variable storage and retrieval
+    Token_stream ts;            // provides get() and putback()
+    Digits_format digits_format;  // how results are shown: see digits.h
+    Rational last_result;       // for save
+    bool allow_save { true };   // not for the clients of a server
+    bool spreadsheet { false }; // let keeps formulas, see Sheet
+    int precision { 20 };       // decimals of 2^(1/2) and the like, see power()
+    Sheet sheet;
+    vector<unique_ptr<Function>> functions;     // every one ever defined
+    map<string, Function*> function_names;      // the current ones
+
+    Code statement();                       // compile the next statement in ts
+    Rational execute(const Code& code);     // and run it
+    void set_digits();
+    void set_spreadsheet();
+    void set_precision();
+    void def_function();
+    string save_path();
+    void save_result();
+    void clean_up_mess();
+
+private:
+    void declaration(bool b, Code& code);
+    void expression(Code& code);
+    void term(Code& code);
+    void secondary(Code& code);
+    void primary(Code& code);
+    void handle_variable(Token& t, Code& code);
+    void calc_nCk(Code& code);
+    void calc_nPk(Code& code);
+    void calc_powmod(Code& code);
+    void calc_series(Code& code, Op op);
+    void calc_constant(Code& code, const string& s);
+    Rational series(const Code& body, const Rational& a, const Rational& b, bool sum);
+    bool term_ratio(const Code& body, long from, vector<mpq_class>& p, vector<mpq_class>& q);
+    bool defining { false };    // compiling the body of a def
+    void calc_if(Code& code);
+    void calc_call(Code& code, Function* f);
+    Rational define(const Code& f);
+    void update(int slot);
+    Rational call(Function& f, const Rational* args);
+};
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
 // additional calculator functions
@@ -403,46 +833,341 @@ double calc_cos()
 }
 */
 
-mpz_class factorial(mpz_class n)
+// factorial(n) is in combinatorics.h: mpz_fac_ui plus a cache of big results
+
+Rational nCk(const Rational& n, const Rational& k)  {
+    long r;
+    if (n.is_small() && k.is_small() && small_binomial(n.small_num(), k.small_num(), r))
+        return r;
+    return binomial(n.get_num(), k.get_num());     // combinatorics.h: no factorials involved
+}
+
+void Calculator::calc_nCk(Code& code)
+    // nCr(n, k): compile both arguments, the ncr instruction does the work
 {
-    mpz_class result(n); // initialize an arbitrary-sized integer with 'n'
-    if (n == 0) return 1;
-    while(n-- > 1) result *= n; // compute the product with every integers < n
-    return result;
+    Token t = ts.get();
+    if (t.kind != '(') error("'(' expected");
+    expression(code);
+    t = ts.get();
+    if (t.kind != ',') error("',' expected");
+    expression(code);
+    t = ts.get();
+    if (t.kind != ')') error("')' expected");
+    code.emit(Op::ncr);
+}
+
+Rational nPk(const Rational& n, const Rational& k)  {
+    long r;
+    if (n.is_small() && k.is_small() && small_falling(n.small_num(), k.small_num(), r))
+        return r;
+    return falling(n.get_num(), k.get_num());      // n*(n-1)*...*(n-k+1)
+}
+
+Rational fact(const Rational& n)
+{
+    long r;
+    if (n.is_small() && small_factorial(n.small_num(), r)) return r;
+    return factorial(n.get_num());
+}
+
+void Calculator::calc_nPk(Code& code)
+{
+    Token t = ts.get();
+    if (t.kind != '(') error("'(' expected");
+    expression(code);
+    t = ts.get();
+    if (t.kind != ',') error("',' expected");
+    expression(code);
+    t = ts.get();
+    if (t.kind != ')') error("')' expected");
+    code.emit(Op::npr);
 }
 
-mpq_class nCk(mpz_class n, mpz_class k)  {
-    return factorial(n)/(factorial(n-k) * factorial(k) );
+void Calculator::calc_powmod(Code& code)
+    // powmod(base, power, modulus)
+{
+    Token t = ts.get();
+    if (t.kind != '(') error("'(' expected");
+    expression(code);
+    t = ts.get();
+    if (t.kind != ',') error("',' expected");
+    expression(code);
+    t = ts.get();
+    if (t.kind != ',') error("',' expected");
+    expression(code);
+    t = ts.get();
+    if (t.kind != ')') error("')' expected");
+    code.emit(Op::powmod, -1);
 }
 
-mpq_class calc_nCk()
+void Calculator::calc_series(Code& code, Op op)
+    // sum(i, from, to, term) or prod(i, from, to, term): the bounds are
+    // compiled into code, term into a body of its own that is run for each i
 {
     Token t = ts.get();
     if (t.kind != '(') error("'(' expected");
-    mpq_class n = expression();
+    t = ts.get();
+    if (t.kind != name && t.kind != fnConst) error("index name expected");
+    Code body;
+    body.index = st.slot(t.name);
+    t = ts.get();
+    if (t.kind != ',') error("',' expected");
+    expression(code);
     t = ts.get();
     if (t.kind != ',') error("',' expected");
-    mpq_class k = expression();
+    expression(code);
+    t = ts.get();
+    if (t.kind != ',') error("',' expected");
+    expression(body);
     t = ts.get();
     if (t.kind != ')') error("')' expected");
-    return nCk(n.get_num(), k.get_num());
+    code.bodies.push_back(move(body));
+    code.emit(op, code.bodies.size()-1);
 }
 
-mpq_class nPk(mpz_class n, mpz_class k)  {
-    return factorial(n)/factorial(n-k);
+void Calculator::calc_constant(Code& code, const string& s)
+    // pi(digits) and the like, see constants.h
+{
+    Constant c = Constant::pi;
+    constant_named(s, c);
+    Token t = ts.get();
+    if (t.kind != '(') error("'(' expected");
+    expression(code);
+    t = ts.get();
+    if (t.kind != ')') error("')' expected");
+    code.emit(Op::constant, int(c));
 }
 
-mpq_class calc_nPk()
+void Calculator::calc_if(Code& code)
+    // if(c, a, b): a if c is not 0, else b; a and b are bodies, and only
+    // one of them is run
 {
     Token t = ts.get();
     if (t.kind != '(') error("'(' expected");
-    mpq_class n = expression();
+    expression(code);
+    Code a;
+    Code b;
+    t = ts.get();
+    if (t.kind != ',') error("',' expected");
+    expression(a);
     t = ts.get();
     if (t.kind != ',') error("',' expected");
-    mpq_class k = expression();
+    expression(b);
+    t = ts.get();
+    if (t.kind != ')') error("')' expected");
+    code.bodies.push_back(move(a));
+    code.bodies.push_back(move(b));
+    code.emit(Op::choose, code.bodies.size()-2);
+}
+
+void Calculator::calc_call(Code& code, Function* f)
+    // f(a, b, ...): the arguments go on the stack, one call instruction
+{
+    Token t = ts.get();
+    if (t.kind != '(') error("'(' expected");
+    size_t n = 0;
+    t = ts.get();
+    if (t.kind != ')') {
+        ts.putback(t);
+        do {
+            expression(code);
+            ++n;
+            t = ts.get();
+        } while (t.kind == ',');
+        if (t.kind != ')') error("')' expected");
+    }
+    if (n != f->params.size())
+        error(f->name + ": ", to_string(f->params.size()) + " arguments expected");
+    code.calls.push_back(f);
+    code.emit(Op::call, code.calls.size()-1);
+}
+
+void Calculator::def_function()
+    // assume we have seen "def"
+    // handle: [memo] name(parameter, ...) = expression
+{
+    Token t = ts.get();
+    bool memo = false;
+    if (t.kind == name && t.name == "memo") {
+        Token t2 = ts.get();
+        if (t2.kind == name) {
+            memo = true;
+            t = t2;
+        }
+        else ts.putback(t2);            // a function called memo
+    }
+    if (t.kind != name) error("function name expected in def");
+    auto f = make_unique<Function>();
+    f->name = t.name;
+    f->memo = memo;
+
+    t = ts.get();
+    if (t.kind != '(') error("'(' expected");
     t = ts.get();
+    while (t.kind == name || t.kind == fnConst) {
+        int s = st.slot(t.name);
+        if (find(f->params.begin(), f->params.end(), s) != f->params.end())
+            error(f->name + ": parameter twice: ", t.name);
+        f->params.push_back(s);
+        t = ts.get();
+        if (t.kind != ',') break;
+        t = ts.get();
+        if (t.kind != name && t.kind != fnConst) error("parameter name expected");
+    }
     if (t.kind != ')') error("')' expected");
-    return nPk(n.get_num(), k.get_num());
+    t = ts.get();
+    if (t.kind != '=') error("= missing in def of ", f->name);
+
+    // the name means the new function already, for a recursive call
+    auto p = function_names.find(f->name);
+    Function* old = p == function_names.end() ? nullptr : p->second;
+    function_names[f->name] = f.get();
+    defining = true;
+    try {
+        expression(f->body);
+        defining = false;
+        Code_use u;
+        vector<int> bound = f->params;
+        code_use(f->body, u, bound);
+        u.writes.insert(u.writes.end(), f->params.begin(), f->params.end());
+        sort_unique(u.reads);
+        sort_unique(u.writes);
+        if (memo && !u.reads.empty())
+            error(f->name + ": a memo function may not read the variable ", st.saved(u.reads[0]).name);
+        if (memo && u.assigns) error(f->name, ": a memo function may not assign to a variable");
+        f->use = move(u);
+    }
+    catch(...) {
+        defining = false;
+        if (old) function_names[f->name] = old;
+        else function_names.erase(f->name);
+        throw;
+    }
+    functions.push_back(move(f));
+}
+
+Rational constant_value(Constant c, const Rational& digits)
+    // c cut off after that many decimals, as an exact fraction
+{
+    if (!digits.is_small() || digits.small_den() != 1 || digits.small_num() < 0)
+        error(constant_name(c), ": the number of digits must be a whole number >= 0");
+    unsigned long n = digits.small_num();
+    mpz_class v = constant_digits(c, n);
+    if (v == 0) return 0;
+    // v/10^n: only 2s and 5s can cancel, so there is no need for a gcd
+    unsigned long twos = min(mpz_scan1(v.get_mpz_t(), 0), n);
+    unsigned long fives = 0;
+    v >>= twos;
+    while (fives < n && mpz_divisible_ui_p(v.get_mpz_t(), 5)) {
+        v /= 5;
+        ++fives;
+    }
+    mpq_class q;
+    mpq_set_num(q.get_mpq_t(), v.get_mpz_t());
+    mpz_ui_pow_ui(mpq_denref(q.get_mpq_t()), 5, n - fives);
+    mpz_mul_2exp(mpq_denref(q.get_mpq_t()), mpq_denref(q.get_mpq_t()), n - twos);
+    return q;
+}
+
+/*  Version 3.5: roots.  ^ used to look at the numerator of the power only, so
+    8^(1/3) was 8 and 2^-3 was 8 as well.  Now x^(a/b) is the b-th root of
+    x^a, and x^-p is (1/x)^p.  When x is a perfect b-th power, numerator and
+    denominator both (mpz_root says so), the root is exact: (27/8)^(2/3) =
+    9/4.  Otherwise it is cut off after "precision" decimals, the way pi(n)
+    is.  The precision goes into the pow instruction when the statement is
+    compiled, so a formula or a function keeps the one it was made with, and
+    a parallel batch needs no lock for it.
+*/
+
+Rational power(const Rational& base, const Rational& p, int decimals)
+    // base ^ p, roots to that many decimals when they are not exact
+{
+    if (base.is_small() && p.is_small() && p.small_num() >= 0 && p.small_den() == 1) {
+        // stay in longs while neither numerator nor denominator overflows
+        long b = base.small_num();
+        long e = p.small_num();
+        if (base.small_den() == 1 && -1 <= b && b <= 1)        // 0, 1, -1
+            return e == 0 ? 1 : (b == -1 && e%2 == 0) ? 1 : b;
+        long num = 1, den = 1;
+        bool fits = true;
+        for (long i = 0; fits && i < e; ++i)    // overflows within 63 steps
+            fits = !__builtin_mul_overflow(num, b, &num)
+                && !__builtin_mul_overflow(den, base.small_den(), &den);
+        if (fits) return Rational(num) / Rational(den);
+    }
+    mpz_class num = base.get_num();
+    mpz_class den = base.get_den();
+    mpz_class a = p.get_num();
+    mpz_class b = p.get_den();
+    if (num == 0) {
+        if (a < 0) error("divide by zero");
+        return a == 0 ? 1 : 0;
+    }
+    if (a < 0) {                        // x^-a = (1/x)^a
+        swap(num, den);
+        if (den < 0) {
+            num = -num;
+            den = -den;
+        }
+        a = -a;
+    }
+    if (num < 0 && mpz_even_p(b.get_mpz_t())) error("^: even root of a negative number");
+    if (den == 1 && (num == 1 || num == -1))
+        return num == -1 && mpz_odd_p(a.get_mpz_t()) ? -1 : 1;
+    if (!a.fits_ulong_p()) error("^: exponent too large");
+    if (!b.fits_ulong_p()) error("^: root of too high a degree");
+    unsigned long e = a.get_ui();
+    unsigned long n = b.get_ui();
+
+    mpz_class result_num;
+    mpz_class result_den;
+    if (n > 1) {
+        mpz_class rn, rd;
+        if (mpz_root(rn.get_mpz_t(), num.get_mpz_t(), n) != 0
+            && mpz_root(rd.get_mpz_t(), den.get_mpz_t(), n) != 0) {
+            num = rn;                   // a perfect power: no approximation
+            den = rd;
+            n = 1;
+        }
+    }
+    check_result_bits(power_bits(num, e) + power_bits(den, e), "^");
+    mpz_pow_ui(result_num.get_mpz_t(), num.get_mpz_t(), e);
+    mpz_pow_ui(result_den.get_mpz_t(), den.get_mpz_t(), e);
+    if (n == 1) return mpq_class(result_num, result_den);
+
+    // floor(root(x * 10^(n*decimals))) / 10^decimals, with the sign of x
+    if (n > (unsigned long)max_exponent / max(decimals, 1))
+        error("^: root of too high a degree for the precision");
+    bool negative = result_num < 0;
+    mpz_class scale;
+    mpz_ui_pow_ui(scale.get_mpz_t(), 10, n * decimals);
+    mpz_class x = abs(result_num) * scale / result_den;
+    mpz_root(x.get_mpz_t(), x.get_mpz_t(), n);
+    if (negative) x = -x;
+    mpz_ui_pow_ui(scale.get_mpz_t(), 10, decimals);
+    mpq_class q(x, scale);
+    q.canonicalize();
+    return q;
+}
+
+mpz_class powmod(const mpz_class& base, const mpz_class& power, const mpz_class& m)
+    // base^power % m by mpz_powm: base^power itself is never built, and the
+    // power can be as big as we like.  Like % the result has the sign of
+    // base^power; a negative power needs the inverse of base modulo m.
+{
+    if (m == 0) error("%:divide by zero");
+    mpz_class mod = abs(m);
+    mpz_class b = base;
+    mpz_class e = power;
+    if (e < 0) {
+        if (mpz_invert(b.get_mpz_t(), b.get_mpz_t(), mod.get_mpz_t()) == 0)
+            error("powmod: no inverse for a negative power");
+        e = -e;
+    }
+    mpz_class result;
+    mpz_powm(result.get_mpz_t(), b.get_mpz_t(), e.get_mpz_t(), mod.get_mpz_t());
+    if (base < 0 && mpz_odd_p(power.get_mpz_t()) && result != 0) result -= mod;
+    return result;
 }
 /*   *** THIS VERSION DID NOT WORK WELL WITH FRACTIONS, use '^'
 mpq_class calc_pow()
@@ -464,48 +1189,65 @@ mpq_class calc_pow()
 }
 */
 
-mpq_class handle_variable(Token& t)
+void Calculator::handle_variable(Token& t, Code& code)
+    // a name that is no variable yet gets no slot, and the Code fails when it
+    // gets there; only in a def it does, as the variable may come later
 {
+    int var = defining ? st.slot(t.name) : st.find(t.name);
+    if (var < 0) code.names.push_back(t.name);
     Token t2 = ts.get();
-    if (t2.kind == '=')
-        return st.set(t.name, expression());
+    if (t2.kind == '=') {
+        expression(code);
+        if (var < 0) code.emit(Op::unknown_store, code.names.size()-1);
+        else code.emit(spreadsheet ? Op::update : Op::store, var);
+    }
+    else if (t2.kind == '(' && function_names.count(t.name)) {
+        ts.putback(t2);
+        calc_call(code, function_names[t.name]);
+    }
     else {
         ts.putback(t2);
-        return st.get(t.name);       // missing in text!
+        if (var < 0) code.emit(Op::unknown, code.names.size()-1);
+        else code.emit(Op::load, var);       // missing in text!
     }
 }
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
 // input grammar functions
-mpq_class secondary();  // declare here so as to ------------------------------
+// (secondary() is declared in Calculator, so that primary() may call it)
 
 
-mpq_class primary()            // deal with numbers and parenthesis/braces
+void Calculator::primary(Code& code)            // deal with numbers and parenthesis/braces
 {
     Token t = ts.get();
     switch (t.kind) {
         case '(':                   // handle '(' expression ')'
             {
-                mpq_class d = expression();
+                expression(code);
                 t = ts.get();
                 if (t.kind != ')') error("')' expected");
-                return d;
+                return;
             }
         case '{':
             {
-                mpq_class d = expression();
+                expression(code);
                 t = ts.get();
                 if (t.kind != '}') error("'}' expected");
-                return d;
+                return;
             }
         case number:                   // we use '8' to represent a number
-            return t.value;         // return the number's value
+            code.emit_literal(t.value);         // push the number's value
+            return;
         case name:
-            return handle_variable(t);
+            handle_variable(t, code);
+            return;
         case '-':
-            return -primary();
+            primary(code);
+            code.emit(Op::neg);
+            return;
         case '+':
-            return primary();
+            primary(code);
+            return;
     /*
         case square_root:
            {
@@ -522,18 +1264,44 @@ mpq_class primary()            // deal with numbers and parenthesis/braces
               return calc_pow();
 */
         case fnCr:
-             return calc_nCk();
+             calc_nCk(code);
+             return;
         case fnPr:
-             return calc_nPk();
+             calc_nPk(code);
+             return;
+        case fnPowmod:
+             calc_powmod(code);
+             return;
+        case fnSum:
+             calc_series(code, Op::series_sum);
+             return;
+        case fnConst:
+            {
+                Token t2 = ts.get();
+                ts.putback(t2);
+                if (t2.kind == '(') {
+                    calc_constant(code, t.name);
+                    return;
+                }
+                Token v{name, t.name};      // no '(': a variable called pi, e, ...
+                handle_variable(v, code);
+                return;
+            }
+        case fnProd:
+             calc_series(code, Op::series_prod);
+             return;
+        case fnIf:
+             calc_if(code);
+             return;
         default:
             error("primary expected");
     }
 }
 
-mpq_class secondary()
+void Calculator::secondary(Code& code)
     // ex 3 - Add a factorial operator '!'
 {
-    mpq_class left = primary();
+    primary(code);
     Token t = ts.get();
 
   while (true) {
@@ -544,202 +1312,1514 @@ mpq_class secondary()
             for (int i = n; i > 0; --i)
                 left *= i;
 */
-// replace with Big Integer mpz_class version
-        mpz_class fac  = factorial(left.get_num());
-        left = mpq_class(fac, 1);
+// replace with Big Integer mpz_class version (see Op::fact in execute())
+        code.emit(Op::fact);
          t = ts.get();
         }
         else {
             ts.putback(t);
-            return left;
+            return;
         }
     }
 }
 
-mpq_class term()               // deal with * and /
+void Calculator::term(Code& code)               // deal with * and /
 {
-    mpq_class left = secondary();
+    secondary(code);
     Token t = ts.get();             // get next token from Token_stream
+    bool after_pow = false;         // was the last instruction a '^'?
 
     while (true) {
         switch (t.kind) {
             case '*':
-                left *= secondary();
+                secondary(code);
+                code.emit(Op::mul);
                 t = ts.get();
                 break;
             case '/':
-                {
-                    mpq_class d = secondary();
-                    if (d == 0) error("divide by zero");
-                    left /= d;
-                    t = ts.get();
-                    break;
-                }
+                secondary(code);
+                code.emit(Op::div);
+                t = ts.get();
+                break;
 
             case '%':
-            {
-                mpq_class d = primary();
-                if (d.get_num() == 0) error("%:divide by zero");
-                // for C:
-                // mpz_t temp;
-                // mpz_mod (temp, left.get_mpz_t(), d.get_mpz_t());
-                // left = mpz_class(temp);
-                // for C++:
-                left = left.get_num() % d.get_num();
+                if (after_pow) {
+                    // a ^ b % m: turn pow, mod into one powmod so that
+                    // a^b itself is never built
+                    int decimals = code.instrs.back().arg;
+                    code.instrs.pop_back();
+                    primary(code);
+                    code.emit(Op::powmod, decimals);
+                    after_pow = false;
+                }
+                else {
+                    primary(code);
+                    code.emit(Op::mod);
+                }
                 t = ts.get();
-                break;
-            }
+                continue;
 
          case exponent:
-          {
-            mpz_class result_num;
-            mpz_class result_den;
-            mpq_class power = secondary();
-            mpz_pow_ui(result_num.get_mpz_t(), left.get_num().get_mpz_t(), power.get_num().get_ui());
-            mpz_pow_ui(result_den.get_mpz_t(), left.get_den().get_mpz_t(), power.get_num().get_ui());
-            mpq_class result = mpq_class(result_num, result_den);
-            left = result;
+            secondary(code);
+            code.emit(Op::pow, precision);
             t = ts.get();
-            break;
-        }
+            after_pow = true;
+            continue;
 
         case nCr:
-               left = nCk(left.get_num(), secondary().get_num());
+               secondary(code);
+               code.emit(Op::ncr);
                t = ts.get();
                break;
 
         case nPr:
-              left = nPk(left.get_num(), secondary().get_num());
+              secondary(code);
+              code.emit(Op::npr);
               t = ts.get();
               break;
         default:
                 ts.putback(t);      // put t back into the Token_stream
-                return left;
+                return;
         }
+        after_pow = false;          // '^' and '%' continue, the others get here
     }
 }
 
-mpq_class expression()         // deal with + and -
+void Calculator::expression(Code& code)         // deal with + and -
+    // the terms are left on the stack (a - b as a + -b) and added up at the
+    // end by one Op::sum; just two terms get a plain add or sub
 {
-    mpq_class left = term();           // read and evaluate a term
+    term(code);                     // read and compile a term
     Token t = ts.get();             // get next token from Token_stream
+    int terms = 1;
+    bool minus = false;             // was the last term subtracted?
 
     while (true) {
         switch (t.kind) {
             case '+':
-                left += term();     // evaluate term and add
+                term(code);
+                ++terms;
+                minus = false;
                 t = ts.get();
                 break;
             case '-':
-                left -= term();     // evaluate term and subtract
+                term(code);
+                code.emit(Op::neg);     // subtract the term
+                ++terms;
+                minus = true;
                 t = ts.get();
                 break;
             default:
                 ts.putback(t);      // put t back into the token stream
-                return left;
+                if (terms == 2 && minus) {
+                    code.instrs.pop_back();
+                    code.emit(Op::sub);
+                }
+                else if (terms == 2)
+                    code.emit(Op::add);
+                else if (terms > 2)
+                    code.emit(Op::sum, terms);
+                return;
         }
     }
 }
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
-mpq_class declaration(bool b)
+void Calculator::declaration(bool b, Code& code)
     // assume we have seen "let" or "constant"
     // handle: name = expression
     // declare a variable called "name" with the initial value "expression"
 {
     Token t = ts.get();
-    if (t.kind != name) error("name expected in declaration");
+    if (t.kind != name && t.kind != fnConst) error("name expected in declaration");
     string var_name = t.name;
 
     Token t2 = ts.get();
     if (t2.kind != '=') error("= missing in declaration of ", var_name);
 
-    mpq_class d = expression();
-    st.declare(var_name, d, b);
-    return d;
+    if (spreadsheet && !b) {        // keep the formula, see Sheet
+        Code f;
+        f.index = st.slot(var_name);
+        expression(f);
+        if (code_use(f).assigns) error("spreadsheet: a formula may not assign to a variable");
+        code.bodies.push_back(move(f));
+        code.emit(Op::define, code.bodies.size()-1);
+        return;
+    }
+    expression(code);
+    code.emit(b ? Op::declare_const : Op::declare, st.slot(var_name));
 }
 
-mpq_class statement()  // handles declarations and expressions
+Code Calculator::statement()  // handles declarations and expressions
 {
+    Code code;
     Token t = ts.get();
     switch (t.kind) {
         case let:
-            return declaration(false);
+            declaration(false, code);
+            break;
 
         case constant:
-            return declaration(true);
+            declaration(true, code);
+            break;
 
         default:
             ts.putback(t);
-            return expression();
+            expression(code);
     }
+    return code;
 }
 
-void print_help()
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  Op::sum: a + b + c + ... for n terms.  Adding one term at a time reduces
+    the running total every time, a gcd with an ever growing denominator, and
+    that is where 1/1 + 1/2 + ... + 1/5000 spent nearly all of its time.
+    Instead the terms are added in longs while the total stays small, and the
+    rest are added as unreduced fractions in a balanced tree,
+        n/d + n'/d' = (n*(d'/g) + n'*(d/g)) / (d*(d'/g))    with g = gcd(d, d')
+    and a single canonicalize() at the end.  Only the denominators are kept
+    down (to their lcm; 1/1! + 1/2! + ... would otherwise multiply all the
+    factorials together), the gcd with the numerator waits for the end, or
+    until the denominator grows past reduce_bits.
+*/
+
+const size_t reduce_bits = 1 << 20;
+
+struct Fraction {       // not (yet) in lowest terms
+    mpz_class num;
+    mpz_class den;
+};
+
+Fraction fraction_sum(const Rational* a, const Rational* b)
+    // the sum of [a, b), which is not empty
 {
-    cout << "Rational Calculator with Big Integers\n"
-         << "========================================================\n"
-         << "This calculator program supports +, -, *, and / operations\n"
-         << "Enter any form of compound statement followed by ';' for result\n"
-         << "(You may also just hit enter to see the result)\n"
-         << "- ex: (5-2)/{6*(8+14)} = 1/44 = 0.0227273\n\n"
-         << "An '!' placed after a value will calculate the factorial of it\n"
-         << "- ex: 4! = 4 * 3 * 2 * 1  (for integers only)\n"
-         << "You may use ^ for exponent, and enforce binding\n"
-         << "- ex: > {(2^4)*(5^3)}*{{(2*5*11)/{(2^2)*(5^2)}}^5} = 161051/50 = 3221.02\n"
-         << "- ex: 44!/(12!*32!) = 21090682613 = 2.10907e+10\n\n"
-         << " Combinations and Permutations:\n"
-         << "nCr(8,4)*nCr(5,2) = 700, but 8C4*5C2 = 61075 (not what we want!)\n"
-         << "You need to enforce binding: (8C4)*(5C2) = 700\n"
-         << "Likewise, you can use nPr(7,3) or 7P3\n\n"
-         << "Modulus:\n10%3 = 1, 5C3 = 10, 5C3%3 = 1\n"
-         << "The modulus operator % may be used on integers, but not on fractions\n\n"
-         << "Note about integer division and powers:\n"
-         << "8^(1/3) = 8 (if you need = 2, then use 'hc' which handles doubles)\n"
-         << "45^2 = 2025, 5C3^2 = 100\n\n"
-         << "Variable assignment is provided using the 'let' keyword:\n"
-         << "- ex: let x = 37/2; x * 5 = ; x = 185/2 = 92.5\n\n"
-         << "To be used for PROBABILITY: (3C2)/(12C2) = 1/22 = 0.0454545\n\n";
+    if (b - a == 1) return Fraction{a->get_num(), a->get_den()};
+    const Rational* m = a + (b - a)/2;
+    Fraction x = fraction_sum(a, m);
+    Fraction y = fraction_sum(m, b);
+    check_budget();
+    Fraction s;
+    if (x.den == y.den) {       // integers, or the same denominator
+        s.num = x.num + y.num;
+        s.den = x.den;
+    }
+    else {
+        mpz_class g = gcd(x.den, y.den);
+        mpz_class xd = x.den/g;
+        mpz_class yd = y.den/g;
+        s.num = x.num*yd + y.num*xd;
+        s.den = x.den*yd;
+    }
+    if (mpz_sizeinbase(s.den.get_mpz_t(), 2) > reduce_bits) {
+        mpz_class g = gcd(s.num, s.den);
+        s.num /= g;
+        s.den /= g;
+    }
+    return s;
+}
+
+Rational sum_terms(const Rational* a, const Rational* b)
+{
+    Rational s = *a++;
+    while (a < b && s.is_small() && a->is_small()) s += *a++;
+    if (a == b) return s;
+    Fraction f = fraction_sum(a, b);
+    mpq_class q(f.num, f.den);
+    q.canonicalize();
+    return s + Rational(q);
 }
 
 // * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  sum(i, a, b, term) and prod(i, a, b, term)
+
+    The term is evaluated for i = a, a+1, ..., b and the values are combined
+    by binary splitting, never one at a time: a sum goes through sum_terms()
+    above, a product is a product tree of the numerators and one of the
+    denominators, reduced once at the end.
+
+    A sum whose terms grow, like sum(i, 0, n, 1/i!) for e, is not built a
+    term at a time at all when the ratio of two neighbouring terms is a ratio
+    of polynomials in i, t(i)/t(i-1) = p(i)/q(i): 1/i for 1/i!, x^2/(2i(2i-1))
+    for x^(2i)/(2i)!, (n-i+1)/i for nCr(n, i).  term_ratio() reads p and q
+    off the compiled term.  Then only t(a) is evaluated, and
+        sum = t(a) * (1 + r(a+1) + r(a+1)*r(a+2) + ...),   r = p/q
+    where a range [l, r) of the ratios is summed as
+        leaf k:           P = p(k), Q = q(k), T = p(k)
+        [l,m) + [m,r):    P = P1*P2, Q = Q1*Q2, T = T1*Q2 + P1*T2
+    and T/Q is the sum over the range.  The big numbers are only ever made
+    by balanced multiplications of numbers of about the same size, so n
+    terms cost O(M(n log n) log n) instead of the n full terms' O(n M(n log n)).
+    A term that stays small (1/i, 1/i^2, a probability) is added by
+    sum_terms(), whose denominators are the lcm of the terms' rather than
+    their product, and so is any term term_ratio() can not read (a call, an
+    if(), a root, a nested sum), whose first term is 0, or whose ratio has a
+    q(k) = 0 in the range.
+*/
 
-void clean_up_mess()  {
-    ts.ignore(print);
+const unsigned long max_series_terms = 1ul << 26;
+
+Rational series_sum(const vector<Rational>& terms)
+{
+    if (terms.empty()) return 0;
+    return sum_terms(&terms[0], &terms[0] + terms.size());
 }
 
-void calculate()   //expression evaluation loop
+Fraction fraction_product(const Rational* a, const Rational* b)
+    // the product of [a, b), which is not empty
 {
-  while (cin)
-    try {
-      cout << prompt;
-      Token t = ts.get();
-      while (t.kind == print) t = ts.get();  // eats ';' to discard extra 'prints'
-      if (t.kind == help) print_help();
-      else if (t.kind == quit)  return;  // for a clean exit!
-      else {
-        ts.putback(t);
-        mpq_class temp = statement();
-        cout << result << temp << " = " << temp.get_d() << '\n';
-      }
+    if (b - a == 1) return Fraction{a->get_num(), a->get_den()};
+    const Rational* m = a + (b - a)/2;
+    Fraction x = fraction_product(a, m);
+    Fraction y = fraction_product(m, b);
+    check_budget();
+    return Fraction{x.num*y.num, x.den*y.den};
+}
 
-    }
-    catch(exception& e) {
-        cerr << e.what() << '\n';
-        clean_up_mess();
-      }
+Rational series_prod(const vector<Rational>& terms)
+{
+    for (const Rational& t : terms)
+        if (t.sign() == 0) return 0;
+    // in longs while that lasts, as in sum_terms()
+    Rational p = 1;
+    size_t k = 0;
+    while (k < terms.size() && p.is_small() && terms[k].is_small()) p *= terms[k++];
+    if (k == terms.size()) return p;
+    Fraction f = fraction_product(&terms[k], &terms[0] + terms.size());
+    mpq_class q(f.num, f.den);
+    q.canonicalize();
+    return p * Rational(q);
+}
+
+// polynomials in the index, lowest coefficient first
+using Poly = vector<mpq_class>;
+
+const size_t max_ratio_degree = 16;     // beyond this p and q are not worth it
+
+Poly poly_add(const Poly& f, const Poly& g)
+{
+    Poly h(max(f.size(), g.size()));
+    for (size_t i = 0; i < f.size(); ++i) h[i] += f[i];
+    for (size_t i = 0; i < g.size(); ++i) h[i] += g[i];
+    while (h.size() > 1 && h.back() == 0) h.pop_back();
+    return h;
+}
+
+Poly poly_mul(const Poly& f, const Poly& g)
+{
+    Poly h(f.size() + g.size() - 1);
+    for (size_t i = 0; i < f.size(); ++i)
+        for (size_t j = 0; j < g.size(); ++j) h[i+j] += f[i]*g[j];
+    while (h.size() > 1 && h.back() == 0) h.pop_back();
+    return h;
+}
+
+Poly poly_pow(const Poly& f, long m)
+{
+    Poly h { 1 };
+    for (long i = 0; i < m; ++i) h = poly_mul(h, f);
+    return h;
+}
+
+Poly poly_previous(const Poly& f)
+    // f(i-1)
+{
+    Poly h { 0 };
+    for (size_t i = f.size(); i > 0; --i) h = poly_add(poly_mul(h, Poly{-1, 1}), Poly{f[i-1]});
+    return h;
+}
+
+mpq_class poly_at(const Poly& f, long k)
+{
+    mpq_class v = 0;
+    for (size_t i = f.size(); i > 0; --i) v = v*k + f[i-1];
+    return v;
+}
+
+struct Series_term {    // what term_ratio() knows about a value in the term
+    bool ratio { false };   // false: the value is f(i); true: only p(i)/q(i) is known
+    bool grows { false };   // ! C P, or i in an exponent, went into it
+    Poly f { 0 };
+    Poly p { 1 };
+    Poly q { 1 };
+
+    bool is_constant() const { return !ratio && f.size() == 1; }
+    bool is_unit_linear() const     // i + an integer
+        { return !ratio && f.size() == 2 && f[1] == 1 && f[0].get_den() == 1; }
+    void to_ratio()
+    {
+        if (ratio) return;
+        ratio = true;
+        if (f.size() > 1) {     // f(i)/f(i-1); a constant is 1
+            p = f;
+            q = poly_previous(f);
+        }
+    }
+};
+
+bool small_integer(const mpq_class& x, long& m)
+{
+    if (x.get_den() != 1 || !x.get_num().fits_slong_p()) return false;
+    m = x.get_num().get_si();
+    return true;
+}
+
+bool Calculator::term_ratio(const Code& body, long from, Poly& p, Poly& q)
+    // is t(i)/t(i-1) = p(i)/q(i) for the term compiled in body, i = from, ...?
+    // See above
+{
+    vector<Series_term> stack;
+    for (const Instr& in : body.instrs) {
+        Series_term x;
+        if (in.op == Op::push) {
+            x.f = Poly{body.literals[in.arg].to_mpq()};
+            stack.push_back(x);
+            continue;
+        }
+        if (in.op == Op::load) {
+            if (in.arg == body.index) x.f = Poly{0, 1};
+            else x.f = Poly{st.get(in.arg).to_mpq()};   // fixed while the sum runs
+            stack.push_back(x);
+            continue;
+        }
+        if (stack.empty()) return false;
+        Series_term& top = stack.back();
+        switch (in.op) {
+            case Op::neg:
+                if (!top.ratio) top.f = poly_mul(top.f, Poly{-1});     // the ratio stays
+                continue;
+            case Op::fact:
+            {
+                long alpha;
+                if (top.is_constant()) {
+                    top.f = Poly{fact(Rational(top.f[0])).to_mpq()};
+                    continue;
+                }
+                // (alpha i + beta)! / (alpha (i-1) + beta)!, alpha factors
+                if (top.ratio || top.f.size() != 2 || top.f[0].get_den() != 1
+                    || !small_integer(top.f[1], alpha) || alpha < 1 || alpha > long(max_ratio_degree))
+                    return false;
+                Poly r { 1 };
+                for (long j = 0; j < alpha; ++j)
+                    r = poly_mul(r, Poly{top.f[0] - j, alpha});
+                top.ratio = top.grows = true;
+                top.p = r;
+                top.q = Poly{1};
+                continue;
+            }
+            case Op::constant:
+                if (!top.is_constant()) return false;
+                top.f = Poly{constant_value(Constant(in.arg), Rational(top.f[0])).to_mpq()};
+                continue;
+            case Op::sum:
+            {
+                if (stack.size() < size_t(in.arg)) return false;
+                Poly f { 0 };
+                for (size_t i = stack.size() - in.arg; i < stack.size(); ++i) {
+                    if (stack[i].ratio) return false;   // a sum of ratios is not one
+                    f = poly_add(f, stack[i].f);
+                }
+                stack.resize(stack.size() - in.arg + 1);
+                stack.back().f = f;
+                continue;
+            }
+            case Op::add: case Op::sub: case Op::mul: case Op::div: case Op::mod:
+            case Op::pow: case Op::ncr: case Op::npr:
+                break;
+            default:
+                return false;       // calls, if(), nested sums, assignments
+        }
+
+        // binary operators: left is just below the top of the stack
+        if (stack.size() < 2) return false;
+        Series_term& left = stack[stack.size()-2];
+        Series_term right = stack.back();
+        stack.pop_back();
+        if (left.is_constant() && right.is_constant()) {    // as execute() does it
+            Rational a(left.f[0]);
+            Rational b(right.f[0]);
+            switch (in.op) {
+                case Op::add: a += b; break;
+                case Op::sub: a -= b; break;
+                case Op::mul: a *= b; break;
+                case Op::div:
+                    if (b == 0) return false;
+                    a /= b;
+                    break;
+                case Op::mod:
+                    if (b.sign() == 0) return false;
+                    a = mpz_class(a.get_num() % b.get_num());
+                    break;
+                case Op::pow: a = power(a, b, in.arg); break;
+                case Op::ncr: a = nCk(a, b); break;
+                case Op::npr: a = nPk(a, b); break;
+                default: return false;
+            }
+            left.f = Poly{a.to_mpq()};
+            continue;
+        }
+        long m;
+        switch (in.op) {
+            case Op::add:
+            case Op::sub:
+                if (left.ratio || right.ratio) return false;
+                if (in.op == Op::sub) right.f = poly_mul(right.f, Poly{-1});
+                left.f = poly_add(left.f, right.f);
+                break;
+            case Op::mul:
+                if (!left.ratio && !right.ratio) {
+                    left.f = poly_mul(left.f, right.f);
+                    break;
+                }
+                left.to_ratio();
+                right.to_ratio();
+                left.p = poly_mul(left.p, right.p);
+                left.q = poly_mul(left.q, right.q);
+                left.grows = left.grows || right.grows;
+                break;
+            case Op::div:
+                if (right.is_constant()) {
+                    if (right.f[0] == 0) return false;
+                    if (!left.ratio) left.f = poly_mul(left.f, Poly{1/right.f[0]});
+                    break;
+                }
+                left.to_ratio();
+                right.to_ratio();
+                left.p = poly_mul(left.p, right.q);
+                left.q = poly_mul(left.q, right.p);
+                left.grows = left.grows || right.grows;
+                break;
+            case Op::pow:
+                if (right.is_constant()) {          // f^m: integer m only, no roots
+                    if (!small_integer(right.f[0], m) || m > long(max_ratio_degree)
+                        || m < -long(max_ratio_degree))
+                        return false;
+                    if (!left.ratio && m >= 0) {
+                        left.f = poly_pow(left.f, m);
+                        break;
+                    }
+                    left.to_ratio();
+                    if (m < 0) swap(left.p, left.q);
+                    left.p = poly_pow(left.p, abs(m));
+                    left.q = poly_pow(left.q, abs(m));
+                    break;
+                }
+                // c^(alpha i + beta), whole alpha and beta: the ratio is c^alpha
+                if (left.is_constant() && left.f[0] != 0 && !right.ratio && right.f.size() == 2
+                    && right.f[0].get_den() == 1 && small_integer(right.f[1], m)) {
+                    mpq_class c = m < 0 ? 1/left.f[0] : left.f[0];
+                    mpz_class num, den;
+                    mpz_pow_ui(num.get_mpz_t(), c.get_num().get_mpz_t(), abs(m));
+                    mpz_pow_ui(den.get_mpz_t(), c.get_den().get_mpz_t(), abs(m));
+                    left.ratio = left.grows = true;
+                    left.p = Poly{mpq_class(num)};
+                    left.q = Poly{mpq_class(den)};
+                    break;
+                }
+                return false;
+            case Op::ncr:
+            case Op::npr:
+            {
+                // i+b < 0 makes the term 0, and no ratio leads out of that:
+                // sum(i, -2, 3, nPr(5, i)) = 86, sum(i, 0, 3, nPr(5, i-2)) = 6
+                const Series_term& arg = left.is_constant() ? right : left;
+                if (arg.is_unit_linear() && arg.f[0] + from < 0) return false;
+                // C(n, i+b) = C(n, i+b-1) * (n-i-b+1)/(i+b), P(n, i+b) the same times (i+b)
+                if (left.is_constant() && right.is_unit_linear() && left.f[0].get_den() == 1) {
+                    mpq_class b = right.f[0];
+                    left.p = Poly{left.f[0] - b + 1, -1};
+                    left.q = in.op == Op::ncr ? Poly{b, 1} : Poly{1};
+                }
+                // C(i+b, k) = C(i+b-1, k) * (i+b)/(i+b-k), and P(i+b, k) too
+                else if (left.is_unit_linear() && right.is_constant()
+                         && small_integer(right.f[0], m) && m >= 0) {
+                    mpq_class b = left.f[0];
+                    left.p = Poly{b, 1};
+                    left.q = Poly{b - m, 1};
+                }
+                else return false;
+                left.ratio = left.grows = true;
+                break;
+            }
+            default:
+                return false;
+        }
+        if (left.f.size() > max_ratio_degree + 1 || left.p.size() > max_ratio_degree + 1
+            || left.q.size() > max_ratio_degree + 1)
+            return false;
+    }
+    if (stack.size() != 1 || !stack[0].ratio || !stack[0].grows) return false;
+    p = stack[0].p;
+    q = stack[0].q;
+    return true;
+}
+
+struct PQT {
+    mpz_class p;
+    mpz_class q;
+    mpz_class t;
+};
+
+struct Zero_ratio { };      // a q(k) is 0: the ratios do not go through t(k-1)
+
+PQT split_series(const Poly& p, const Poly& q, long a, long b)
+    // P, Q and T of the ratios p(k)/q(k) for k in [a, b), which is not empty
+{
+    if (b - a == 1) {
+        mpq_class x = poly_at(p, a);
+        mpq_class y = poly_at(q, a);
+        if (y == 0) throw Zero_ratio{};
+        mpz_class n = x.get_num() * y.get_den();
+        return PQT{n, x.get_den() * y.get_num(), n};
+    }
+    long m = a + (b - a)/2;
+    PQT x = split_series(p, q, a, m);
+    PQT y = split_series(p, q, m, b);
+    check_budget();
+    return PQT{x.p*y.p, x.q*y.q, x.t*y.q + x.p*y.t};
+}
+
+Rational Calculator::series(const Code& body, const Rational& a, const Rational& b, bool sum)
+    // run body for index = a..b, then add or multiply up the terms
+{
+    const string what = sum ? sumkey : prodkey;
+    if (!a.is_small() || !b.is_small() || a.small_den() != 1 || b.small_den() != 1)
+        error(what, ": the bounds must be whole numbers");
+    long from = a.small_num();
+    long to = b.small_num();
+    if (to < from) return sum ? 0 : 1;      // empty
+    if ((unsigned long)to - (unsigned long)from >= max_series_terms)
+        error(what, ": too many terms");
+
+    Variable old = st.saved(body.index);    // the index is local to the series
+    Poly p, q;
+    if (sum && to > from && term_ratio(body, from, p, q)) {
+        try {
+            st.bind(body.index, from);
+            Rational first = execute(body);
+            st.restore(body.index, old);
+            if (first == 0) throw Zero_ratio{};     // every later term would be 0 too
+            PQT s = split_series(p, q, from + 1, to + 1);
+            mpq_class r(s.q + s.t, s.q);
+            r.canonicalize();
+            return first * Rational(r);
+        }
+        catch (Zero_ratio&) {
+            // fall through to the terms one by one
+        }
+        catch (...) {
+            st.restore(body.index, old);
+            throw;
+        }
+    }
+
+    vector<Rational> terms;
+    terms.reserve(to - from + 1);
+    try {
+        for (long i = from; i <= to; ++i) {
+            st.bind(body.index, i);
+            terms.push_back(execute(body));
+            check_budget();
+        }
+    }
+    catch (...) {
+        st.restore(body.index, old);
+        throw;
+    }
+    st.restore(body.index, old);
+    return sum ? series_sum(terms) : series_prod(terms);
+}
+
+Rational Calculator::define(const Code& f)
+    // let f.index = f, and keep f
+{
+    Rational v = execute(f);
+    st.declare(f.index, v);
+    sheet.define(f.index, f);
+    return v;
+}
+
+void Calculator::update(int slot)
+    // slot has a new value: recompute the formulas depending on it, each once,
+    // and only if one of its inputs changed
+{
+    set<int> changed { slot };
+    for (int s : sheet.downstream(slot)) {
+        const Sheet::Formula& f = sheet.formula(s);
+        bool stale = false;
+        for (int in : f.inputs)
+            if (changed.count(in)) stale = true;
+        if (!stale) continue;
+        Rational v;
+        try {
+            v = execute(f.code);
+        }
+        catch(exception& e) {
+            error("updating " + st.saved(s).name + ": ", e.what());
+        }
+        if (v == st.get(s)) continue;   // its users need not move
+        st.set(s, v);
+        changed.insert(s);
+    }
+}
+
+const size_t max_call_stack = 6 << 20;     // bytes of stack the calls may use
+thread_local int call_depth = 0;            // calls under way in this thread
+thread_local uintptr_t call_stack_base;     // where the outermost one started
+
+Rational Calculator::call(Function& f, const Rational* args)
+    // bind the parameters like series() binds its index, run the body, and
+    // put the old values back
+{
+    vector<Rational> key;
+    if (f.memo) {
+        key.assign(args, args + f.params.size());
+        lock_guard<mutex> held(f.guard);
+        auto p = f.memo_table.find(key);
+        if (p != f.memo_table.end()) return p->second;
+    }
+    // a recursion that doesn't stop runs out of stack long before memory:
+    // stop it at three quarters of the usual 8 MB
+    char here;
+    if (call_depth == 0) call_stack_base = uintptr_t(&here);
+    else if (call_stack_base - uintptr_t(&here) > max_call_stack)
+        error(f.name, ": calls nested too deep");
+    check_budget();
+
+    vector<Variable> old;
+    for (int s : f.params) old.push_back(st.saved(s));
+    auto put_back = [&] {
+        for (size_t i = old.size(); i > 0; --i) st.restore(f.params[i-1], old[i-1]);
+        --call_depth;
+    };
+    ++call_depth;
+    Rational r;
+    try {
+        for (size_t i = 0; i < f.params.size(); ++i) st.bind(f.params[i], args[i]);
+        r = execute(f.body);
+    }
+    catch (...) {
+        put_back();
+        throw;
+    }
+    put_back();
+
+    if (f.memo) {
+        lock_guard<mutex> held(f.guard);
+        f.memo_table.emplace(move(key), r);
+    }
+    return r;
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+// the stack machine
+
+Rational Calculator::execute(const Code& code)
+    // run the instructions of a compiled statement; the result is left on top
+{
+    Statement_budget budget;        // memory and time, see budget.h
+    vector<Rational> stack;
+    stack.reserve(code.instrs.size());
+
+    for (const Instr& in : code.instrs) {
+        if (in.op == Op::push) {
+            stack.push_back(code.literals[in.arg]);
+            continue;
+        }
+        if (in.op == Op::load) {
+            stack.push_back(st.get(in.arg));
+            continue;
+        }
+        if (in.op == Op::unknown) error("get: undefined variable ", code.names[in.arg]);
+        if (in.op == Op::unknown_store) error("set: undefined variable ", code.names[in.arg]);
+        if (in.op == Op::define) {
+            stack.push_back(define(code.bodies[in.arg]));
+            continue;
+        }
+        if (in.op == Op::call) {
+            Function& f = *code.calls[in.arg];
+            size_t first = stack.size() - f.params.size();
+            Rational r = call(f, stack.data() + first);
+            stack.resize(first);
+            stack.push_back(move(r));
+            continue;
+        }
+
+        check_budget();             // what the last one built may be over
+        Rational& top = stack.back();
+        switch (in.op) {
+            case Op::store:
+                st.set(in.arg, top);
+                break;
+            case Op::update:
+            {
+                bool same = st.get(in.arg) == top;
+                st.set(in.arg, top);
+                sheet.forget(in.arg);
+                if (!same) update(in.arg);
+                break;
+            }
+            case Op::declare:
+                st.declare(in.arg, top, false);
+                break;
+            case Op::declare_const:
+                st.declare(in.arg, top, true);
+                break;
+            case Op::neg:
+                top = -top;
+                break;
+            case Op::powmod:
+            {
+                // base, power and modulus are the top three
+                Rational& base = stack[stack.size()-3];
+                const Rational& p = stack[stack.size()-2];
+                const Rational& m = top;
+                if (m.sign() == 0) error("%:divide by zero");
+                if (in.arg >= 0 && (p < 0 || p.get_den() != 1))   // ^ then %, as without powmod
+                    base = mpz_class(power(base, p, in.arg).get_num() % m.get_num());
+                else
+                    base = powmod(base.get_num(), p.get_num(), m.get_num());
+                stack.pop_back();
+                stack.pop_back();
+                break;
+            }
+            case Op::sum:
+            {
+                size_t first = stack.size() - in.arg;
+                Rational s = sum_terms(&stack[first], &stack[first] + in.arg);
+                stack.resize(first + 1);
+                stack.back() = move(s);
+                break;
+            }
+            case Op::series_sum:
+            case Op::series_prod:
+            {
+                // the bounds are the top two
+                Rational& from = stack[stack.size()-2];
+                from = series(code.bodies[in.arg], from, top, in.op == Op::series_sum);
+                stack.pop_back();
+                break;
+            }
+            case Op::constant:
+                top = constant_value(Constant(in.arg), top);
+                break;
+            case Op::choose:
+                top = execute(code.bodies[top.sign() != 0 ? in.arg : in.arg+1]);
+                break;
+            case Op::fact:
+            {
+                // replace with Big Integer mpz_class version
+                top = fact(top);
+                break;
+            }
+            default:
+            {
+                // binary operators: left is just below the top of the stack
+                Rational& left = stack[stack.size()-2];
+                const Rational& d = top;
+                switch (in.op) {
+                    case Op::add: left += d; break;
+                    case Op::sub: left -= d; break;
+                    case Op::mul: left *= d; break;
+                    case Op::div:
+                        if (d == 0) error("divide by zero");
+                        left /= d;
+                        break;
+                    case Op::mod:
+                        if (d.sign() == 0) error("%:divide by zero");
+                        if (left.is_small() && d.is_small()) {   // numerators, like below
+                            left = left.small_num() % d.small_num();
+                            break;
+                        }
+                        // for C:
+                        // mpz_t temp;
+                        // mpz_mod (temp, left.get_mpz_t(), d.get_mpz_t());
+                        // left = mpz_class(temp);
+                        // for C++:
+                        left = mpz_class(left.get_num() % d.get_num());
+                        break;
+                    case Op::pow:
+                        left = power(left, d, in.arg);
+                        break;
+                    case Op::ncr:
+                        left = nCk(left, d);
+                        break;
+                    case Op::npr:
+                        left = nPk(left, d);
+                        break;
+                    default:
+                        error("execute: bad instruction");
+                }
+                stack.pop_back();
+            }
+        }
+    }
+    return stack.back();
+}
+
+void print_help()
+{
+    cout << "Rational Calculator with Big Integers\n"
+         << "========================================================\n"
+         << "This calculator program supports +, -, *, and / operations\n"
+         << "Enter any form of compound statement followed by ';' for result\n"
+         << "(You may also just hit enter to see the result)\n"
+         << "- ex: (5-2)/{6*(8+14)} = 1/44 = 0.0227273\n\n"
+         << "An '!' placed after a value will calculate the factorial of it\n"
+         << "- ex: 4! = 4 * 3 * 2 * 1  (for integers only)\n"
+         << "You may use ^ for exponent, and enforce binding\n"
+         << "- ex: > {(2^4)*(5^3)}*{{(2*5*11)/{(2^2)*(5^2)}}^5} = 161051/50 = 3221.02\n"
+         << "- ex: 44!/(12!*32!) = 21090682613 = 2.10907e+10\n\n"
+         << " Combinations and Permutations:\n"
+         << "nCr(8,4)*nCr(5,2) = 700, but 8C4*5C2 = 61075 (not what we want!)\n"
+         << "You need to enforce binding: (8C4)*(5C2) = 700\n"
+         << "Likewise, you can use nPr(7,3) or 7P3\n\n"
+         << "Modulus:\n10%3 = 1, 5C3 = 10, 5C3%3 = 1\n"
+         << "The modulus operator % may be used on integers, but not on fractions\n\n"
+         << "Numbers are exact: 0.1 = 1/10, 2.5e3 = 2500, 1e-3 = 1/1000\n"
+         << "and you may write integers in hex (0x1F) or binary (0b101)\n\n"
+         << "Powers and roots:\n"
+         << "45^2 = 2025, 5C3^2 = 100, 2^-2 = 1/4, 8^(1/3) = 2, (27/8)^(2/3) = 9/4\n"
+         << "A root that is not exact has 'precision' decimals (20 to start with):\n"
+         << "- ex: precision 5; 2^(1/2) = 141421/100000 = 1.41421\n\n"
+         << "Variable assignment is provided using the 'let' keyword:\n"
+         << "- ex: let x = 37/2; x * 5 = ; x = 185/2 = 92.5\n\n"
+         << "To be used for PROBABILITY: (3C2)/(12C2) = 1/22 = 0.0454545\n\n"
+         << "Sums and products over i = a, a+1, ..., b:\n"
+         << "sum(i, 1, 4, 1/i) = 25/12, prod(i, 1, 5, i) = 120\n"
+         << "sum(k, 0, 3, (3Ck)/(2^3)) = 1, sum(i, 0, 20, 1/i!) is close to e\n\n"
+         << "Constants to as many decimals as you ask for:\n"
+         << "pi(4) = 6283/2000 = 3.1415, and likewise e(n), ln2(n) and ln10(n)\n"
+         << "A variable may still be called pi, e, ln2 or ln10: e(5) is the constant, e is the variable\n"
+         << "(set CALC_CACHE to a directory to keep them between runs)\n\n"
+         << "Huge results: 'digits 1000' shows the first and last 1000 digits,\n"
+         << "'digits count' only how many there are, 'digits all' every one;\n"
+         << "'save out.txt' writes all the digits of the last result to a file\n\n"
+         << "A statement may use 1024 MB and as long as it likes; set CALC_MAX_MEMORY\n"
+         << "(MB, 0 for no limit) and CALC_MAX_TIME (seconds) to change that\n\n"
+         << "'spreadsheet on': a variable made with let remembers its formula,\n"
+         << "and changing a variable recomputes the ones made from it:\n"
+         << "- ex: let x = 2; let y = x^2; x = 3; y = 9 ('spreadsheet off' to stop)\n\n"
+         << "Functions: def f(n, k) = nCr(n, k) * (2^n); f(4, 2) = 96\n"
+         << "if(c, a, b) is a if c is not 0, else b, so a function may call itself;\n"
+         << "'def memo' keeps the results (only for functions of their arguments):\n"
+         << "- ex: def memo fib(n) = if(n-1, if(n, fib(n-1) + fib(n-2), 0), 1)\n\n"
+         << "^C stops the statement being worked out.  One that ends with '&'\n"
+         << "runs in the background: let f = 1000000! &; 'jobs' lists what is\n"
+         << "running, 'wait' (or 'wait 1') waits and shows the results\n\n";
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+
+void Calculator::clean_up_mess()  {
+    ts.ignore(print);
+}
+
+Rational Calculator::evaluate(string_view s)
+    // run the statements in s, as many as there are, like a batch without
+    // output: "digits", "save", "spreadsheet" and "def" work, help is
+    // ignored, errors are thrown.
+    // Returns the value of the last statement (last_result).
+{
+    ts.from_string(s);
+    try {
+        while (true) {
+            Token t = ts.get();
+            while (t.kind == print) t = ts.get();
+            if (t.kind == quit) break;
+            else if (t.kind == digitscmd) set_digits();
+            else if (t.kind == savecmd) save_result();
+            else if (t.kind == sheetcmd) set_spreadsheet();
+            else if (t.kind == precisioncmd) set_precision();
+            else if (t.kind == defcmd) def_function();
+            else if (t.kind != help) {
+                ts.putback(t);
+                Code code = statement();
+                last_result = execute(code);
+            }
+        }
+    }
+    catch (...) {
+        ts.from_string(string_view{});      // s need not outlive us
+        throw;
+    }
+    ts.from_string(string_view{});
+    return last_result;
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  Batch mode:  qc --batch in.txt [--out results.txt] [--exact | --decimal]
+
+    For scripts with millions of statements.  No prompts, no help, no banner;
+    one line of output per statement, collected in an Output_buffer (see
+    buffered_io.h) and written with write(), not cout.  A statement that
+    fails gives an "error: line N: ..." line in its place and the run goes
+    on with the next line.  "-" means standard input/output.
+    Results come out with every digit unless a "digits" statement says
+    otherwise; the interactive calculate() below shares put_result().
+    With --jobs N independent statements run on N threads (see parallel_batch()).
+*/
+
+void put_exact(Output_buffer& out, const Rational& r, const Digits_format& d)
+    // for put_result(), see buffered_io.h
+{
+    if (r.is_small()) {
+        char* s = out.room(48);
+        int n = r.small_den() == 1 ? snprintf(s, 48, "%ld", r.small_num())
+                                   : snprintf(s, 48, "%ld/%ld", r.small_num(), r.small_den());
+        out.used(s, n);
+    }
+    else {
+        put_integer(out, r.get_num(), d);       // streamed, never one huge string
+        if (r.get_den() != 1) {
+            out.put('/');
+            put_integer(out, r.get_den(), d);
+        }
+    }
+}
+
+mpz_class integer_part(const Rational& r)
+{
+    return r.get_num() / r.get_den();
+}
+
+void Calculator::set_digits()
+    // assume we have seen "digits"
+    // handle: all | count | N
+{
+    Token t = ts.get();
+    if (t.kind == name && t.name == "all") digits_format = Digits_format{Digits_mode::all, 0};
+    else if (t.kind == name && t.name == "count") digits_format = Digits_format{Digits_mode::count, 0};
+    else if (t.kind == number && t.value > 0 && t.value.is_small() && t.value.small_den() == 1)
+        digits_format = Digits_format{Digits_mode::ends, size_t(t.value.small_num())};
+    else error("digits: all, count or a number of digits expected");
+}
+
+void Calculator::set_precision()
+    // assume we have seen "precision"
+    // handle: N, the decimals of a root that is not exact
+{
+    Token t = ts.get();
+    if (t.kind == number && t.value >= 0 && t.value <= max_exponent
+        && t.value.is_small() && t.value.small_den() == 1)
+        precision = t.value.small_num();
+    else error("precision: a number of decimals expected");
+}
+
+void save_value(const string& path, const Rational& r)
+    // write every digit of r to the file path
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) error("can't open output file ", path);
+    try {
+        Output_buffer out(fd);
+        put_result(out, r, Format::exact, Digits_format{});
+        out.flush();
+    }
+    catch(...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+}
+
+void Calculator::set_spreadsheet()
+    // assume we have seen "spreadsheet"
+    // handle: on | off
+{
+    Token t = ts.get();
+    if (t.kind == name && t.name == "on") spreadsheet = true;
+    else if (t.kind == name && t.name == "off") spreadsheet = false;
+    else error("spreadsheet: on or off expected");
+}
+
+string Calculator::save_path()
+    // assume we have seen "save"
+    // the file named by the rest of the line
+{
+    string path = ts.rest_of_line();
+    if (!allow_save) error("save: not allowed here");
+    if (path.empty()) error("save: file name expected");
+    return path;
+}
+
+void Calculator::save_result()
+    // write every digit of the last result to the file named by the rest of the line
+{
+    save_value(save_path(), last_result);
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+// background jobs for calculate(), see jobs.h
+
+shared_ptr<Calculator> copy_for_job(const Calculator& calc)
+    // a Calculator with calc's variables and options; the functions are
+    // shared, as a Function never changes once defined (but for its memo
+    // table, which is locked)
+{
+    auto c = make_shared<Calculator>();
+    c->st = calc.st;
+    c->function_names = calc.function_names;
+    c->digits_format = calc.digits_format;
+    c->precision = calc.precision;
+    return c;
+}
+
+struct Assignment {
+    char kind { 0 };            // let, constant, '=' or 0 for none
+    string name;
+};
+
+Assignment assignment_in(const string& s)
+    // is s "let x = ...", "constant x = ..." or "x = ..."?
+{
+    Assignment a;
+    Token_stream ts;
+    ts.from_string(s);
+    try {
+        Token t = ts.get();
+        if (t.kind == let || t.kind == constant) {
+            a.kind = t.kind;
+            t = ts.get();
+        }
+        if ((t.kind != name && t.kind != fnConst) || ts.get().kind != '=') return Assignment{};
+        if (!a.kind) a.kind = '=';
+        a.name = t.name;
+    }
+    catch (exception&) {
+        return Assignment{};
+    }
+    return a;
+}
+
+void finish_jobs(Calculator& calc, Job_table<Rational>& jobs, Output_buffer& screen)
+    // show what the finished jobs found, and do their assignments (as a
+    // value: in spreadsheet mode a job's let makes no formula)
+{
+    for (auto& j : jobs.done()) {
+        cout << '[' << j->id << "] done  " << j->text << '\n';
+        try {
+            if (!j->error.empty()) error(j->error);
+            Assignment a = assignment_in(j->text);
+            if (a.kind) {
+                Code code;
+                code.emit_literal(j->value);
+                if (a.kind == '=') code.emit(calc.spreadsheet ? Op::update : Op::store, calc.st.slot(a.name));
+                else code.emit(a.kind == constant ? Op::declare_const : Op::declare, calc.st.slot(a.name));
+                calc.execute(code);
+            }
+            cout << result << flush;
+            put_result(screen, j->value, Format::both, calc.digits_format);
+            screen.flush();
+        }
+        catch (exception& e) {
+            cerr << e.what() << '\n';
+        }
+    }
+}
+
+int job_number(Token_stream& ts)
+    // after "wait": the number of a job, 0 for all of them
+{
+    Token t = ts.get();
+    const Rational& v = t.value;
+    if (t.kind == number && v.is_small() && v.small_den() == 1 && v.small_num() > 0)
+        return v.small_num();
+    ts.putback(t);
+    return 0;
+}
+
+void calculate(Calculator& calc)   //expression evaluation loop
+{
+  Token_stream& ts = calc.ts;
+  Output_buffer screen(1);      // results go the way batch results do
+  Job_table<Rational> jobs;
+  catch_interrupts();
+  while (true)    // until quit, or the end of the input
+    try {
+      finish_jobs(calc, jobs, screen);
+      cout << prompt;
+      string text;
+      if (ts.background(text)) {
+          shared_ptr<Calculator> c = copy_for_job(calc);
+          const auto& j = jobs.start(text, [c, text] { return c->evaluate(text); });
+          cout << '[' << j.id << "] " << text << '\n';
+          continue;
+      }
+      Token t = ts.get();
+      while (t.kind == print) t = ts.get();  // eats ';' to discard extra 'prints'
+      interrupt_requested = false;           // a ^C at the prompt stops nothing
+      if (t.kind == help) print_help();
+      else if (t.kind == quit)  return;  // for a clean exit!
+      else if (t.kind == digitscmd) calc.set_digits();
+      else if (t.kind == savecmd) calc.save_result();
+      else if (t.kind == sheetcmd) calc.set_spreadsheet();
+      else if (t.kind == precisioncmd) calc.set_precision();
+      else if (t.kind == defcmd) calc.def_function();
+      else if (t.kind == jobscmd) jobs.list(cout);
+      else if (t.kind == waitcmd) {
+        jobs.wait(job_number(ts));
+        finish_jobs(calc, jobs, screen);
+      }
+      else {
+        ts.putback(t);
+        Code code = calc.statement();             // compile the whole statement first,
+        calc.last_result = calc.execute(code);    // then run it
+        cout << result << flush;
+        put_result(screen, calc.last_result, Format::both, calc.digits_format);
+        screen.flush();
+      }
+
+    }
+    catch(exception& e) {
+        screen.flush();
+        cerr << e.what() << '\n';
+        calc.clean_up_mess();
+      }
+}
+
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  Parallel batch:  qc --batch in.txt --jobs N
+
+    Most scripts are lines that have nothing to do with each other, so with
+    --jobs the statements are compiled a block at a time and run on N threads.
+    Two statements must still run in source order when one of them writes a
+    variable the other reads or writes.  The Code says which (see code_use()):
+    declaration() and handle_variable() have already turned every name into a
+    slot, load reads it, store and declare write it, sum() and prod() write
+    their index and a call does what its Function does.  So a statement
+    waits for
+        the last statement before it that writes a slot it reads or writes
+        the statements since then that read a slot it writes
+    and sees its variables just as it would have in order, errors and all.
+    In spreadsheet mode a let or an assignment touches the Sheet and may
+    recompute any formula, so such a statement runs with nothing else.
+    Every slot is interned while compiling, so the threads only read and
+    write var_table entries, they never make it grow.
+
+    A block also ends at a statement with more after it on its line: if it
+    fails, the rest of the line is skipped.  The results come out in source
+    order, as soon as the ones before them are done.  "digits" happens while compiling; "save" is done by the thread
+    writing the results, when everything before it has been written.
+*/
+
+const size_t batch_block = 1 << 12;     // statements compiled ahead
+
+struct Batch_statement {
+    enum Kind { value, save, note } kind { note };
+    int line { 0 };
+    Code code;                  // value: what to run
+    Digits_format digits;       // value: the format in effect
+    string text;                // save: the file name; note: what to print
+    vector<int> after;          // the statements waiting for this one
+    int waiting { 0 };          // how many statements this one waits for
+    bool rest_of_line { false };    // value: more follows on its line
+    bool finished { false };
+    bool ok { false };
+    Rational result;
+    string output;
+};
+
+bool read_block(Calculator& calc, vector<Batch_statement>& block)
+    // compile up to batch_block statements; false at the end of the input
+{
+    Token_stream& ts = calc.ts;
+    while (block.size() < batch_block) {
+        Batch_statement s;
+        s.line = ts.line();
+        try {
+            Token t = ts.get();
+            while (t.kind == print) t = ts.get();
+            s.line = ts.line();
+            if (t.kind == quit) return false;
+            if (t.kind == help) continue;
+            if (t.kind == digitscmd) {
+                calc.set_digits();
+                continue;
+            }
+            if (t.kind == sheetcmd) {
+                calc.set_spreadsheet();
+                continue;
+            }
+            if (t.kind == precisioncmd) {
+                calc.set_precision();
+                continue;
+            }
+            if (t.kind == defcmd) {
+                calc.def_function();
+                continue;
+            }
+            if (t.kind == savecmd) {
+                s.kind = Batch_statement::save;
+                s.text = calc.save_path();
+            }
+            else {
+                ts.putback(t);
+                s.kind = Batch_statement::value;
+                s.code = calc.statement();
+                s.digits = calc.digits_format;
+                Token next = ts.get();      // statement() put back the Token after it
+                ts.putback(next);
+                if (next.kind != print && next.kind != quit) {
+                    // like "x y": if x fails, clean_up_mess() skips y, so we
+                    // can't go on before we know how x went
+                    s.rest_of_line = true;
+                    block.push_back(move(s));
+                    return true;
+                }
+            }
+        }
+        catch(exception& e) {
+            s.kind = Batch_statement::note;
+            s.text = error_line(s.line, e);
+            calc.clean_up_mess();
+        }
+        block.push_back(move(s));
+    }
+    return true;
+}
+
+void link_block(vector<Batch_statement>& block)
+    // make each value statement wait for the ones it depends on
+{
+    vector<int> last_writer;            // by slot: the statement, or -1
+    vector<vector<int>> readers;        // by slot: since the last write
+    int barrier = -1;                   // the last statement using the Sheet
+    vector<int> since;                  // the statements after it
+    for (size_t i = 0; i < block.size(); ++i) {
+        if (block[i].kind != Batch_statement::value) continue;
+        auto wait_for = [&](int j) {
+            if (j < 0) return;
+            block[j].after.push_back(i);
+            ++block[i].waiting;
+        };
+        wait_for(barrier);
+        Code_use u = code_use(block[i].code);
+        if (u.sheet) {
+            // an update may recompute any formula: this one runs on its own
+            for (int j : since) wait_for(j);
+            barrier = i;
+            since.clear();
+            continue;
+        }
+        since.push_back(i);
+        for (const vector<int>* v : { &u.reads, &u.writes })
+            if (!v->empty() && size_t(v->back()) >= last_writer.size()) {
+                last_writer.resize(v->back() + 1, -1);
+                readers.resize(v->back() + 1);
+            }
+        for (int s : u.reads) wait_for(last_writer[s]);
+        for (int s : u.writes) {
+            wait_for(last_writer[s]);
+            for (int j : readers[s]) wait_for(j);
+        }
+        for (int s : u.reads) readers[s].push_back(i);
+        for (int s : u.writes) {
+            last_writer[s] = i;
+            readers[s].clear();
+        }
+    }
+}
+
+void run_statement(Calculator& calc, Batch_statement& s, Format f)
+{
+    Output_buffer out;          // in memory
+    try {
+        s.result = calc.execute(s.code);
+        put_result(out, s.result, f, s.digits);
+        s.ok = true;
+    }
+    catch(exception& e) {
+        out.put(error_line(s.line, e));
+    }
+    s.output = out.take();
+    s.code = Code{};            // done with it
+}
+
+int run_block(Calculator& calc, vector<Batch_statement>& block, Format f, int jobs, Output_buffer& out)
+    // returns the number of statements that failed
+{
+    mutex m;
+    condition_variable work;    // for the workers: something is ready
+    condition_variable done;    // for us: a statement is finished
+    deque<int> ready;
+    int left = 0;               // value statements not yet run
+    for (size_t i = 0; i < block.size(); ++i) {
+        if (block[i].kind != Batch_statement::value) continue;
+        ++left;
+        if (block[i].waiting == 0) ready.push_back(i);
+    }
+
+    auto worker = [&] {
+        unique_lock<mutex> held(m);
+        while (true) {
+            work.wait(held, [&] { return !ready.empty() || left == 0; });
+            if (ready.empty()) return;
+            int i = ready.front();
+            ready.pop_front();
+            held.unlock();
+            run_statement(calc, block[i], f);
+            held.lock();
+            block[i].finished = true;
+            --left;
+            for (int j : block[i].after)
+                if (--block[j].waiting == 0) {
+                    ready.push_back(j);
+                    work.notify_one();
+                }
+            if (left == 0) work.notify_all();
+            done.notify_one();
+        }
+    };
+    vector<thread> pool;
+    for (int k = 0; k < jobs; ++k) pool.emplace_back(worker);
+
+    int errors = 0;
+    for (Batch_statement& s : block) {
+        switch (s.kind) {
+            case Batch_statement::value:
+            {
+                unique_lock<mutex> held(m);
+                done.wait(held, [&] { return s.finished; });
+                held.unlock();
+                out.put(s.output);
+                if (s.ok) calc.last_result = move(s.result);
+                else ++errors;
+                break;
+            }
+            case Batch_statement::save:
+                try {
+                    save_value(s.text, calc.last_result);
+                }
+                catch(exception& e) {
+                    ++errors;
+                    out.put(error_line(s.line, e));
+                }
+                break;
+            case Batch_statement::note:
+                ++errors;               // only errors are noted
+                out.put(s.text);
+                break;
+        }
+        s.output = string{};
+    }
+    for (thread& t : pool) t.join();
+    return errors;
+}
+
+int parallel_batch(Calculator& calc, Output_buffer& out, Format f, int jobs)
+    // returns the number of statements that failed
+{
+    int errors = 0;
+    bool more = true;
+    while (more) {
+        vector<Batch_statement> block;
+        more = read_block(calc, block);
+        link_block(block);
+        errors += run_block(calc, block, f, jobs, out);
+        if (!block.empty() && block.back().rest_of_line && !block.back().ok)
+            calc.clean_up_mess();       // what batch() does after an error
+    }
+    return errors;
+}
+
+int batch(Calculator& calc, const string& in, const string& out_name, Format f, int jobs)
+    // returns the number of statements that failed
+{
+    Token_stream& ts = calc.ts;
+    return batch_files(ts, in, out_name, [&](Output_buffer& out) {
+        if (jobs > 1) return parallel_batch(calc, out, f, jobs);
+        return batch_statements(ts, out, [&](int& line) {
+            Token t = ts.get();
+            while (t.kind == print) t = ts.get();
+            line = ts.line();
+            if (t.kind == quit) return false;
+            else if (t.kind == digitscmd) calc.set_digits();
+            else if (t.kind == savecmd) calc.save_result();
+            else if (t.kind == sheetcmd) calc.set_spreadsheet();
+            else if (t.kind == precisioncmd) calc.set_precision();
+            else if (t.kind == defcmd) calc.def_function();
+            else if (t.kind != help) {          // no help in batch mode
+                ts.putback(t);
+                Code code = calc.statement();
+                calc.last_result = calc.execute(code);
+                put_result(out, calc.last_result, f, calc.digits_format);
+            }
+            return true;
+        }, [&] { calc.clean_up_mess(); });
+    });
+}
+
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+/*  Server mode:  qc --serve /tmp/qc.sock [--workers N] [--exact | --decimal]
+
+    See server.h.  Each connection gets a Calculator of its own, set up the
+    way calculate() is (digits 1000), and each line it sends is answered the
+    way calculate() would print it.  Clients may not save to files.
+*/
+
+string answer(Calculator& calc, const string& line, Format f)
+{
+    Output_buffer out;          // in memory
+    try {
+        Rational r = calc.evaluate(line);
+        out.put(result);
+        put_result(out, r, f, calc.digits_format);
+    }
+    catch(exception& e) {
+        out.put(string("error: ") + e.what() + '\n');
+    }
+    return out.take();
+}
+
+void serve(const string& path, int workers, Format f)
+{
+    serve_calculators<Calculator>(path, workers,
+        [f](Calculator& calc, const string& line) { return answer(calc, line, f); },
+        [](Calculator& calc) {
+            calc.digits_format = Digits_format{Digits_mode::ends, 1000};
+            calc.allow_save = false;
+        });
 }
 
 
-int main()
+int main(int argc, char* argv[])
 try {
    //st.declare("pi", 4*atan(1), true);       // hardcoded constants
    //st.declare("e", 2.7182818284, true);
 
+   string in;
+   string out = "-";
+   string socket_path;
+   int workers = worker_count();
+   int jobs = 1;           // for --batch: sequential
+   Format format = Format::both;
+   for (int i = 1; i < argc; ++i) {
+       string arg = argv[i];
+       if (arg == "--batch" && i+1 < argc) in = argv[++i];
+       else if (arg == "--out" && i+1 < argc) out = argv[++i];
+       else if (arg == "--serve" && i+1 < argc) socket_path = argv[++i];
+       else if (arg == "--workers" && i+1 < argc) workers = stoi(argv[++i]);
+       else if (arg == "--jobs" && i+1 < argc) jobs = stoi(argv[++i]);
+       else if (arg == "--exact") format = Format::exact;
+       else if (arg == "--decimal") format = Format::decimal;
+       else error("usage: qc [--batch in.txt [--out results.txt] [--jobs n] | --serve socket [--workers n]]"
+                  " [--exact | --decimal]");
+   }
+   if (!socket_path.empty()) {
+       serve(socket_path, workers, format);
+       return 0;
+   }
+   Calculator calc;
+   if (!in.empty()) return batch(calc, in, out, format, jobs) ? 1 : 0;
+
+   calc.digits_format = Digits_format{Digits_mode::ends, 1000};    // a screenful, not a million digits
+   calc.ts.from_fd(0);          // standard input
    cout << "Probability Calculator with Rational Numbers\n"
         << "(type ? for help)\n\n";
 
-   calculate();
+   calculate(calc);
    // keep_window_open();  // cope with Windows console mode
    return 0;
 }
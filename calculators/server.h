@@ -0,0 +1,407 @@
+/*
+   server.h
+
+   qc --serve path and count --serve path: the calculator as a daemon on a
+   Unix-domain socket, so that a client connects once and asks as many
+   questions as it likes instead of starting a process for each one.
+
+   The protocol is lines of text.  Each line the client sends is run as
+   statements (Calculator::evaluate()) and answered with one line:
+       = 25/12 = 2.08333        or        error: divide by zero
+   Blank lines get no answer.  The line "history" is answered with
+   "history: N" and the N lines evaluated so far, one per line.
+
+   Every connection is a session with a Calculator of its own (variables,
+   digits format, last result) and its history; sessions never see each
+   other.  One thread runs an epoll loop that does all the socket I/O; the
+   statements are run by a pool of worker threads, so one slow factorial
+   holds up only its own session.  The lines of one session are run one at
+   a time, in order.  SIGINT or SIGTERM stops the server and removes the
+   socket; a statement still running gives up at its next budget check
+   (see budget.h) rather than holding up the shutdown.
+
+   Calc is the calculator class, Handler turns a line into its answer and
+   Setup gets each new session ready, so the server knows nothing about
+   Integers or Rationals:
+       serve_calculators<Calculator>(path, workers,
+           [](Calculator& c, const string& line) { return ...; },
+           [](Calculator& c) { ... });
+   (They are template parameters rather than std::function: <functional>
+   does not survive std_lib_facilities.h's "#define vector Vector".)
+*/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "std_lib_facilities.h"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "budget.h"
+
+template<class Calc, class Handler, class Setup>
+class Calc_server {
+public:
+    // handle(calc, line) is the answer to line, '\n' included;
+    // setup(calc) is called for each new session
+    Calc_server(const string& path, Handler h, Setup s)
+        : socket_path{path}, handle{h}, setup{s} { }
+    ~Calc_server() { shut_down(); }
+    Calc_server(const Calc_server&) = delete;
+    Calc_server& operator=(const Calc_server&) = delete;
+
+    void run(int workers);      // until SIGINT or SIGTERM
+
+    static const size_t max_line = 1 << 24;     // a client that sends more is dropped
+
+private:
+    struct Session {
+        explicit Session(int f) : fd{f} { }
+        int fd;
+        Calc calc;
+        vector<string> history;
+        string in;                  // read, not yet a whole line
+        string out;                 // answers not yet written
+        deque<string> pending;      // whole lines waiting their turn
+        bool busy { false };        // is a worker running one of our lines?
+        bool closing { false };     // the client hung up (or misbehaved)
+        uint32_t events { 0 };      // what epoll is watching for (0: fd not in epoll)
+    };
+    struct Job {
+        long id;
+        Session* session;           // stays put while it is busy
+        string line;
+        string answer;
+    };
+
+    string socket_path;
+    Handler handle;
+    Setup setup;
+
+    int listen_fd { -1 };
+    int epoll_fd { -1 };
+    int done_fd { -1 };             // eventfd: the workers have finished jobs
+    int signal_fd { -1 };
+    unordered_map<long, unique_ptr<Session>> sessions;   // by id, not fd: fds are reused
+    unordered_map<int, long> by_fd;
+    long next_id { 1 };
+
+    // the worker pool: jobs go in through todo, come back through done
+    mutex jobs_lock;
+    condition_variable jobs_ready;
+    deque<Job> todo;
+    deque<Job> done;
+    bool stopping { false };
+    atomic<bool> stop_statements { false };     // what the workers run gives up
+    vector<thread> pool;
+
+    void open_socket();
+    void watch(int fd, uint32_t events, bool add);
+    void watch(Session& s, uint32_t events);
+    void accept_clients();
+    void read_client(long id);
+    void write_client(long id);
+    void dispatch(long id);
+    void finish_jobs();
+    void close_session(long id);
+    void work();
+    void shut_down();
+};
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+
+template<class Calc, class Handler, class Setup>
+void Calc_server<Calc, Handler, Setup>::open_socket()
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) error("socket path too long: ", socket_path);
+    strcpy(addr.sun_path, socket_path.c_str());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) error("can't create socket");
+    unlink(socket_path.c_str());        // left over from a server that died
+    if (bind(listen_fd, (sockaddr*)&addr, sizeof addr) < 0)
+        error("can't bind socket ", socket_path);
+    if (listen(listen_fd, SOMAXCONN) < 0) error("can't listen on ", socket_path);
+}
+
+template<class Calc, class Handler, class Setup>
+void Calc_server<Calc, Handler, Setup>::watch(int fd, uint32_t events, bool add)
+{
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev) < 0)
+        error("epoll_ctl failed");
+}
+
+template<class Calc, class Handler, class Setup>
+void Calc_server<Calc, Handler, Setup>::watch(Session& s, uint32_t events)
+    // a session that waits for nothing is taken out of epoll, or it would
+    // keep reporting the hangup of a client whose answer is still running
+{
+    if (events == s.events) return;
+    if (events == 0) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s.fd, nullptr);
+    else watch(s.fd, events, s.events == 0);
+    s.events = events;
+}
+
+template<class Calc, class Handler, class Setup>
+void Calc_server<Calc, Handler, Setup>::run(int workers)
+{
+    // SIGINT and SIGTERM come in through signal_fd (the workers inherit the mask)
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    open_socket();
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (epoll_fd < 0 || done_fd < 0 || signal_fd < 0) error("can't set up the event loop");
+    watch(listen_fd, EPOLLIN, true);
+    watch(done_fd, EPOLLIN, true);
+    watch(signal_fd, EPOLLIN, true);
+
+    for (int i = 0; i < max(workers, 1); ++i) pool.emplace_back([this] { work(); });
+
+    vector<epoll_event> events(64);
+    while (true) {
+        int n = epoll_wait(epoll_fd, events.data(), events.size(), -1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) error("epoll_wait failed");
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == signal_fd) return;            // the destructor cleans up
+            if (fd == listen_fd) accept_clients();
+            else if (fd == done_fd) finish_jobs();
+            else {
+                auto p = by_fd.find(fd);
+                if (p == by_fd.end()) continue;     // closed by an earlier event
+                long id = p->second;
+                if (events[i].events & EPOLLOUT) write_client(id);
+                if (sessions.count(id) && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                    read_client(id);
+            }
+        }
+    }
+}
+
+template<class Calc, class Handler, class Setup>
+void Calc_server<Calc, Handler, Setup>::accept_clients()
+{
+    while (true) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;         // EAGAIN: no more for now
+        long id = next_id++;
+        unique_ptr<Session> s{new Session(fd)};
+        setup(s->calc);
+        watch(*s, EPOLLIN);
+        sessions[id] = move(s);
+        by_fd[fd] = id;
+    }
+}
+
+template<class Calc, class Handler, class Setup>
+void Calc_server<Calc, Handler, Setup>::read_client(long id)
+{
+    Session& s = *sessions[id];
+    char buf[1 << 16];
+    while (!s.closing) {
+        ssize_t got = read(s.fd, buf, sizeof buf);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (got <= 0) {             // end of input (or an error): answer what we have
+            s.closing = true;
+            break;
+        }
+        s.in.append(buf, got);
+        size_t start = 0;
+        for (size_t nl; (nl = s.in.find('\n', start)) != string::npos; start = nl + 1) {
+            string line = s.in.substr(start, nl - start);
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.find_first_not_of(" \t") != string::npos) s.pending.push_back(move(line));
+        }
+        s.in.erase(0, start);
+        if (s.in.size() > max_line) {
+            s.out += "error: line too long\n";
+            s.pending.clear();
+            s.closing = true;
+        }
+    }
+    if (s.closing) {
+        if (!s.in.empty() && s.in.find_first_not_of(" \t\r") != string::npos)
+            s.pending.push_back(s.in);     // a last line without its '\n'
+        s.in.clear();
+        shutdown(s.fd, SHUT_RD);
+        watch(s, 0);                        // no more reading; write_client() decides
+    }
+    dispatch(id);
+}
+
+template<class Calc, class Handler, class Setup>
+void Calc_server<Calc, Handler, Setup>::dispatch(long id)
+    // start the next line of session id, if it has one and nothing is running
+{
+    Session& s = *sessions[id];
+    while (!s.busy && !s.pending.empty()) {
+        string line = move(s.pending.front());
+        s.pending.pop_front();
+        if (line == "history") {            // no need for a worker
+            s.out += "history: " + to_string(s.history.size()) + '\n';
+            for (const string& h : s.history) s.out += h + '\n';
+            continue;
+        }
+        s.history.push_back(line);
+        s.busy = true;
+        {
+            lock_guard<mutex> held(jobs_lock);
+            todo.push_back(Job{id, &s, move(line), ""});
+        }
+        jobs_ready.notify_one();
+    }
+    write_client(id);
+}
+
+template<class Calc, class Handler, class Setup>
+void Calc_server<Calc, Handler, Setup>::write_client(long id)
+{
+    Session& s = *sessions[id];
+    size_t sent = 0;
+    while (sent < s.out.size()) {
+        ssize_t w = send(s.fd, s.out.data() + sent, s.out.size() - sent, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (w < 0) {                    // the client is gone
+            s.out.clear();
+            sent = 0;
+            s.pending.clear();
+            s.closing = true;
+            break;
+        }
+        sent += w;
+    }
+    s.out.erase(0, sent);
+    if (s.closing && s.out.empty() && s.pending.empty() && !s.busy) {
+        close_session(id);
+        return;
+    }
+    // wait for room in the socket if there is more to send
+    uint32_t want = 0;
+    if (!s.closing) want |= EPOLLIN;
+    if (!s.out.empty()) want |= EPOLLOUT;
+    watch(s, want);
+}
+
+template<class Calc, class Handler, class Setup>
+void Calc_server<Calc, Handler, Setup>::close_session(long id)
+{
+    auto p = sessions.find(id);
+    if (p == sessions.end()) return;
+    int fd = p->second->fd;
+    watch(*p->second, 0);
+    close(fd);
+    by_fd.erase(fd);
+    sessions.erase(p);
+}
+
+template<class Calc, class Handler, class Setup>
+void Calc_server<Calc, Handler, Setup>::finish_jobs()
+    // the workers' answers: hand them to their sessions and start the next lines
+{
+    uint64_t count;
+    while (read(done_fd, &count, sizeof count) > 0) { }
+    deque<Job> finished;
+    {
+        lock_guard<mutex> held(jobs_lock);
+        finished.swap(done);
+    }
+    for (Job& j : finished) {
+        auto p = sessions.find(j.id);
+        if (p == sessions.end()) continue;
+        p->second->out += j.answer;
+        p->second->busy = false;
+        dispatch(j.id);
+    }
+}
+
+template<class Calc, class Handler, class Setup>
+void Calc_server<Calc, Handler, Setup>::work()
+    // a worker thread: run lines until the server stops
+{
+    budget_state().stop = &stop_statements;
+    while (true) {
+        Job j;
+        {
+            unique_lock<mutex> held(jobs_lock);
+            jobs_ready.wait(held, [this] { return stopping || !todo.empty(); });
+            if (stopping) return;
+            j = move(todo.front());
+            todo.pop_front();
+        }
+        try {
+            j.answer = handle(j.session->calc, j.line);
+        }
+        catch (...) {
+            j.answer = "error: exception\n";
+        }
+        {
+            lock_guard<mutex> held(jobs_lock);
+            done.push_back(move(j));
+        }
+        uint64_t one = 1;
+        ssize_t w = write(done_fd, &one, sizeof one);
+        (void)w;
+    }
+}
+
+template<class Calc, class Handler, class Setup>
+void Calc_server<Calc, Handler, Setup>::shut_down()
+{
+    {
+        lock_guard<mutex> held(jobs_lock);
+        stopping = true;
+    }
+    stop_statements = true;             // a worker in a long statement stops soon
+    jobs_ready.notify_all();
+    for (thread& t : pool) t.join();
+    pool.clear();
+    for (auto& p : sessions) close(p.second->fd);
+    sessions.clear();
+    by_fd.clear();
+    for (int* fd : { &listen_fd, &epoll_fd, &done_fd, &signal_fd })
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+    if (!socket_path.empty()) unlink(socket_path.c_str());
+    socket_path.clear();
+}
+
+template<class Calc, class Handler, class Setup>
+void serve_calculators(const string& path, int workers, Handler h, Setup s)
+    // until SIGINT or SIGTERM
+{
+    Calc_server<Calc, Handler, Setup> server{path, h, s};
+    server.run(workers);
+}
+
+#endif // SERVER_H
@@ -0,0 +1,159 @@
+/*
+   symbol_table.h
+
+   The variables of the calculators, shared by hc, count, count2 and qc:
+   Basic_symbol_table<double>, <Integer>, <Lazy_integer> or <Rational>.
+
+   Variables used to be found by walking var_table and comparing names, which
+   made every lookup (and every "let") linear in the number of variables.
+   Now each name is interned once: it gets a "slot", its index in var_table,
+   and an open-addressing hash table (linear probing) maps names to slots.
+   The parser resolves a name to its slot, so get() and set() just index
+   var_table.
+
+   Only what names a variable interns it: let and constant, the parameters
+   of a function, the index of a sum.  A name that is only read goes through
+   find(), so a typo does not take a slot for good.
+*/
+
+#ifndef SYMBOL_TABLE_H
+#define SYMBOL_TABLE_H
+
+#include "std_lib_facilities.h"
+
+template<class T>
+class Basic_variable {
+public:
+    string name;
+    T value;
+    bool constant;
+    bool declared;      // a name gets its slot when first seen, "let" declares it
+    Basic_variable(const string& n, const T& v, bool c = false)
+        : name{n}, value{v}, constant{c}, declared{false} { }
+};
+
+inline unsigned hash_name(const string& s)
+    // FNV-1a
+{
+    unsigned h = 2166136261u;
+    for (char c : s) {
+        h ^= (unsigned char)c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+template<class T>
+class Basic_symbol_table {
+public:
+    using Variable = Basic_variable<T>;
+
+    int slot(const string&);        // find (or intern) the slot of a name
+    int find(const string&) const;  // the slot of a name, -1 if it has none
+    bool is_declared(const string&) const;
+    Variable saved(int s) const { return var_table[s]; }
+    void restore(int s, const Variable& v) { var_table[s] = v; }
+    void bind(int s, const T& val);     // a parameter, or the index of a sum()
+    const T& get(int);
+    T set(int, const T&);
+    T declare(int, const T&, bool con = false);
+    T declare(const string& var, const T& val, bool con = false)
+        { return declare(slot(var), val, con); }
+
+private:
+    vector<Variable> var_table;                   // indexed by slot
+    vector<int> index = vector<int>(64, -1);      // hash buckets: slot or -1
+    void rehash();
+};
+
+template<class T>
+int Basic_symbol_table<T>::slot(const string& var)
+{
+    unsigned mask = index.size() - 1;
+    for (unsigned i = hash_name(var) & mask; ; i = (i+1) & mask) {
+        int s = index[i];
+        if (s < 0) {                    // first time we see var: intern it
+            s = var_table.size();
+            var_table.push_back(Variable{var, T{}});
+            index[i] = s;
+            if (2*var_table.size() > index.size()) rehash();
+            return s;
+        }
+        if (var_table[s].name == var) return s;
+    }
+}
+
+template<class T>
+int Basic_symbol_table<T>::find(const string& var) const
+{
+    unsigned mask = index.size() - 1;
+    for (unsigned i = hash_name(var) & mask; index[i] >= 0; i = (i+1) & mask)
+        if (var_table[index[i]].name == var) return index[i];
+    return -1;
+}
+
+template<class T>
+void Basic_symbol_table<T>::rehash()
+    // keep the hash table at most half full
+{
+    index.assign(2*index.size(), -1);
+    unsigned mask = index.size() - 1;
+    for (size_t s = 0; s < var_table.size(); ++s) {
+        unsigned i = hash_name(var_table[s].name) & mask;
+        while (index[i] >= 0) i = (i+1) & mask;
+        index[i] = s;
+    }
+}
+
+template<class T>
+bool Basic_symbol_table<T>::is_declared(const string& var) const
+    // is var already in var_table?
+{
+    int s = find(var);
+    return s >= 0 && var_table[s].declared;
+}
+
+template<class T>
+const T& Basic_symbol_table<T>::get(int s)
+    // return the value of the Variable in slot s
+{
+    const Variable& v = var_table[s];
+    if (!v.declared) error("get: undefined variable ", v.name);
+    return v.value;
+}
+
+template<class T>
+T Basic_symbol_table<T>::set(int s, const T& d)
+    // set the Variable in slot s to d
+{
+    Variable& v = var_table[s];
+    if (!v.declared) error("set: undefined variable ", v.name);
+    if (v.constant) error("Can't overwrite constant variable");
+    v.value = d;
+    return d;
+}
+
+template<class T>
+T Basic_symbol_table<T>::declare(int s, const T& val, bool con)
+    // give the Variable in slot s its first value
+{
+    Variable& v = var_table[s];
+    if (v.declared) error(v.name, " declared twice");
+    v.value = val;
+    v.constant = con;
+    v.declared = true;
+    return val;
+}
+
+template<class T>
+void Basic_symbol_table<T>::bind(int s, const T& val)
+    // give the Variable in slot s a value, declared or not, constant or not;
+    // the caller puts the old one back with restore()
+{
+    Variable& v = var_table[s];
+    v.value = val;
+    v.constant = false;
+    v.declared = true;
+}
+
+#endif // SYMBOL_TABLE_H